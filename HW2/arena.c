@@ -0,0 +1,188 @@
+/* A bump arena for the temporary memory of the loader.
+ *
+ * Allocations are carved out of large blocks by bumping an offset, and free
+ * only counts them. Once nothing is live anymore, which happens at the end of
+ * every load, the arena starts over from the beginning of its memory. If a
+ * load needed more than one block, they are replaced by a single block of
+ * their combined size, so loading similar images through one arena settles
+ * on one block and no calls to malloc at all.
+ *
+ * Bands of an image are inflated on several threads, which allocate from the
+ * same arena, so it is guarded by a mutex. Keeping one arena per thread keeps
+ * it uncontended.
+ */
+#include "arena.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+
+// The first block of an arena holds a decoder and its inflate window
+#define PNG_ARENA_BLOCK_SIZE (64 * 1024)
+#define PNG_ARENA_ALIGN _Alignof(max_align_t)
+
+struct png_arena_block {
+  struct png_arena_block *next;
+  size_t size;
+  size_t used;
+  _Alignas(max_align_t) uint8_t data[];
+};
+
+struct png_arena {
+  pthread_mutex_t lock;
+  struct png_arena_block *blocks; // The newest block comes first
+  size_t block_size;              // Size of the next block
+  size_t live;                    // Allocations that were not freed yet
+};
+
+void *alloc_png_memory(const struct png_allocator *allocator, size_t size) {
+  if (!allocator) {
+    return malloc(size);
+  }
+
+  return allocator->alloc(allocator->arg, size);
+}
+
+void free_png_memory(const struct png_allocator *allocator, void *ptr) {
+  if (!ptr) {
+    return;
+  }
+
+  if (!allocator) {
+    free(ptr);
+    return;
+  }
+
+  allocator->free(allocator->arg, ptr);
+}
+
+void *resize_png_memory(const struct png_allocator *allocator, void *ptr,
+                        size_t old_size, size_t new_size) {
+  uint8_t *resized;
+
+  if (!allocator) {
+    return realloc(ptr, new_size);
+  }
+
+  resized = allocator->alloc(allocator->arg, new_size);
+  if (!resized) {
+    return NULL;
+  }
+
+  if (ptr) {
+    memcpy(resized, ptr, old_size < new_size ? old_size : new_size);
+    allocator->free(allocator->arg, ptr);
+  }
+
+  return resized;
+}
+
+/* Go back to the beginning of the arena. Several blocks are merged into one
+ * that is large enough for all of them. */
+void rewind_png_arena(struct png_arena *arena) {
+  struct png_arena_block *block = arena->blocks;
+
+  if (block && !block->next) {
+    block->used = 0;
+    return;
+  }
+
+  arena->block_size = 0;
+  while (block) {
+    struct png_arena_block *next = block->next;
+
+    arena->block_size += block->size;
+    free(block);
+    block = next;
+  }
+  arena->blocks = NULL;
+}
+
+void *alloc_png_arena(void *arg, size_t size) {
+  struct png_arena *arena = arg;
+  struct png_arena_block *block;
+  void *ptr = NULL;
+
+  // Every allocation starts suitably aligned for any type
+  size = (size + PNG_ARENA_ALIGN - 1) & ~(PNG_ARENA_ALIGN - 1);
+
+  pthread_mutex_lock(&arena->lock);
+
+  block = arena->blocks;
+  if (!block || block->size - block->used < size) {
+    size_t block_size = arena->block_size;
+
+    while (block_size < size) {
+      block_size *= 2;
+    }
+
+    block = malloc(sizeof(struct png_arena_block) + block_size);
+    if (!block) {
+      goto out;
+    }
+
+    block->next = arena->blocks;
+    block->size = block_size;
+    block->used = 0;
+    arena->blocks = block;
+    arena->block_size = 2 * block_size;
+  }
+
+  ptr = block->data + block->used;
+  block->used += size;
+  arena->live++;
+
+out:
+  pthread_mutex_unlock(&arena->lock);
+  return ptr;
+}
+
+void free_png_arena(void *arg, void *ptr) {
+  struct png_arena *arena = arg;
+
+  (void)ptr;
+
+  pthread_mutex_lock(&arena->lock);
+  if (!--arena->live) {
+    rewind_png_arena(arena);
+  }
+  pthread_mutex_unlock(&arena->lock);
+}
+
+struct png_arena *png_arena_create(void) {
+  struct png_arena *arena = malloc(sizeof(struct png_arena));
+
+  if (!arena) {
+    return NULL;
+  }
+
+  pthread_mutex_init(&arena->lock, NULL);
+  arena->blocks = NULL;
+  arena->block_size = PNG_ARENA_BLOCK_SIZE;
+  arena->live = 0;
+  return arena;
+}
+
+struct png_allocator png_arena_allocator(struct png_arena *arena) {
+  struct png_allocator allocator = {alloc_png_arena, free_png_arena, arena};
+
+  return allocator;
+}
+
+void png_arena_destroy(struct png_arena *arena) {
+  struct png_arena_block *block;
+
+  if (!arena) {
+    return;
+  }
+
+  block = arena->blocks;
+  while (block) {
+    struct png_arena_block *next = block->next;
+
+    free(block);
+    block = next;
+  }
+
+  pthread_mutex_destroy(&arena->lock);
+  free(arena);
+}
@@ -0,0 +1,17 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "pngparser.h"
+
+/* Temporary memory of the loader. Every allocation goes through the
+ * allocator that the load was started with, or through malloc and free if
+ * allocator is NULL. */
+void *alloc_png_memory(const struct png_allocator *allocator, size_t size);
+void free_png_memory(const struct png_allocator *allocator, void *ptr);
+
+/* Grow an allocation of old_size bytes to new_size bytes, keeping its
+ * contents. Returns NULL, and leaves ptr alone, on failure. */
+void *resize_png_memory(const struct png_allocator *allocator, void *ptr,
+                        size_t old_size, size_t new_size);
+
+#endif
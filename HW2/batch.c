@@ -0,0 +1,557 @@
+/* Loading many small PNGs at once.
+ *
+ * For small files, the blocking open, stat, read and close calls cost more
+ * than decoding. The calling thread keeps up to PNG_BATCH_FILES_IN_FLIGHT
+ * files in flight on an io_uring instead: every file is stat'ed, opened, read
+ * whole with a readahead hint in front, and closed, all without waiting on
+ * any single request. Files that have been read are handed to a
+ * pool of decoding threads through a queue.
+ *
+ * If the kernel does not let us use io_uring, or lacks the requests we need,
+ * the calling thread reads the files with plain system calls, still in
+ * parallel with the decoding. Files that cannot be read whole up front, such
+ * as pipes, or whose requests fail, are left to the decoding threads, which
+ * load them by path like load_png does.
+ */
+#define _GNU_SOURCE
+#include "pngparser.h"
+#include "uring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Files that are being opened or read at the same time
+#define PNG_BATCH_FILES_IN_FLIGHT 64
+// Files that have been read, but not decoded yet, are limited as well
+#define PNG_BATCH_MAX_BUFFERS (4 * PNG_BATCH_FILES_IN_FLIGHT)
+#define PNG_BATCH_RING_ENTRIES (4 * PNG_BATCH_FILES_IN_FLIGHT)
+#define PNG_BATCH_MAX_THREADS 64
+
+// What a completion belongs to: the slot of the file and the request
+#define PNG_BATCH_OP_OPEN 0
+#define PNG_BATCH_OP_STAT 1
+#define PNG_BATCH_OP_READ 2
+#define PNG_BATCH_OP_OTHER 3
+
+// The requests the ring is used for, which kernels before 5.6 lack
+static const uint8_t png_batch_ops[] = {IORING_OP_OPENAT, IORING_OP_STATX,
+                                        IORING_OP_FADVISE, IORING_OP_READ,
+                                        IORING_OP_CLOSE};
+
+/* A file that is being read */
+struct png_batch_slot {
+  size_t index;
+  const char *path;
+  int fd;
+  int pending; // Requests that have not completed yet
+  int failed;
+  struct statx stat;
+  uint8_t *data;
+  size_t length;
+  size_t read;
+};
+
+/* The files on the ring. Requests whose completion does not matter (hints
+ * and closes) are only counted, so we can wait for them at the end. */
+struct png_batch_ring {
+  struct uring ring;
+  struct png_batch_slot slots[PNG_BATCH_FILES_IN_FLIGHT];
+  size_t free_slots[PNG_BATCH_FILES_IN_FLIGHT];
+  size_t free_count;
+  size_t others;
+};
+
+/* Files that have been read, waiting for a decoding thread */
+struct png_batch_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;   // Signalled when a file is queued or input ends
+  pthread_cond_t drained; // Signalled when a buffer is released
+
+  size_t *indices;
+  uint8_t **data;
+  size_t *lengths;
+  size_t head;
+  size_t tail;
+  size_t buffers; // Buffers read and not yet released
+  int done;       // No more files will be queued
+
+  const char **paths;
+  struct image **imgs;
+  int failed;
+};
+
+/* Hand a file that has been read to the decoding threads. A NULL data marks a
+ * file that could not be read here, which the decoding thread loads by path. */
+void queue_png_file(struct png_batch_queue *queue, size_t index,
+                    uint8_t *data, size_t length) {
+  pthread_mutex_lock(&queue->lock);
+  queue->indices[queue->tail] = index;
+  queue->data[queue->tail] = data;
+  queue->lengths[queue->tail] = length;
+  queue->tail++;
+  pthread_cond_signal(&queue->ready);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/* Wait until another buffer may be allocated */
+void reserve_png_buffer(struct png_batch_queue *queue) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->buffers >= PNG_BATCH_MAX_BUFFERS) {
+    pthread_cond_wait(&queue->drained, &queue->lock);
+  }
+  queue->buffers++;
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/* Can another buffer be allocated right away? */
+int try_reserve_png_buffer(struct png_batch_queue *queue) {
+  int reserved = 0;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->buffers < PNG_BATCH_MAX_BUFFERS) {
+    queue->buffers++;
+    reserved = 1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return reserved;
+}
+
+void release_png_buffer_slot(struct png_batch_queue *queue) {
+  pthread_mutex_lock(&queue->lock);
+  queue->buffers--;
+  pthread_cond_signal(&queue->drained);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/* Every worker loads its images through a codec context of its own, which
+ * they all reuse: after the first image, the inflate state is only reset and
+ * temporary memory costs no malloc and no lock that other workers contend
+ * for. */
+void *run_png_decode_worker(void *arg) {
+  struct png_batch_queue *queue = arg;
+  struct png_load_opts opts = {0};
+
+  opts.ctx = png_codec_ctx_create();
+
+  for (;;) {
+    size_t index, length;
+    uint8_t *data;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->head == queue->tail && !queue->done) {
+      pthread_cond_wait(&queue->ready, &queue->lock);
+    }
+
+    if (queue->head == queue->tail) {
+      pthread_mutex_unlock(&queue->lock);
+      png_codec_ctx_destroy(opts.ctx);
+      return NULL;
+    }
+
+    index = queue->indices[queue->head];
+    data = queue->data[queue->head];
+    length = queue->lengths[queue->head];
+    queue->head++;
+    pthread_mutex_unlock(&queue->lock);
+
+    if (data ? load_png_mem_ex(data, length, &queue->imgs[index], &opts)
+             : load_png_ex(queue->paths[index], &queue->imgs[index], &opts)) {
+      queue->imgs[index] = NULL;
+      __atomic_store_n(&queue->failed, 1, __ATOMIC_RELAXED);
+    }
+
+    if (data) {
+      free(data);
+      release_png_buffer_slot(queue);
+    }
+  }
+}
+
+/* Read a whole file with plain system calls */
+uint8_t *read_png_file(const char *path, size_t *length) {
+  struct stat st;
+  uint8_t *data = NULL;
+  size_t have = 0;
+  int fd;
+
+  // Opening a pipe would take data from the one that reads it later
+  if (stat(path, &st) || !S_ISREG(st.st_mode) || !st.st_size) {
+    return NULL;
+  }
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  data = malloc(st.st_size);
+  if (!data) {
+    goto error;
+  }
+
+  while (have < (size_t)st.st_size) {
+    ssize_t ret = read(fd, data + have, st.st_size - have);
+    if (ret <= 0) {
+      goto error;
+    }
+    have += ret;
+  }
+
+  close(fd);
+  *length = have;
+  return data;
+
+error:
+  free(data);
+  close(fd);
+  return NULL;
+}
+
+void read_png_files_blocking(const char **paths, size_t first, size_t n,
+                             struct png_batch_queue *queue) {
+  for (size_t idx = first; idx < n; idx++) {
+    size_t length;
+    uint8_t *data;
+
+    reserve_png_buffer(queue);
+    data = read_png_file(paths[idx], &length);
+
+    if (!data) {
+      release_png_buffer_slot(queue);
+    }
+    queue_png_file(queue, idx, data, length);
+  }
+}
+
+static uint64_t get_png_batch_tag(size_t slot, int op) {
+  return (uint64_t)slot << 2 | op;
+}
+
+/* Queue the read of the rest of a file, behind a hint that we are about to
+ * read all of it */
+int queue_png_file_read(struct png_batch_ring *batch, size_t slot_idx) {
+  struct png_batch_slot *slot = &batch->slots[slot_idx];
+  struct io_uring_sqe *advise, *read;
+
+  if (get_uring_sq_space(&batch->ring) < 2) {
+    return 1;
+  }
+
+  advise = get_uring_sqe(&batch->ring);
+  advise->opcode = IORING_OP_FADVISE;
+  advise->fd = slot->fd;
+  advise->off = slot->read;
+  advise->len = slot->length - slot->read;
+  advise->fadvise_advice = POSIX_FADV_WILLNEED;
+  // The read is issued after the hint, even if the hint fails
+  advise->flags = IOSQE_IO_HARDLINK;
+  advise->user_data = get_png_batch_tag(slot_idx, PNG_BATCH_OP_OTHER);
+
+  read = get_uring_sqe(&batch->ring);
+  read->opcode = IORING_OP_READ;
+  read->fd = slot->fd;
+  read->addr = (uint64_t)(uintptr_t)(slot->data + slot->read);
+  read->len = slot->length - slot->read;
+  read->off = slot->read;
+  read->user_data = get_png_batch_tag(slot_idx, PNG_BATCH_OP_READ);
+
+  batch->others++;
+  slot->pending++;
+  return 0;
+}
+
+/* Queue the stat of a file */
+int queue_png_file_stat(struct png_batch_ring *batch, size_t slot_idx) {
+  struct png_batch_slot *slot = &batch->slots[slot_idx];
+  struct io_uring_sqe *stat = get_uring_sqe(&batch->ring);
+
+  if (!stat) {
+    return 1;
+  }
+
+  stat->opcode = IORING_OP_STATX;
+  stat->fd = AT_FDCWD;
+  stat->addr = (uint64_t)(uintptr_t)slot->path;
+  stat->len = STATX_TYPE | STATX_SIZE;
+  stat->off = (uint64_t)(uintptr_t)&slot->stat;
+  stat->user_data = get_png_batch_tag(slot_idx, PNG_BATCH_OP_STAT);
+
+  slot->pending = 1;
+  return 0;
+}
+
+/* Queue the open of a file that turned out to be a regular one */
+int queue_png_file_open(struct png_batch_ring *batch, size_t slot_idx) {
+  struct png_batch_slot *slot = &batch->slots[slot_idx];
+  struct io_uring_sqe *open = get_uring_sqe(&batch->ring);
+
+  if (!open) {
+    return 1;
+  }
+
+  open->opcode = IORING_OP_OPENAT;
+  open->fd = AT_FDCWD;
+  open->addr = (uint64_t)(uintptr_t)slot->path;
+  open->open_flags = O_RDONLY;
+  open->user_data = get_png_batch_tag(slot_idx, PNG_BATCH_OP_OPEN);
+
+  slot->pending = 1;
+  return 0;
+}
+
+/* Close the file of a slot without waiting for it */
+void queue_png_file_close(struct png_batch_ring *batch, size_t slot_idx) {
+  struct png_batch_slot *slot = &batch->slots[slot_idx];
+  struct io_uring_sqe *sqe = get_uring_sqe(&batch->ring);
+
+  if (!sqe) {
+    close(slot->fd);
+    return;
+  }
+
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = slot->fd;
+  sqe->user_data = get_png_batch_tag(slot_idx, PNG_BATCH_OP_OTHER);
+  batch->others++;
+}
+
+/* Move a file on after one of its requests completed. Returns 1 once the file
+ * is done and its slot is free again. */
+int advance_png_batch_slot(struct png_batch_ring *batch, size_t slot_idx,
+                           int op, int res, struct png_batch_queue *queue) {
+  struct png_batch_slot *slot = &batch->slots[slot_idx];
+
+  switch (op) {
+  case PNG_BATCH_OP_OPEN:
+    if (res < 0) {
+      slot->failed = 1;
+    } else {
+      slot->fd = res;
+    }
+    break;
+  case PNG_BATCH_OP_STAT:
+    if (res < 0 || !S_ISREG(slot->stat.stx_mode) || !slot->stat.stx_size) {
+      slot->failed = 1;
+    }
+    break;
+  case PNG_BATCH_OP_READ:
+    if (res <= 0) {
+      slot->failed = 1;
+    } else {
+      slot->read += res;
+    }
+    break;
+  default:
+    batch->others--;
+    return 0;
+  }
+
+  if (--slot->pending) {
+    return 0;
+  }
+
+  // Only regular files are opened: opening a pipe would take data from the
+  // decoding thread that loads it by path
+  if (!slot->failed && slot->fd < 0) {
+    if (!queue_png_file_open(batch, slot_idx)) {
+      return 0;
+    }
+    slot->failed = 1;
+  }
+
+  // The file is open, read all of it
+  if (!slot->failed && !slot->data) {
+    slot->length = slot->stat.stx_size;
+    slot->data = malloc(slot->length);
+
+    if (slot->data && !queue_png_file_read(batch, slot_idx)) {
+      return 0;
+    }
+    slot->failed = 1;
+  }
+
+  // Short read, ask for the rest
+  if (!slot->failed && slot->read < slot->length) {
+    if (!queue_png_file_read(batch, slot_idx)) {
+      return 0;
+    }
+    slot->failed = 1;
+  }
+
+  if (slot->fd >= 0) {
+    queue_png_file_close(batch, slot_idx);
+  }
+
+  if (slot->failed) {
+    free(slot->data);
+    release_png_buffer_slot(queue);
+    queue_png_file(queue, slot->index, NULL, 0);
+  } else {
+    queue_png_file(queue, slot->index, slot->data, slot->length);
+  }
+
+  return 1;
+}
+
+/* Give up on the files in flight after the ring failed. The kernel may still
+ * write into their buffers, so those are not freed. */
+void fail_png_batch_slots(struct png_batch_ring *batch,
+                          struct png_batch_queue *queue) {
+  int busy[PNG_BATCH_FILES_IN_FLIGHT] = {0};
+
+  for (size_t idx = 0; idx < PNG_BATCH_FILES_IN_FLIGHT; idx++) {
+    busy[idx] = 1;
+  }
+
+  for (size_t idx = 0; idx < batch->free_count; idx++) {
+    busy[batch->free_slots[idx]] = 0;
+  }
+
+  for (size_t idx = 0; idx < PNG_BATCH_FILES_IN_FLIGHT; idx++) {
+    if (busy[idx]) {
+      release_png_buffer_slot(queue);
+      queue_png_file(queue, batch->slots[idx].index, NULL, 0);
+    }
+  }
+}
+
+/* Read the files from *next on through the ring and advance *next past the
+ * files that were started. Returns 0 on success and a non-zero value if the
+ * ring failed. */
+int read_png_files_uring(struct png_batch_ring *batch, const char **paths,
+                         size_t n, size_t *next,
+                         struct png_batch_queue *queue) {
+  struct io_uring_cqe cqe;
+
+  batch->free_count = PNG_BATCH_FILES_IN_FLIGHT;
+  batch->others = 0;
+  for (size_t idx = 0; idx < PNG_BATCH_FILES_IN_FLIGHT; idx++) {
+    batch->free_slots[idx] = idx;
+  }
+
+  while (*next < n || batch->free_count < PNG_BATCH_FILES_IN_FLIGHT ||
+         batch->others) {
+    // Start as many files as there are slots and buffers for
+    while (*next < n && batch->free_count) {
+      size_t slot_idx = batch->free_slots[batch->free_count - 1];
+      struct png_batch_slot *slot = &batch->slots[slot_idx];
+
+      // Without any file in flight, waiting for a buffer cannot deadlock
+      if (batch->free_count == PNG_BATCH_FILES_IN_FLIGHT) {
+        reserve_png_buffer(queue);
+      } else if (!try_reserve_png_buffer(queue)) {
+        break;
+      }
+
+      memset(slot, 0, sizeof(*slot));
+      slot->index = *next;
+      slot->path = paths[*next];
+      slot->fd = -1;
+
+      if (queue_png_file_stat(batch, slot_idx)) {
+        release_png_buffer_slot(queue);
+        break;
+      }
+
+      batch->free_count--;
+      (*next)++;
+    }
+
+    if (submit_uring(&batch->ring, 1)) {
+      fail_png_batch_slots(batch, queue);
+      return 1;
+    }
+
+    while (!reap_uring_cqe(&batch->ring, &cqe)) {
+      size_t slot_idx = cqe.user_data >> 2;
+      int op = cqe.user_data & 3;
+
+      if (advance_png_batch_slot(batch, slot_idx, op, cqe.res, queue)) {
+        batch->free_slots[batch->free_count++] = slot_idx;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* Loads n PNG files, decoding them on all cores while the rest are read */
+int load_png_batch(const char **paths, size_t n, struct image **imgs) {
+  struct png_batch_queue queue;
+  struct png_batch_ring *batch;
+  pthread_t threads[PNG_BATCH_MAX_THREADS];
+  size_t thread_count = 0, next = 0;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int failed = 0;
+
+  for (size_t idx = 0; idx < n; idx++) {
+    imgs[idx] = NULL;
+  }
+
+  memset(&queue, 0, sizeof(queue));
+  queue.paths = paths;
+  queue.imgs = imgs;
+  queue.indices = malloc(sizeof(size_t) * n);
+  queue.data = malloc(sizeof(uint8_t *) * n);
+  queue.lengths = malloc(sizeof(size_t) * n);
+  batch = malloc(sizeof(*batch));
+
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_cond_init(&queue.ready, NULL);
+  pthread_cond_init(&queue.drained, NULL);
+
+  if (queue.indices && queue.data && queue.lengths && batch) {
+    while (thread_count < n && thread_count < (size_t)cores &&
+           thread_count < PNG_BATCH_MAX_THREADS) {
+      if (pthread_create(&threads[thread_count], NULL, run_png_decode_worker,
+                         &queue)) {
+        break;
+      }
+      thread_count++;
+    }
+  }
+
+  // Without a decoding thread, load the files one after the other
+  if (!thread_count) {
+    for (size_t idx = 0; idx < n; idx++) {
+      if (load_png(paths[idx], &imgs[idx])) {
+        imgs[idx] = NULL;
+        failed = 1;
+      }
+    }
+    goto out;
+  }
+
+  if (!setup_uring(&batch->ring, PNG_BATCH_RING_ENTRIES)) {
+    if (has_uring_ops(&batch->ring, png_batch_ops, sizeof(png_batch_ops))) {
+      read_png_files_uring(batch, paths, n, &next, &queue);
+    }
+    close_uring(&batch->ring);
+  }
+
+  // Whatever the ring did not get to is read the plain way
+  read_png_files_blocking(paths, next, n, &queue);
+
+  pthread_mutex_lock(&queue.lock);
+  queue.done = 1;
+  pthread_cond_broadcast(&queue.ready);
+  pthread_mutex_unlock(&queue.lock);
+
+  while (thread_count) {
+    pthread_join(threads[--thread_count], NULL);
+  }
+  failed = queue.failed;
+
+out:
+  pthread_cond_destroy(&queue.drained);
+  pthread_cond_destroy(&queue.ready);
+  pthread_mutex_destroy(&queue.lock);
+  free(queue.indices);
+  free(queue.data);
+  free(queue.lengths);
+  free(batch);
+  return failed;
+}
@@ -0,0 +1,306 @@
+/* Expanding scanlines of every PNG color type into RGBA pixels.
+ *
+ * The 8- and 16-bit layouts map onto struct pixel with a fixed byte shuffle,
+ * which SSSE3 does for a whole register at once. Sub-byte samples go through
+ * a table that turns a byte into all the pixels it holds.
+ */
+#include "expand.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define EXPAND_X86 1
+#include <immintrin.h>
+#endif
+
+/* Does the CPU have SSSE3? Checked once, the first time it matters. */
+static int has_ssse3 = 0;
+static pthread_once_t ssse3_checked = PTHREAD_ONCE_INIT;
+
+static void check_ssse3(void) {
+#ifdef EXPAND_X86
+  __builtin_cpu_init();
+  has_ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+static int use_ssse3(void) {
+  pthread_once(&ssse3_checked, check_ssse3);
+  return has_ssse3;
+}
+
+static inline uint16_t load_be16(const uint8_t *p) { return p[0] << 8 | p[1]; }
+
+void build_expand_table(const struct pixel *lut, uint8_t depth,
+                        struct pixel *table) {
+  uint32_t per_byte = 8 / depth;
+  uint32_t mask = (1 << depth) - 1;
+
+  for (uint32_t byte = 0; byte < 256; byte++) {
+    for (uint32_t j = 0; j < per_byte; j++) {
+      uint32_t shift = 8 - depth * (j + 1);
+      table[byte * per_byte + j] = lut[(byte >> shift) & mask];
+    }
+  }
+}
+
+void expand_packed(const uint8_t *src, struct pixel *dst, uint32_t width,
+                   uint8_t depth, const struct pixel *table) {
+  uint32_t per_byte = 8 / depth;
+  uint32_t whole = width / per_byte;
+  uint32_t idx;
+
+  switch (depth) {
+  case 8:
+    for (idx = 0; idx < width; idx++) {
+      dst[idx] = table[src[idx]];
+    }
+    return;
+  case 4:
+    for (idx = 0; idx < whole; idx++) {
+      memcpy(dst + 2 * idx, table + 2 * src[idx], 2 * sizeof(struct pixel));
+    }
+    break;
+  case 2:
+    for (idx = 0; idx < whole; idx++) {
+      memcpy(dst + 4 * idx, table + 4 * src[idx], 4 * sizeof(struct pixel));
+    }
+    break;
+  default:
+    for (idx = 0; idx < whole; idx++) {
+      memcpy(dst + 8 * idx, table + 8 * src[idx], 8 * sizeof(struct pixel));
+    }
+    break;
+  }
+
+  // The last byte may only be partially used
+  if (whole * per_byte < width) {
+    memcpy(dst + whole * per_byte, table + per_byte * src[whole],
+           (width - whole * per_byte) * sizeof(struct pixel));
+  }
+}
+
+#ifdef EXPAND_X86
+
+/* Clear the alpha of every pixel that equals key, which has an alpha of 0xff */
+__attribute__((target("ssse3"))) static inline __m128i
+key_out_ssse3(__m128i px, __m128i key) {
+  __m128i match = _mm_cmpeq_epi32(px, key);
+  return _mm_andnot_si128(_mm_slli_epi32(match, 24), px);
+}
+
+/* 4 pixels per 12 bytes, reading 16 bytes at a time */
+__attribute__((target("ssse3"))) static uint32_t
+expand_rgb8_ssse3(const uint8_t *src, struct pixel *dst, uint32_t width,
+                  const uint16_t *key) {
+  const __m128i shuffle =
+      _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  const __m128i alpha = _mm_set1_epi32(0xff000000);
+  __m128i key_px = _mm_set1_epi32(-1);
+  uint32_t idx = 0;
+
+  if (key) {
+    key_px = _mm_set1_epi32(0xff000000 | (key[2] & 0xff) << 16 |
+                            (key[1] & 0xff) << 8 | (key[0] & 0xff));
+  }
+
+  for (; idx + 6 <= width; idx += 4) {
+    __m128i in = _mm_loadu_si128((const __m128i *)(src + 3 * idx));
+    __m128i px = _mm_or_si128(_mm_shuffle_epi8(in, shuffle), alpha);
+    if (key) {
+      px = key_out_ssse3(px, key_px);
+    }
+    _mm_storeu_si128((__m128i *)(dst + idx), px);
+  }
+
+  return idx;
+}
+
+/* 8 pixels per 16 bytes */
+__attribute__((target("ssse3"))) static uint32_t
+expand_gray_alpha8_ssse3(const uint8_t *src, struct pixel *dst,
+                         uint32_t width) {
+  const __m128i lo =
+      _mm_setr_epi8(0, 0, 0, 1, 2, 2, 2, 3, 4, 4, 4, 5, 6, 6, 6, 7);
+  const __m128i hi =
+      _mm_setr_epi8(8, 8, 8, 9, 10, 10, 10, 11, 12, 12, 12, 13, 14, 14, 14, 15);
+  uint32_t idx = 0;
+
+  for (; idx + 8 <= width; idx += 8) {
+    __m128i in = _mm_loadu_si128((const __m128i *)(src + 2 * idx));
+    _mm_storeu_si128((__m128i *)(dst + idx), _mm_shuffle_epi8(in, lo));
+    _mm_storeu_si128((__m128i *)(dst + idx + 4), _mm_shuffle_epi8(in, hi));
+  }
+
+  return idx;
+}
+
+/* 4 pixels per 16 bytes */
+__attribute__((target("ssse3"))) static uint32_t
+expand_gray_alpha16_ssse3(const uint8_t *src, struct pixel *dst,
+                          uint32_t width) {
+  const __m128i shuffle =
+      _mm_setr_epi8(0, 0, 0, 2, 4, 4, 4, 6, 8, 8, 8, 10, 12, 12, 12, 14);
+  uint32_t idx = 0;
+
+  for (; idx + 4 <= width; idx += 4) {
+    __m128i in = _mm_loadu_si128((const __m128i *)(src + 4 * idx));
+    _mm_storeu_si128((__m128i *)(dst + idx), _mm_shuffle_epi8(in, shuffle));
+  }
+
+  return idx;
+}
+
+/* 4 pixels per 32 bytes */
+__attribute__((target("ssse3"))) static uint32_t
+expand_rgb_alpha16_ssse3(const uint8_t *src, struct pixel *dst,
+                         uint32_t width) {
+  const __m128i shuffle = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1,
+                                        -1, -1, -1, -1, -1);
+  uint32_t idx = 0;
+
+  for (; idx + 4 <= width; idx += 4) {
+    __m128i in0 = _mm_loadu_si128((const __m128i *)(src + 8 * idx));
+    __m128i in1 = _mm_loadu_si128((const __m128i *)(src + 8 * idx + 16));
+    __m128i px = _mm_unpacklo_epi64(_mm_shuffle_epi8(in0, shuffle),
+                                    _mm_shuffle_epi8(in1, shuffle));
+    _mm_storeu_si128((__m128i *)(dst + idx), px);
+  }
+
+  return idx;
+}
+
+/* 4 pixels per 24 bytes, reading 16 bytes at a time */
+__attribute__((target("ssse3"))) static uint32_t
+expand_rgb16_ssse3(const uint8_t *src, struct pixel *dst, uint32_t width) {
+  const __m128i shuffle = _mm_setr_epi8(0, 2, 4, -1, 6, 8, 10, -1, -1, -1, -1,
+                                        -1, -1, -1, -1, -1);
+  const __m128i alpha = _mm_set1_epi32(0xff000000);
+  uint32_t idx = 0;
+
+  for (; idx + 5 <= width; idx += 4) {
+    __m128i in0 = _mm_loadu_si128((const __m128i *)(src + 6 * idx));
+    __m128i in1 = _mm_loadu_si128((const __m128i *)(src + 6 * idx + 12));
+    __m128i px = _mm_unpacklo_epi64(_mm_shuffle_epi8(in0, shuffle),
+                                    _mm_shuffle_epi8(in1, shuffle));
+    _mm_storeu_si128((__m128i *)(dst + idx), _mm_or_si128(px, alpha));
+  }
+
+  return idx;
+}
+
+#endif
+
+void expand_rgb8(const uint8_t *src, struct pixel *dst, uint32_t width,
+                 const uint16_t *key) {
+  uint32_t idx = 0;
+
+  // An 8-bit sample never matches a key above 0xff
+  if (key && (key[0] | key[1] | key[2]) > 0xff) {
+    key = NULL;
+  }
+
+#ifdef EXPAND_X86
+  if (use_ssse3()) {
+    idx = expand_rgb8_ssse3(src, dst, width, key);
+  }
+#endif
+
+  for (; idx < width; idx++) {
+    dst[idx].red = src[3 * idx];
+    dst[idx].green = src[3 * idx + 1];
+    dst[idx].blue = src[3 * idx + 2];
+    dst[idx].alpha = 0xff;
+
+    if (key && key[0] == src[3 * idx] && key[1] == src[3 * idx + 1] &&
+        key[2] == src[3 * idx + 2]) {
+      dst[idx].alpha = 0;
+    }
+  }
+}
+
+void expand_gray_alpha8(const uint8_t *src, struct pixel *dst, uint32_t width) {
+  uint32_t idx = 0;
+
+#ifdef EXPAND_X86
+  if (use_ssse3()) {
+    idx = expand_gray_alpha8_ssse3(src, dst, width);
+  }
+#endif
+
+  for (; idx < width; idx++) {
+    dst[idx].red = dst[idx].green = dst[idx].blue = src[2 * idx];
+    dst[idx].alpha = src[2 * idx + 1];
+  }
+}
+
+void expand_gray16(const uint8_t *src, struct pixel *dst, uint32_t width,
+                   const uint16_t *key) {
+  for (uint32_t idx = 0; idx < width; idx++) {
+    dst[idx].red = dst[idx].green = dst[idx].blue = src[2 * idx];
+    dst[idx].alpha = 0xff;
+
+    if (key && key[0] == load_be16(src + 2 * idx)) {
+      dst[idx].alpha = 0;
+    }
+  }
+}
+
+void expand_rgb16(const uint8_t *src, struct pixel *dst, uint32_t width,
+                  const uint16_t *key) {
+  uint32_t idx = 0;
+
+#ifdef EXPAND_X86
+  // The key compares all 16 bits, which the shuffle has thrown away
+  if (!key && use_ssse3()) {
+    idx = expand_rgb16_ssse3(src, dst, width);
+  }
+#endif
+
+  for (; idx < width; idx++) {
+    const uint8_t *sample = src + 6 * idx;
+
+    dst[idx].red = sample[0];
+    dst[idx].green = sample[2];
+    dst[idx].blue = sample[4];
+    dst[idx].alpha = 0xff;
+
+    if (key && key[0] == load_be16(sample) && key[1] == load_be16(sample + 2) &&
+        key[2] == load_be16(sample + 4)) {
+      dst[idx].alpha = 0;
+    }
+  }
+}
+
+void expand_gray_alpha16(const uint8_t *src, struct pixel *dst,
+                         uint32_t width) {
+  uint32_t idx = 0;
+
+#ifdef EXPAND_X86
+  if (use_ssse3()) {
+    idx = expand_gray_alpha16_ssse3(src, dst, width);
+  }
+#endif
+
+  for (; idx < width; idx++) {
+    dst[idx].red = dst[idx].green = dst[idx].blue = src[4 * idx];
+    dst[idx].alpha = src[4 * idx + 2];
+  }
+}
+
+void expand_rgb_alpha16(const uint8_t *src, struct pixel *dst, uint32_t width) {
+  uint32_t idx = 0;
+
+#ifdef EXPAND_X86
+  if (use_ssse3()) {
+    idx = expand_rgb_alpha16_ssse3(src, dst, width);
+  }
+#endif
+
+  for (; idx < width; idx++) {
+    dst[idx].red = src[8 * idx];
+    dst[idx].green = src[8 * idx + 2];
+    dst[idx].blue = src[8 * idx + 4];
+    dst[idx].alpha = src[8 * idx + 6];
+  }
+}
@@ -0,0 +1,42 @@
+#ifndef EXPAND_H
+#define EXPAND_H
+
+#include "pngparser.h"
+
+/* Kernels that expand one unfiltered scanline into width RGBA pixels. Every
+ * color type and bit depth gets its own kernel, so no kernel has to decide
+ * per pixel what it is looking at. 16-bit channels keep their most
+ * significant byte.
+ *
+ * Palette images and grayscale images of up to 8 bits are expanded through a
+ * lookup table with one pixel per sample value (build_expand_table).
+ *
+ * key is the transparent color from the tRNS chunk, or NULL if there is none.
+ * Pixels of that color get an alpha of 0.
+ */
+
+/* Entries in a table built by build_expand_table */
+#define EXPAND_TABLE_SIZE (256 * 8)
+
+/* Turn a lookup table of 256 pixels into a table that maps every possible
+ * byte of a scanline with the given bit depth to the 8 / depth pixels it
+ * holds. For a depth of 8 this is just a copy of lut. */
+void build_expand_table(const struct pixel *lut, uint8_t depth,
+                        struct pixel *table);
+
+void expand_packed(const uint8_t *src, struct pixel *dst, uint32_t width,
+                   uint8_t depth, const struct pixel *table);
+
+void expand_rgb8(const uint8_t *src, struct pixel *dst, uint32_t width,
+                 const uint16_t *key);
+void expand_gray_alpha8(const uint8_t *src, struct pixel *dst, uint32_t width);
+
+void expand_gray16(const uint8_t *src, struct pixel *dst, uint32_t width,
+                   const uint16_t *key);
+void expand_rgb16(const uint8_t *src, struct pixel *dst, uint32_t width,
+                  const uint16_t *key);
+void expand_gray_alpha16(const uint8_t *src, struct pixel *dst,
+                         uint32_t width);
+void expand_rgb_alpha16(const uint8_t *src, struct pixel *dst, uint32_t width);
+
+#endif
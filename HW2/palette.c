@@ -0,0 +1,129 @@
+/* Mapping the colors of an image to a palette when it is stored.
+ *
+ * A palette has at most 256 colors, so an open addressing table of twice
+ * that many slots finds the index of a color in about one probe, however
+ * large the palette is. Images that fit a palette are mostly drawn, not
+ * photographed, and made of long runs of one color. Those are skipped a
+ * register at a time, and only the pixels that start a run are looked up.
+ */
+#include "palette.h"
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static uint32_t load_color(const struct pixel *px) {
+  uint32_t color;
+
+  memcpy(&color, px, sizeof(color));
+  return color;
+}
+
+/* 9 bits: 2 * PALETTE_MAX_COLORS slots */
+static uint32_t hash_color(uint32_t color) {
+  return (color * 2654435761u) >> 23;
+}
+
+/* The slot that holds color, or the empty one where it belongs */
+static uint32_t find_slot(const struct palette_index *index, uint32_t color) {
+  uint32_t slot = hash_color(color);
+
+  while (index->entries[slot] && index->colors[slot] != color) {
+    slot = (slot + 1) % (2 * PALETTE_MAX_COLORS);
+  }
+
+  return slot;
+}
+
+/* Returns the first pixel from idx on that is not of color, or n */
+static size_t skip_run(const struct pixel *px, size_t idx, size_t n,
+                       uint32_t color) {
+#ifdef __SSE2__
+  __m128i run = _mm_set1_epi32((int)color);
+
+  for (; idx + 4 <= n; idx += 4) {
+    __m128i four = _mm_loadu_si128((const __m128i *)(px + idx));
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(four, run)) != 0xffff) {
+      break;
+    }
+  }
+#endif
+
+  while (idx < n && load_color(&px[idx]) == color) {
+    idx++;
+  }
+
+  return idx;
+}
+
+void build_palette_index(struct palette_index *index,
+                         const struct pixel *palette, uint32_t length,
+                         int with_alpha) {
+  struct pixel opaque = {0xff, 0xff, 0xff, with_alpha ? 0xff : 0};
+
+  index->mask = load_color(&opaque);
+  memset(index->entries, 0, sizeof(index->entries));
+
+  for (uint32_t idx = 0; idx < length && idx < PALETTE_MAX_COLORS; idx++) {
+    uint32_t color = load_color(&palette[idx]) & index->mask;
+    uint32_t slot = find_slot(index, color);
+
+    if (!index->entries[slot]) {
+      index->colors[slot] = color;
+      index->entries[slot] = idx + 1;
+    }
+  }
+}
+
+int map_palette_row(const struct palette_index *index, const struct pixel *row,
+                    uint32_t width, uint8_t *out) {
+  size_t x = 0;
+
+  while (x < width) {
+    uint32_t color = load_color(&row[x]);
+    uint32_t slot = find_slot(index, color & index->mask);
+    size_t end;
+
+    if (!index->entries[slot]) {
+      return 1;
+    }
+
+    end = skip_run(row, x + 1, width, color);
+    memset(out + x, index->entries[slot] - 1, end - x);
+    x = end;
+  }
+
+  return 0;
+}
+
+uint32_t collect_palette(const struct pixel *px, size_t n,
+                         struct pixel *palette) {
+  struct palette_index index;
+  uint32_t count = 0;
+  size_t idx = 0;
+
+  memset(index.entries, 0, sizeof(index.entries));
+
+  while (idx < n) {
+    uint32_t color = load_color(&px[idx]);
+    uint32_t slot = find_slot(&index, color);
+
+    if (!index.entries[slot]) {
+      if (count == PALETTE_MAX_COLORS) {
+        return 0;
+      }
+
+      if (palette) {
+        palette[count] = px[idx];
+      }
+      index.colors[slot] = color;
+      index.entries[slot] = ++count;
+    }
+
+    idx = skip_run(px, idx + 1, n, color);
+  }
+
+  return count;
+}
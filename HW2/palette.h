@@ -0,0 +1,37 @@
+#ifndef PALETTE_H
+#define PALETTE_H
+
+#include "pngparser.h"
+
+/* The most colors a palette holds */
+#define PALETTE_MAX_COLORS 256
+
+/* The colors of a palette, hashed to look up their index in constant time
+ * while an image is stored. Colors are compared as the 4 bytes of a struct
+ * pixel, without those that mask clears. */
+struct palette_index {
+  uint32_t mask;
+  uint32_t colors[2 * PALETTE_MAX_COLORS];
+  uint16_t entries[2 * PALETTE_MAX_COLORS]; // Palette index + 1, 0 if empty
+};
+
+/* Index the length colors of palette. Unless with_alpha is set, colors only
+ * differ in red, green and blue. If a color is listed twice, its first entry
+ * is the one that is found. */
+void build_palette_index(struct palette_index *index,
+                         const struct pixel *palette, uint32_t length,
+                         int with_alpha);
+
+/* Write the palette index of each of the width pixels of row to out. Returns
+ * a non-zero value if a color is not in the palette. */
+int map_palette_row(const struct palette_index *index, const struct pixel *row,
+                    uint32_t width, uint8_t *out);
+
+/* Collect the distinct colors of the n pixels at px into palette, in the
+ * order they first appear, as long as there are at most PALETTE_MAX_COLORS
+ * of them. Returns their number, or 0 if there are more. palette may be NULL
+ * if only the number matters. */
+uint32_t collect_palette(const struct pixel *px, size_t n,
+                         struct pixel *palette);
+
+#endif
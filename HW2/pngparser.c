@@ -1,11 +1,47 @@
 #include "pngparser.h"
+#include "arena.h"
 #include "crc.h"
+#include "expand.h"
+#include "palette.h"
+#include "scanfilter.h"
+#include "unfilter.h"
 #include "zlib.h"
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define PNG_OUTPUT_CHUNK_SIZE (1 << 14)
 
+// Initial window for files that cannot be mapped (pipes, sockets, ...)
+#define PNG_STREAM_WINDOW_SIZE (1 << 16)
+// How far past the current IDAT chunk we ask the kernel to read ahead
+#define PNG_READAHEAD_SIZE (1 << 20)
+// Chunk lengths are limited to 2^31 - 1 by the specification
+#define PNG_MAX_CHUNK_LENGTH 0x7fffffffu
+// At most 256 palette entries of 3 bytes each
+#define PNG_MAX_PLTE_LENGTH (256 * 3)
+// IDAT data is checked and inflated in slices that stay in the L1 cache
+#define PNG_CRC_SLICE_SIZE (1 << 14)
+// Threads that inflate the bands of a file with a band index
+#define PNG_MAX_BAND_THREADS 64
+// Scanlines that are inflated ahead of the thread that converts them
+#define PNG_PIPELINE_RING_SIZE (1 << 18)
+#define PNG_PIPELINE_MIN_ROWS 4
+// Deflate level of store_png. Larger files, but written several times faster
+// than with the default of zlib.
+#define PNG_DEFAULT_LEVEL 1
+// Larger image data is deflated in blocks of this size on all cores
+#define PNG_DEFLATE_BLOCK_SIZE (1 << 17)
+#define PNG_MAX_DEFLATE_THREADS 64
+// deflateBound leaves no room for the empty block of Z_SYNC_FLUSH
+#define PNG_DEFLATE_FLUSH_MARGIN 16
+// Largest IDAT chunk that is written, unless the store asks for another size
+#define PNG_IDAT_SIZE (1 << 16)
+
 #define PNG_IHDR_COLOR_GRAYSCALE 0
 #define PNG_IHDR_COLOR_RGB 2
 #define PNG_IHDR_COLOR_PALETTE 3
@@ -50,6 +86,7 @@ struct __attribute__((__packed__)) png_chunk {
  */
 typedef struct png_chunk png_chunk_ihdr;
 typedef struct png_chunk png_chunk_plte;
+typedef struct png_chunk png_chunk_trns;
 typedef struct png_chunk png_chunk_idat;
 typedef struct png_chunk png_chunk_iend;
 
@@ -79,31 +116,51 @@ struct __attribute__((__packed__)) png_header_filesig {
   uint8_t filesig[8];
 };
 
-/* The current implementation supports only some of the PNG color types
+/* All PNG color types are supported. Everything is expanded to RGBA.
  */
 int is_color_type_valid(uint8_t color_type) {
   switch (color_type) {
 
+  case PNG_IHDR_COLOR_GRAYSCALE:
+  case PNG_IHDR_COLOR_RGB:
   case PNG_IHDR_COLOR_PALETTE:
+  case PNG_IHDR_COLOR_GRAYSCALE_ALPHA:
   case PNG_IHDR_COLOR_RGB_ALPHA:
     return 1;
+  default:
+    return 0;
+  }
+}
+
+/* The bit depths that the PNG specification allows for every color type */
+int is_bit_depth_valid(uint8_t color_type, int8_t bitdepth) {
+  switch (color_type) {
   case PNG_IHDR_COLOR_GRAYSCALE:
+    return bitdepth == 1 || bitdepth == 2 || bitdepth == 4 || bitdepth == 8 ||
+           bitdepth == 16;
+  case PNG_IHDR_COLOR_PALETTE:
+    return bitdepth == 1 || bitdepth == 2 || bitdepth == 4 || bitdepth == 8;
   case PNG_IHDR_COLOR_RGB:
   case PNG_IHDR_COLOR_GRAYSCALE_ALPHA:
+  case PNG_IHDR_COLOR_RGB_ALPHA:
+    return bitdepth == 8 || bitdepth == 16;
   default:
     return 0;
   }
 }
 
-/* Currently, we support only some of the bidepths */
-int is_bit_depth_valid(uint8_t color_type, int8_t bitdepth) {
-  if (color_type == PNG_IHDR_COLOR_PALETTE && bitdepth == 8)
-    return 1;
-
-  if (color_type == PNG_IHDR_COLOR_RGB_ALPHA && bitdepth == 8)
+/* Samples per pixel */
+uint32_t get_png_channels(uint8_t color_type) {
+  switch (color_type) {
+  case PNG_IHDR_COLOR_RGB:
+    return 3;
+  case PNG_IHDR_COLOR_GRAYSCALE_ALPHA:
+    return 2;
+  case PNG_IHDR_COLOR_RGB_ALPHA:
+    return 4;
+  default:
     return 1;
-
-  return 0;
+  }
 }
 
 /* The only supported method is deflate */
@@ -116,8 +173,11 @@ int is_compression_valid(uint8_t compression) { return !compression; }
  */
 int is_filter_valid(uint8_t filter) { return !filter; }
 
-/* The only filter type that we support is no filter at all */
-int is_filter_type_valid(uint8_t filter_type) { return !filter_type; }
+/* Every scanline starts with one of the five filter types of the default
+ * filtering method: None, Sub, Up, Average or Paeth */
+int is_filter_type_valid(uint8_t filter_type) {
+  return filter_type <= PNG_FILTER_TYPE_PAETH;
+}
 
 /* Y0L0 PNG stores all of its data as a sequence of rows.
  * Some other, barbaric standards (e.g. PNG) also provide storage sequences
@@ -129,10 +189,8 @@ int is_interlace_valid(uint8_t interlace) {
   case PNG_IHDR_INTERLACE_NO_INTERLACE:
     return 1;
 
-  // We don't support interlacing
-  //
   case PNG_IHDR_INTERLACE_ADAM7:
-    return 0;
+    return 1;
 
   default:
     return 0;
@@ -164,10 +222,12 @@ int is_chunk_ihdr(struct png_chunk *chunk) {
   return !memcmp(&chunk->chunk_type, "IHDR", 4);
 }
 
-/* Convert a freshly read generic chunk to IHDR */
-png_chunk_ihdr *format_ihdr_chunk(struct png_chunk *chunk) {
+/* Convert a freshly read generic chunk to IHDR. The chunk data lives in the
+ * read-only file mapping, so the header is copied into ihdr_header before it is
+ * converted to the host byte order. */
+png_chunk_ihdr *format_ihdr_chunk(struct png_chunk *chunk,
+                                  struct png_header_ihdr *ihdr_header) {
   png_chunk_ihdr *ihdr;
-  struct png_header_ihdr *ihdr_header;
 
   if (!is_chunk_ihdr(chunk))
     return NULL;
@@ -175,12 +235,13 @@ png_chunk_ihdr *format_ihdr_chunk(struct png_chunk *chunk) {
   if (chunk->length != sizeof(struct png_header_ihdr))
     return NULL;
 
+  memcpy(ihdr_header, chunk->chunk_data, sizeof(*ihdr_header));
   ihdr = (png_chunk_ihdr *)chunk;
+  ihdr->chunk_data = ihdr_header;
 
-  if (!is_png_ihdr_valid(ihdr->chunk_data))
+  if (!is_png_ihdr_valid(ihdr_header))
     return NULL;
 
-  ihdr_header = (struct png_header_ihdr *)ihdr->chunk_data;
   ihdr_header->height = to_little_endian(ihdr_header->height);
   ihdr_header->width = to_little_endian(ihdr_header->width);
 
@@ -209,9 +270,236 @@ png_chunk_iend *format_iend_chunk(struct png_chunk *chunk) {
   return (png_chunk_iend *)chunk;
 }
 
+/* A read-only view of a PNG file. Chunks are walked in place, and their
+ * chunk_data points into the view, so no payload is copied or allocated.
+ *
+ * Regular files are mapped as a whole. Anything else (pipes, sockets) is
+ * streamed through a window that only ever holds the chunk being parsed, so
+ * memory stays bounded by the largest chunk instead of the file size. A PNG
+ * that is already in memory is walked where it is, and belongs to the caller.
+ */
+struct png_buffer {
+  const uint8_t *data;
+  size_t length;
+  size_t offset;
+  int in_memory;
+
+  // Mapped files: everything before this offset has been handed back
+  size_t released;
+
+  // Streamed files: data points into window
+  FILE *file;
+  uint8_t *window;
+  size_t window_capacity;
+  const struct png_allocator *allocator;
+};
+
+/* Open a file as a png_buffer, mapping it if possible */
+int open_png_file(const char *filename, struct png_buffer *buf) {
+  struct stat st;
+  void *data;
+  int fd = open(filename, O_RDONLY);
+
+  memset(buf, 0, sizeof(*buf));
+
+  if (fd < 0) {
+    return 1;
+  }
+
+  if (fstat(fd, &st)) {
+    close(fd);
+    return 1;
+  }
+
+  // Non-regular files cannot be mapped, stream them instead
+  if (!S_ISREG(st.st_mode)) {
+    buf->file = fdopen(fd, "rb");
+    if (!buf->file) {
+      close(fd);
+      return 1;
+    }
+    return 0;
+  }
+
+  // Anything shorter than the signature cannot be a PNG anyway
+  if (st.st_size < (off_t)sizeof(struct png_header_filesig)) {
+    close(fd);
+    return 1;
+  }
+
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (data == MAP_FAILED) {
+    return 1;
+  }
+
+  // We walk the file front to back exactly once
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+  buf->data = data;
+  buf->length = st.st_size;
+  return 0;
+}
+
+/* View a PNG that is already in memory as a png_buffer */
+int open_png_memory(const uint8_t *data, size_t length,
+                    struct png_buffer *buf) {
+  memset(buf, 0, sizeof(*buf));
+
+  if (!data || length < sizeof(struct png_header_filesig)) {
+    return 1;
+  }
+
+  buf->data = data;
+  buf->length = length;
+  buf->in_memory = 1;
+  return 0;
+}
+
+/* Release a buffer created by open_png_file or open_png_memory */
+void close_png_file(struct png_buffer *buf) {
+  if (buf->in_memory) {
+    return;
+  }
+
+  if (buf->file) {
+    fclose(buf->file);
+    free_png_memory(buf->allocator, buf->window);
+    return;
+  }
+
+  munmap((void *)buf->data, buf->length);
+}
+
+/* Make sure that at least needed bytes are available at data + offset. A
+ * mapped buffer already holds everything. A streamed one moves the unread
+ * bytes to the front of its window and reads more of the file, which
+ * invalidates earlier pointers into the window. */
+int fill_png_buffer(struct png_buffer *buf, size_t needed) {
+  size_t remaining = buf->length - buf->offset;
+
+  if (remaining >= needed) {
+    return 0;
+  }
+
+  if (!buf->file) {
+    return 1;
+  }
+
+  if (needed > buf->window_capacity) {
+    size_t capacity = buf->window_capacity ? buf->window_capacity
+                                           : PNG_STREAM_WINDOW_SIZE;
+    uint8_t *window;
+
+    while (capacity < needed) {
+      capacity *= 2;
+    }
+
+    window = resize_png_memory(buf->allocator, buf->window,
+                               buf->window_capacity, capacity);
+    if (!window) {
+      return 1;
+    }
+
+    buf->window = window;
+    buf->window_capacity = capacity;
+  }
+
+  memmove(buf->window, buf->window + buf->offset, remaining);
+  buf->data = buf->window;
+  buf->offset = 0;
+  buf->length = remaining;
+
+  while (buf->length < needed) {
+    size_t have = fread(buf->window + buf->length, 1,
+                        buf->window_capacity - buf->length, buf->file);
+    if (!have) {
+      return 1;
+    }
+    buf->length += have;
+  }
+
+  return 0;
+}
+
+/* Move past length bytes without looking at them. Mapped files and memory
+ * only move the offset. Streamed files drop what their window holds and read
+ * the rest away through it: they cannot seek. */
+int skip_png_buffer(struct png_buffer *buf, size_t length) {
+  size_t remaining = buf->length - buf->offset;
+
+  if (remaining >= length) {
+    buf->offset += length;
+    return 0;
+  }
+
+  if (!buf->file || !buf->window) {
+    return 1;
+  }
+
+  length -= remaining;
+  buf->data = buf->window;
+  buf->offset = buf->length = 0;
+
+  while (length) {
+    size_t have = fread(buf->window, 1,
+                        length < buf->window_capacity ? length
+                                                      : buf->window_capacity,
+                        buf->file);
+    if (!have) {
+      return 1;
+    }
+    length -= have;
+  }
+
+  return 0;
+}
+
+/* Ask the kernel to start reading what follows the current chunk, so the disk
+ * works while we inflate. Streamed files are read on demand instead. */
+void prefetch_png_buffer(struct png_buffer *buf) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  size_t start = buf->offset & ~(size_t)(page_size - 1);
+  size_t length = buf->length - start;
+
+  if (buf->file || buf->in_memory || start >= buf->length) {
+    return;
+  }
+
+  if (length > PNG_READAHEAD_SIZE) {
+    length = PNG_READAHEAD_SIZE;
+  }
+
+  madvise((void *)(buf->data + start), length, MADV_WILLNEED);
+}
+
+/* Drop the pages of a mapped file that have already been parsed. They are
+ * clean, so this only lowers the resident size. The IHDR and the palette are
+ * copied out of the mapping, so nothing points into them anymore. Memory of
+ * the caller is left alone: dropping it would throw its contents away. */
+void release_png_buffer(struct png_buffer *buf) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  size_t end = buf->offset & ~(size_t)(page_size - 1);
+
+  if (buf->file || buf->in_memory || end <= buf->released) {
+    return;
+  }
+
+  madvise((void *)(buf->data + buf->released), end - buf->released,
+          MADV_DONTNEED);
+  buf->released = end;
+}
+
 /* Read the signature of a file */
-int read_png_filesig(FILE *file, struct png_header_filesig *filesig) {
-  return fread(filesig, sizeof(*filesig), 1, file) != 1;
+int read_png_filesig(struct png_buffer *buf, struct png_header_filesig *filesig) {
+  if (fill_png_buffer(buf, sizeof(*filesig))) {
+    return 1;
+  }
+
+  memcpy(filesig, buf->data + buf->offset, sizeof(*filesig));
+  buf->offset += sizeof(*filesig);
+  return 0;
 }
 
 /* Checks if the first bytes have the correct values */
@@ -219,61 +507,120 @@ int is_png_filesig_valid(struct png_header_filesig *filesig) {
   return !memcmp(filesig, "\211PNG\r\n\032\n", 8);
 }
 
-/* CRC for a chunk. This prevents data corruption.
+/* Does the CRC computed over a chunk match the one it was stored with? This
+ * prevents data corruption.
  *
  * EDIT THIS FUNCTION BEFORE FUZZING!
  */
+int is_png_crc_valid(struct png_chunk *chunk, uint32_t crc_value) {
+  return chunk->crc == crc_value;
+}
+
+/* The CRC of the chunk type, which the CRC of the chunk data continues */
+uint32_t get_png_chunk_type_crc(struct png_chunk *chunk) {
+  return crc32(0, (const Bytef *)&chunk->chunk_type, sizeof(int32_t));
+}
+
+/* CRC for a chunk. zlib computes it several bytes at a time, which is much
+ * faster than the byte-wise table of crc.c. */
 int is_png_chunk_valid(struct png_chunk *chunk) {
-  uint32_t crc_value =
-      crc((unsigned char *)&chunk->chunk_type, sizeof(int32_t));
+  uint32_t crc_value = get_png_chunk_type_crc(chunk);
 
   if (chunk->length) {
-    crc_value = update_crc(crc_value ^ 0xffffffffL,
-                           (unsigned char *)chunk->chunk_data, chunk->length) ^
-                0xffffffffL;
+    crc_value = crc32(crc_value, chunk->chunk_data, chunk->length);
   }
 
-  return chunk->crc == crc_value;
+  return is_png_crc_valid(chunk, crc_value);
+}
+
+/* Does the chunk represent image data? */
+int is_chunk_idat(struct png_chunk *chunk) {
+  return !memcmp(&chunk->chunk_type, "IDAT", 4);
 }
 
-/* Fill the chunk with the data from the file.*/
-int read_png_chunk(FILE *file, struct png_chunk *chunk) {
+/* Does the chunk carry transparency information? */
+int is_chunk_trns(struct png_chunk *chunk) {
+  return !memcmp(&chunk->chunk_type, "tRNS", 4);
+}
+
+/* Is this the band index that store_png_banded writes? It is a private
+ * ancillary chunk, so other decoders skip it. */
+int is_chunk_bndx(struct png_chunk *chunk) {
+  return !memcmp(&chunk->chunk_type, "bnDX", 4);
+}
+
+/* Can a decoder that does not know the chunk ignore it? The case of the first
+ * letter of its type tells. */
+int is_chunk_ancillary(struct png_chunk *chunk) {
+  return ((uint8_t *)&chunk->chunk_type)[0] & 0x20;
+}
+
+/* Is this an ancillary chunk that decoding does not use, such as text or
+ * camera metadata? */
+int is_chunk_skippable(struct png_chunk *chunk) {
+  return is_chunk_ancillary(chunk) && !is_chunk_trns(chunk) &&
+         !is_chunk_bndx(chunk);
+}
+
+/* Fill the chunk with the next chunk of the buffer. The chunk data is not
+ * copied: chunk_data points straight into the buffer. crc_mode tells whether
+ * its CRC is checked here (see PNG_CRC_FUSED in pngparser.h).
+ *
+ * Unless every CRC is checked, chunks that is_chunk_skippable are skipped
+ * without being read: they are returned without data. */
+int read_png_chunk(struct png_buffer *buf, struct png_chunk *chunk,
+                   int crc_mode) {
+  const uint8_t *chunk_start;
+
   chunk->chunk_data = NULL;
 
-  if (fread(chunk, sizeof(int32_t), 2, file) != 2) {
-    goto error;
+  // Length and type
+  if (fill_png_buffer(buf, 2 * sizeof(int32_t))) {
+    return 1;
   }
 
+  chunk_start = buf->data + buf->offset;
+  memcpy(&chunk->length, chunk_start, sizeof(int32_t));
+  memcpy(&chunk->chunk_type, chunk_start + sizeof(int32_t), sizeof(int32_t));
+
   chunk->length = to_little_endian(chunk->length);
 
-  if (chunk->length) {
-    chunk->chunk_data = malloc(chunk->length);
-    if (!chunk->chunk_data)
-      goto error;
+  if (chunk->length > PNG_MAX_CHUNK_LENGTH) {
+    return 1;
+  }
 
-    if (fread(chunk->chunk_data, chunk->length, 1, file) != 1) {
-      goto error;
-    }
+  if (crc_mode != PNG_CRC_CHECK && is_chunk_skippable(chunk)) {
+    buf->offset += 2 * sizeof(int32_t);
+    return skip_png_buffer(buf, chunk->length + sizeof(int32_t));
   }
 
-  if (fread(&chunk->crc, sizeof(int32_t), 1, file) != 1) {
-    goto error;
+  // Data and CRC
+  if (fill_png_buffer(buf, 3 * sizeof(int32_t) + (size_t)chunk->length)) {
+    return 1;
+  }
+
+  chunk_start = buf->data + buf->offset;
+
+  if (chunk->length) {
+    chunk->chunk_data = (void *)(chunk_start + 2 * sizeof(int32_t));
   }
 
+  memcpy(&chunk->crc, chunk_start + 2 * sizeof(int32_t) + chunk->length,
+         sizeof(int32_t));
+
   chunk->crc = to_little_endian(chunk->crc);
 
-  if (!is_png_chunk_valid(chunk)) {
-    goto error;
+  // IDAT data is checked while it is inflated, or not at all
+  if (crc_mode == PNG_CRC_CHECK ||
+      (crc_mode == PNG_CRC_FUSED && !is_chunk_idat(chunk))) {
+    if (!is_png_chunk_valid(chunk)) {
+      return 1;
+    }
   }
 
-  chunk->chunk_type = chunk->chunk_type;
+  buf->offset += 3 * sizeof(int32_t) + chunk->length;
 
   return 0;
-
-error:
-  if (chunk->chunk_data)
-    free(chunk->chunk_data);
-  return 1;
 }
 
 /* Does the chunk represent a palette of colors?*/
@@ -281,20 +628,58 @@ int is_chunk_plte(struct png_chunk *chunk) {
   return !memcmp(&chunk->chunk_type, "PLTE", 4);
 }
 
-/* Reinterpret a chunk to the PLTE chunk, if possible */
-png_chunk_plte *format_plte_chunk(struct png_chunk *chunk) {
+/* Reinterpret a chunk to the PLTE chunk, if possible. The entries are copied
+ * into plte_entries, since the chunk data does not outlive the next read. */
+png_chunk_plte *format_plte_chunk(struct png_chunk *chunk,
+                                  struct plte_entry *plte_entries) {
   if (!is_chunk_plte(chunk))
     return NULL;
 
-  if (chunk->length % 3)
+  if (chunk->length % 3 || chunk->length > PNG_MAX_PLTE_LENGTH)
     return NULL;
 
+  memcpy(plte_entries, chunk->chunk_data, chunk->length);
+  chunk->chunk_data = plte_entries;
+
   return (png_chunk_plte *)chunk;
 }
 
-/* Does the chunk represent image data? */
-int is_chunk_idat(struct png_chunk *chunk) {
-  return !memcmp(&chunk->chunk_type, "IDAT", 4);
+/* Reinterpret a chunk to the tRNS chunk, if it fits the color type. Palette
+ * images get one alpha value per palette entry, grayscale and RGB images one
+ * transparent color. The data is copied into trns_entries. */
+png_chunk_trns *format_trns_chunk(struct png_chunk *chunk,
+                                  png_chunk_ihdr *ihdr_chunk,
+                                  png_chunk_plte *plte_chunk,
+                                  uint8_t *trns_entries) {
+  struct png_header_ihdr *ihdr_header =
+      (struct png_header_ihdr *)ihdr_chunk->chunk_data;
+
+  if (!is_chunk_trns(chunk))
+    return NULL;
+
+  switch (ihdr_header->color_type) {
+  case PNG_IHDR_COLOR_GRAYSCALE:
+    if (chunk->length != 2)
+      return NULL;
+    break;
+  case PNG_IHDR_COLOR_RGB:
+    if (chunk->length != 6)
+      return NULL;
+    break;
+  case PNG_IHDR_COLOR_PALETTE:
+    // The palette must come first
+    if (!plte_chunk || chunk->length > plte_chunk->length / 3)
+      return NULL;
+    break;
+  default:
+    // Images with an alpha channel cannot have tRNS
+    return NULL;
+  }
+
+  memcpy(trns_entries, chunk->chunk_data, chunk->length);
+  chunk->chunk_data = trns_entries;
+
+  return (png_chunk_trns *)chunk;
 }
 
 /* Query the metadata for the interlacing type */
@@ -313,414 +698,2534 @@ png_chunk_idat *format_idat_chunk(struct png_chunk *chunk) {
   return (png_chunk_idat *)chunk;
 }
 
-/* Take a deflate stream and decompress it. This is used to obtain image data
- * from an IDAT train. */
-int decompress_png_data(uint8_t *compressed_data, uint32_t input_length,
-                        uint8_t **decompressed_data,
-                        uint32_t *decompressed_length) {
-  int ret;
-  unsigned have;
-  z_stream strm;
-  unsigned char out[PNG_OUTPUT_CHUNK_SIZE];
-  uint8_t *output_buffer = NULL;
-  uint32_t output_length = 0;
-
-  /* allocate inflate state */
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
+struct png_decoder;
 
-  strm.avail_in = input_length;
-  strm.next_in = Z_NULL;
-  ret = inflateInit(&strm);
-  if (ret != Z_OK)
-    return ret;
+/* Chunk-level state of a PNG file that is being walked. The IHDR and the
+ * palette are copied out of the input, so they stay valid while the rest of
+ * the file is read.
+ */
+struct png_parser {
+  struct png_buffer input;
+  struct png_header_ihdr ihdr_header;
+  struct plte_entry plte_entries[256];
+  uint8_t trns_entries[256];
+  struct png_chunk ihdr_storage, plte_storage, trns_storage;
+  png_chunk_ihdr *ihdr_chunk;
+  png_chunk_plte *plte_chunk;
+  png_chunk_trns *trns_chunk;
+  png_chunk_iend *iend_chunk;
+
+  // Band index: where each band of band_rows rows starts in the zlib stream
+  uint32_t band_rows;
+  uint32_t band_count;
+  uint32_t *band_offsets;
+
+  // Temporary memory of the load, NULL for malloc
+  const struct png_allocator *allocator;
+  int crc_mode;
+  // The decoder of the codec context the load runs in, NULL for none
+  struct png_decoder *decoder;
+  int chunk_idx;
+  int idat_train_started;
+  int idat_train_finished;
+  int failed;
+};
 
-  strm.next_in = compressed_data;
+/* Check the signature of a freshly opened PNG */
+int start_png_parser(struct png_parser *parser) {
+  struct png_header_filesig filesig;
 
-  /* run inflate() on input until output buffer not full */
-  do {
-    strm.avail_out = PNG_OUTPUT_CHUNK_SIZE;
-    strm.next_out = out;
-    ret = inflate(&strm, Z_NO_FLUSH);
+  // Did we read the starting bytes properly?
+  // Are the starting bytes correct?
+  if (read_png_filesig(&parser->input, &filesig) ||
+      !is_png_filesig_valid(&filesig)) {
+    close_png_file(&parser->input);
+    return 1;
+  }
 
-    switch (ret) {
-    case Z_STREAM_ERROR:
-    case Z_NEED_DICT:
-    case Z_DATA_ERROR:
-    case Z_MEM_ERROR:
-      goto error;
-    }
+  return 0;
+}
 
-    have = PNG_OUTPUT_CHUNK_SIZE - strm.avail_out;
+/* Open a PNG file and check its signature. Temporary memory comes from
+ * allocator. */
+int open_png_parser(const char *filename, struct png_parser *parser,
+                    const struct png_allocator *allocator) {
+  memset(parser, 0, sizeof(*parser));
+  parser->chunk_idx = -1;
+  parser->allocator = allocator;
 
-    output_buffer = realloc(output_buffer, output_length + have);
+  // Has the file been opened properly?
+  if (open_png_file(filename, &parser->input)) {
+    return 1;
+  }
 
-    memcpy(output_buffer + output_length, out, have);
+  parser->input.allocator = allocator;
+  return start_png_parser(parser);
+}
 
-    output_length += have;
-  } while (strm.avail_out == 0);
+/* Open a PNG that is in memory and check its signature */
+int open_png_parser_memory(const uint8_t *data, size_t length,
+                           struct png_parser *parser,
+                           const struct png_allocator *allocator) {
+  memset(parser, 0, sizeof(*parser));
+  parser->chunk_idx = -1;
+  parser->allocator = allocator;
 
-  if (ret != Z_STREAM_END) {
-    goto error;
+  if (open_png_memory(data, length, &parser->input)) {
+    return 1;
   }
 
-  /* clean up and return */
-  (void)inflateEnd(&strm);
-
-  *decompressed_data = output_buffer;
-  *decompressed_length = output_length;
-  return 0;
+  return start_png_parser(parser);
+}
 
-error:
-  inflateEnd(&strm);
-  if (output_buffer)
-    free(output_buffer);
-  return 1;
+/* Release the file behind a parser */
+void close_png_parser(struct png_parser *parser) {
+  close_png_file(&parser->input);
+  free_png_memory(parser->allocator, parser->band_offsets);
 }
 
-/* Combine image metadata, palette and a decompressed image data buffer (with
- * palette entries) into an image */
-struct image *convert_color_palette_to_image(png_chunk_ihdr *ihdr_chunk,
-                                             png_chunk_plte *plte_chunk,
-                                             uint8_t *inflated_buf,
-                                             uint32_t inflated_size) {
-  struct png_header_ihdr *ihdr_header =
-      (struct png_header_ihdr *)ihdr_chunk->chunk_data;
-  uint32_t height = ihdr_header->height;
-  uint32_t width = ihdr_header->width;
-  uint32_t palette_idx = 0;
+/* Walk a mapped file or a PNG in memory again from its first chunk. A
+ * streamed file cannot be rewound: its window has moved on. */
+void rewind_png_parser(struct png_parser *parser) {
+  struct png_buffer input = parser->input;
+  const struct png_allocator *allocator = parser->allocator;
+  int crc_mode = parser->crc_mode;
+  struct png_decoder *decoder = parser->decoder;
+
+  free_png_memory(allocator, parser->band_offsets);
+  memset(parser, 0, sizeof(*parser));
+  parser->chunk_idx = -1;
+  parser->allocator = allocator;
+  parser->crc_mode = crc_mode;
+  parser->decoder = decoder;
+  parser->input = input;
+  parser->input.offset = sizeof(struct png_header_filesig);
+}
 
-  struct plte_entry *plte_entries = (struct plte_entry *)plte_chunk->chunk_data;
+/* Copy the band index out of its chunk: the number of rows per band, followed
+ * by the offset of every band in the zlib stream, all big endian. A malformed
+ * index is ignored, the image data can be inflated without it. */
+void read_png_band_index(struct png_parser *parser, struct png_chunk *chunk) {
+  uint32_t *fields;
 
-  struct image *img = malloc(sizeof(struct image));
-  img->size_y = height;
-  img->size_x = width;
-  img->px = malloc(sizeof(struct pixel) * img->size_x * img->size_y);
+  if (chunk->length < 2 * sizeof(uint32_t) ||
+      chunk->length % sizeof(uint32_t)) {
+    return;
+  }
 
-  for (uint32_t idy = 0; idy < height; idy++) {
-    // Filter byte at the start of every scanline needs to be 0
-    if (inflated_buf[idy * (1 + width)]) {
-      free(img->px);
-      free(img);
-      return NULL;
-    }
-    for (uint32_t idx = 0; idx < width; idx++) {
-      palette_idx = inflated_buf[idy * (1 + width) + idx + 1];
-      img->px[idy * img->size_x + idx].red = plte_entries[palette_idx].red;
-      img->px[idy * img->size_x + idx].green = plte_entries[palette_idx].green;
-      img->px[idy * img->size_x + idx].blue = plte_entries[palette_idx].blue;
-      img->px[idy * img->size_x + idx].alpha = 0xff;
-    }
+  fields = alloc_png_memory(parser->allocator, chunk->length);
+  if (!fields) {
+    return;
   }
 
-  return img;
-}
+  memcpy(fields, chunk->chunk_data, chunk->length);
+  parser->band_rows = to_little_endian(fields[0]);
+  parser->band_count = chunk->length / sizeof(uint32_t) - 1;
 
-/* Combine image metadata and decompressed image data (RGBA) into an image */
-struct image *convert_rgb_alpha_to_image(png_chunk_ihdr *ihdr_chunk,
-                                         uint8_t *inflated_buf,
-                                         uint32_t inflated_size) {
-  struct png_header_ihdr *ihdr_header =
-      (struct png_header_ihdr *)ihdr_chunk->chunk_data;
-  uint32_t height = ihdr_header->height;
-  uint32_t width = ihdr_header->width;
+  for (uint32_t idx = 0; idx < parser->band_count; idx++) {
+    fields[idx] = to_little_endian(fields[idx + 1]);
+  }
+  parser->band_offsets = fields;
+}
 
-  uint32_t pixel_idx = 0;
-  uint32_t r_idx, g_idx, b_idx, a_idx;
+/* Take the next chunk of the file into account: IHDR, PLTE, tRNS, the band
+ * index and IEND are stored in the parser, IDAT chunks are checked for their
+ * place in the file, and other chunks are ignored. The data of IDAT chunks
+ * and of ignored chunks is not looked at, it may be missing.
+ *
+ * This function returns 0 if the chunk may appear where it does and a
+ * non-zero value otherwise.
+ */
+int accept_png_chunk(struct png_parser *parser, struct png_chunk *chunk) {
+  parser->chunk_idx++;
+  // We have more chunks after IEND for some reason
+  // IEND must be the last chunk
+  if (parser->iend_chunk)
+    return 1;
 
-  struct image *img = malloc(sizeof(struct image));
+  // All IDAT chunks need to occur in sequence
+  // We end the IDAT sequence here if we encounter a different chunk
+  if (parser->idat_train_started && !is_chunk_idat(chunk)) {
+    parser->idat_train_finished = 1;
+    parser->idat_train_started = 0;
+  }
 
-  if (!img) {
-    goto error;
+  // The first iteration: We must have IHDR!
+  if (!parser->chunk_idx) {
+    if (!is_chunk_ihdr(chunk)) {
+      return 1;
+    }
   }
 
-  img->size_y = height;
-  img->size_x = width;
-  img->px = malloc(sizeof(struct pixel) * img->size_x * img->size_y);
+  if (is_chunk_ihdr(chunk)) {
+    // The second IHDR?
+    if (parser->ihdr_chunk) {
+      return 1;
+    }
 
-  if (!img->px) {
-    goto error;
+    parser->ihdr_storage = *chunk;
+    parser->ihdr_chunk =
+        format_ihdr_chunk(&parser->ihdr_storage, &parser->ihdr_header);
+
+    return !parser->ihdr_chunk;
   }
 
-  for (uint32_t idy = 0; idy < height; idy++) {
-    // The filter byte at the start of every scanline needs to be 0
-    if (inflated_buf[idy * (1 + 4 * width)]) {
-      goto error;
+  // PLTE chunk encountered
+  if (is_chunk_plte(chunk)) {
+    // Only 1 PLTE is allowed
+    if (parser->plte_chunk) {
+      return 1;
     }
 
-    for (uint32_t idx = 0; idx < width; idx++) {
-      pixel_idx = idy * (1 + 4 * width) + 1 + 4 * idx;
+    parser->plte_storage = *chunk;
+    parser->plte_chunk =
+        format_plte_chunk(&parser->plte_storage, parser->plte_entries);
 
-      r_idx = pixel_idx;
-      g_idx = pixel_idx + 1;
-      b_idx = pixel_idx + 2;
-      a_idx = pixel_idx + 3;
+    return !parser->plte_chunk;
+  }
 
-      img->px[idy * img->size_x + idx].red = inflated_buf[r_idx];
-      img->px[idy * img->size_x + idx].green = inflated_buf[g_idx];
-      img->px[idy * img->size_x + idx].blue = inflated_buf[b_idx];
-      img->px[idy * img->size_x + idx].alpha = inflated_buf[a_idx];
+  // tRNS chunk, only one and before the image data
+  if (is_chunk_trns(chunk)) {
+    if (parser->trns_chunk || parser->idat_train_started ||
+        parser->idat_train_finished) {
+      return 1;
     }
-  }
 
-  return img;
+    parser->trns_storage = *chunk;
+    parser->trns_chunk =
+        format_trns_chunk(&parser->trns_storage, parser->ihdr_chunk,
+                          parser->plte_chunk, parser->trns_entries);
 
-error:
-  if (img) {
-    if (img->px) {
-      free(img->px);
-    }
-    free(img);
+    return !parser->trns_chunk;
   }
-}
 
-/* Creates magic unicorns */
-void reverse_filter_on_scanlines(png_chunk_ihdr *ihdr_chunk,
-                                 uint8_t *inflated_buf,
-                                 uint32_t inflated_size) {
-  return;
-}
+  // Band index, before the image data
+  if (is_chunk_bndx(chunk)) {
+    if (!parser->band_offsets && !parser->idat_train_started &&
+        !parser->idat_train_finished) {
+      read_png_band_index(parser, chunk);
+    }
 
-/* Dispatch function for converting decompressed data into an image */
-struct image *convert_data_to_image(png_chunk_ihdr *ihdr_chunk,
-                                    png_chunk_plte *plte_chunk,
-                                    uint8_t *inflated_buf,
-                                    uint32_t inflated_size) {
-  struct png_header_ihdr *ihdr_header =
-      (struct png_header_ihdr *)ihdr_chunk->chunk_data;
-  switch (ihdr_header->color_type) {
-  case PNG_IHDR_COLOR_PALETTE:
-    return convert_color_palette_to_image(ihdr_chunk, plte_chunk, inflated_buf,
-                                          inflated_size);
-  case PNG_IHDR_COLOR_RGB_ALPHA:
-    return convert_rgb_alpha_to_image(ihdr_chunk, inflated_buf, inflated_size);
-  default:
-    return NULL;
+    return 0;
   }
-}
-
-/* Parses a Y0L0 PNG with no interlacing */
-struct image *parse_png_no_interlace(png_chunk_ihdr *ihdr_chunk,
-                                     png_chunk_plte *plte_chunk,
-                                     uint8_t *inflated_buf,
-                                     uint32_t inflated_size) {
-  reverse_filter_on_scanlines(ihdr_chunk, inflated_buf, inflated_size);
 
-  return convert_data_to_image(ihdr_chunk, plte_chunk, inflated_buf,
-                               inflated_size);
-}
+  // IEND chunk
+  if (is_chunk_iend(chunk)) {
+    parser->iend_chunk = format_iend_chunk(chunk);
 
-/* Parses a Y0L0 PNG from read data. Returns NULL if the image is interlaced. */
-struct image *parse_png(png_chunk_ihdr *ihdr_chunk, png_chunk_plte *plte_chunk,
-                        uint8_t *inflated_buf, uint32_t inflated_size) {
-  if (!ihdr_chunk) {
-    return NULL;
+    return !parser->iend_chunk;
   }
 
+  if (is_chunk_idat(chunk)) {
+    // If we have already processed a sequence of IDATs, why do we see another
+    // one here?
+    if (parser->idat_train_finished) {
+      return 1;
+    }
+    parser->idat_train_started = 1;
+
+    format_idat_chunk(chunk);
+  }
+
+  return 0;
+}
+
+/* Walk the chunks up to the next IDAT chunk and return it in chunk. IHDR,
+ * PLTE, tRNS and IEND are handled on the way.
+ *
+ * This function returns 0 when an IDAT chunk was found and a non-zero value
+ * otherwise. Check is_png_parser_done to tell a complete file from a broken
+ * one.
+ */
+int read_png_idat(struct png_parser *parser, struct png_chunk *chunk) {
+  if (parser->failed) {
+    return 1;
+  }
+
+  // Read all PNG chunks
+  while (!read_png_chunk(&parser->input, chunk, parser->crc_mode)) {
+    if (accept_png_chunk(parser, chunk)) {
+      parser->failed = 1;
+      return 1;
+    }
+
+    // Hand IDAT data to the caller
+    if (is_chunk_idat(chunk)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Did we reach IEND without errors? */
+int is_png_parser_done(struct png_parser *parser) {
+  return parser->iend_chunk && !parser->failed;
+}
+
+/* The pixels of an image are stored in one pass, or in the seven passes of
+ * Adam7. Pass p holds the pixels at (x0 + i * dx, y0 + j * dy). Once it is
+ * decoded, every pixel seen so far stands for a block_w x block_h block of the
+ * image. */
+struct png_pass {
+  uint8_t x0;
+  uint8_t y0;
+  uint8_t dx;
+  uint8_t dy;
+  uint8_t block_w;
+  uint8_t block_h;
+};
+
+static const struct png_pass png_single_pass[1] = {{0, 0, 1, 1, 1, 1}};
+
+static const struct png_pass png_adam7_passes[7] = {
+    {0, 0, 8, 8, 8, 8}, {4, 0, 8, 8, 4, 8}, {0, 4, 4, 8, 4, 4},
+    {2, 0, 4, 4, 2, 4}, {0, 2, 2, 4, 2, 2}, {1, 0, 2, 2, 1, 2},
+    {0, 1, 1, 2, 1, 1}};
+
+/* Decoding state of one image.
+ *
+ * The IDAT train is inflated one scanline at a time. The filter byte of every
+ * scanline goes into filter_type. 8-bit RGBA scanlines already have the layout
+ * of struct pixel, so they are inflated straight into their row of px and
+ * unfiltered there against the row above. Other formats are inflated into
+ * row_buf, which holds two scanlines: the current one and the previous one,
+ * which the filters refer to. They are then expanded into px by the kernel for
+ * their color type and bit depth (see expand.h).
+ *
+ * Interlaced images are decoded pass by pass. Every pass is a small image of
+ * its own, whose rows are expanded into pass_px and scattered into px.
+ *
+ * Row y of the image goes to row y % px_rows of px. With px_rows equal to the
+ * height that is the whole image, with a smaller value it is a rolling window.
+ * Rows in px must not be modified before the decode is finished, unless
+ * px_rows is 1.
+ *
+ * A pipelined decoder only inflates: row_buf is a ring of ring_rows
+ * scanlines, which a second thread unfilters and converts behind it (see
+ * struct png_pipeline).
+ */
+struct png_pipeline;
+
+struct png_decoder {
+  png_chunk_ihdr *ihdr_chunk;
+  uint8_t color_type;
+  uint8_t bit_depth;
+  uint32_t width;
+  uint32_t height;
+
+  const struct png_pass *passes;
+  uint32_t num_passes;
+  uint32_t pass;        // The pass being inflated
+  uint32_t pass_width;  // Pixels in a row of the pass
+  uint32_t pass_height; // Rows in the pass
+  uint32_t rows_done;   // Scanlines completed, over all passes
+  uint32_t rows_total;
+  uint32_t last_row;    // Inflate stops once this many rows are done
+  uint32_t first_row;   // Bands: the row the stream starts at
+  struct pixel *pass_px;
+
+  // Interlaced images: called with a preview after every pass
+  png_progress_fn progress;
+  void *progress_arg;
+  struct image *preview;
+  int stopped;
+
+  // Palette and grayscale images of up to 8 bits: byte to pixels
+  struct pixel expand_table[EXPAND_TABLE_SIZE];
+  // Grayscale and RGB images: the transparent color, if any
+  uint16_t trns_key[3];
+  uint16_t *key;
+
+  struct pixel *px;
+  uint32_t px_rows;
+  uint32_t px_width;
+  size_t px_stride; // Pixels from one row of px to the next
+
+  // Regions: the corner of the region in the image. Rows above it are only
+  // unfiltered, they are not converted.
+  uint32_t x0;
+  uint32_t y0;
+
+  // Scaled images: px holds the image reduced by 2^scale_shift, every pixel
+  // the average of its block. Blocks are summed up in sum_rows rows of sums,
+  // one for each block row that can be incomplete at the same time.
+  uint32_t scale_shift;
+  uint32_t sum_rows;
+  uint16_t *sums;
+
+  z_stream strm;
+  int stream_end;
+  int raw;     // Bands: raw deflate data, which zlib does not checksum
+  uLong adler; // Bands: Adler-32 of everything inflated so far
+
+  uint32_t row_bytes;  // Bytes of a scanline, without the filter byte
+  uint32_t bpp;        // Bytes per complete pixel, at least 1
+  uint32_t row;        // The scanline of the pass being inflated
+  uint32_t row_filled; // How much of it is inflated, filter byte included
+  uint8_t filter_type;
+  uint8_t *scanline; // Where the scanline is inflated to
+  uint8_t *row_buf;
+  uint32_t ring_rows; // Scanlines in row_buf
+  uint8_t *filters;   // Pipelines: the filter byte of every scanline in row_buf
+  struct png_pipeline *pipeline;
+
+  int kept; // The inflate state belongs to a codec context
+
+  const struct png_allocator *allocator; // Scratch memory, NULL for malloc
+};
+
+/* Bytes in a scanline of width pixels, without the filter byte. Returns 0 if
+ * that does not fit 32 bits. */
+uint32_t get_png_row_bytes(png_chunk_ihdr *ihdr_chunk, uint32_t width) {
+  struct png_header_ihdr *ihdr_header =
+      (struct png_header_ihdr *)ihdr_chunk->chunk_data;
+  uint64_t bits = (uint64_t)width *
+                  get_png_channels(ihdr_header->color_type) *
+                  ihdr_header->bit_depth;
+  uint64_t row_bytes = (bits + 7) / 8;
+
+  return row_bytes < UINT32_MAX ? row_bytes : 0;
+}
+
+/* Bytes per complete pixel, as the filters see them */
+uint32_t get_png_filter_bpp(png_chunk_ihdr *ihdr_chunk) {
+  struct png_header_ihdr *ihdr_header =
+      (struct png_header_ihdr *)ihdr_chunk->chunk_data;
+  uint32_t bits =
+      get_png_channels(ihdr_header->color_type) * ihdr_header->bit_depth;
+
+  return bits < 8 ? 1 : bits / 8;
+}
+
+/* Can we inflate scanlines right into the image? The scanline needs to have
+ * the layout of struct pixel, and px has to hold on to the previous row, which
+ * the next scanline may refer to. Only a px of the whole image does: in a
+ * window or a region, row y of the image is not row y of px. */
+int is_png_row_in_place(png_chunk_ihdr *ihdr_chunk, uint32_t px_rows) {
+  struct png_header_ihdr *ihdr_header =
+      (struct png_header_ihdr *)ihdr_chunk->chunk_data;
+
+  return ihdr_header->color_type == PNG_IHDR_COLOR_RGB_ALPHA &&
+         ihdr_header->bit_depth == 8 && !ihdr_header->interlace &&
+         px_rows >= ihdr_header->height;
+}
+
+/* Where row y of the image goes */
+struct pixel *get_png_decoder_row(struct png_decoder *dec, uint32_t y) {
+  return &dec->px[(y % dec->px_rows) * dec->px_stride];
+}
+
+/* The row of the image that scanline row of the current pass belongs to */
+uint32_t get_png_pass_y(struct png_decoder *dec, uint32_t row) {
+  return dec->passes[dec->pass].y0 + row * dec->passes[dec->pass].dy;
+}
+
+/* Point the decoder at the place where the next scanline goes */
+void set_png_decoder_scanline(struct png_decoder *dec) {
+  dec->row_filled = 0;
+
+  if (dec->row_buf) {
+    dec->scanline =
+        dec->row_buf + (size_t)(dec->row % dec->ring_rows) * dec->row_bytes;
+  } else {
+    dec->scanline = (uint8_t *)get_png_decoder_row(dec, dec->row);
+  }
+}
+
+/* Has every pass been decoded? */
+int is_png_decode_complete(struct png_decoder *dec) {
+  return dec->pass == dec->num_passes;
+}
+
+/* Fill the image with a coarse preview of what the passes so far decoded:
+ * every pixel that is known is copied over the block it stands for. Later
+ * passes overwrite the copies with their own pixels. */
+void fill_png_preview(struct png_decoder *dec) {
+  const struct png_pass *pass = &dec->passes[dec->pass];
+
+  for (uint32_t y = 0; y < dec->height; y += pass->block_h) {
+    struct pixel *row = get_png_decoder_row(dec, y);
+
+    for (uint32_t x = 0; x < dec->width; x += pass->block_w) {
+      for (uint32_t i = 1; i < pass->block_w && x + i < dec->width; i++) {
+        row[x + i] = row[x];
+      }
+    }
+
+    for (uint32_t j = 1; j < pass->block_h && y + j < dec->height; j++) {
+      memcpy(get_png_decoder_row(dec, y + j), row,
+             sizeof(struct pixel) * dec->width);
+    }
+  }
+}
+
+/* Turn the sums of block row y of a scaled image into its pixels, and clear
+ * them for the next block row. Blocks at the right and bottom edges can be
+ * smaller than the others. */
+void emit_png_scaled_row(struct png_decoder *dec, uint32_t y) {
+  uint16_t *sums =
+      dec->sums + (size_t)(y % dec->sum_rows) * dec->px_width * 4;
+  struct pixel *row = get_png_decoder_row(dec, y);
+  uint32_t scale = 1u << dec->scale_shift;
+  uint32_t block_h = dec->height - (y << dec->scale_shift) < scale
+                         ? dec->height - (y << dec->scale_shift)
+                         : scale;
+
+  for (uint32_t x = 0; x < dec->px_width; x++) {
+    uint32_t block_w = dec->width - (x << dec->scale_shift) < scale
+                           ? dec->width - (x << dec->scale_shift)
+                           : scale;
+    uint32_t count = block_w * block_h;
+    uint16_t *sum = &sums[4 * x];
+
+    row[x].red = (sum[0] + count / 2) / count;
+    row[x].green = (sum[1] + count / 2) / count;
+    row[x].blue = (sum[2] + count / 2) / count;
+    row[x].alpha = (sum[3] + count / 2) / count;
+  }
+
+  memset(sums, 0, sizeof(uint16_t) * 4 * dec->px_width);
+}
+
+/* Close the current pass and hand its preview to the progress callback */
+void end_png_pass(struct png_decoder *dec) {
+  // Blocks of a scaled interlaced image are complete after the last pass
+  if (dec->sums && dec->num_passes > 1 && dec->pass + 1 == dec->num_passes) {
+    for (uint32_t y = 0; y < dec->px_rows; y++) {
+      emit_png_scaled_row(dec, y);
+    }
+  }
+
+  if (dec->progress) {
+    fill_png_preview(dec);
+    dec->stopped =
+        dec->progress(dec->preview, dec->pass + 1, dec->progress_arg);
+  }
+
+  dec->pass++;
+}
+
+/* Move on to the first pass, starting from the current one, that has any
+ * pixels. Passes of images narrower or shorter than 5 pixels can be empty, in
+ * which case they have no scanlines at all. */
+void start_png_pass(struct png_decoder *dec) {
+  for (; !is_png_decode_complete(dec) && !dec->stopped; end_png_pass(dec)) {
+    const struct png_pass *pass = &dec->passes[dec->pass];
+
+    dec->pass_width = (dec->width + pass->dx - 1 - pass->x0) / pass->dx;
+    dec->pass_height = (dec->height + pass->dy - 1 - pass->y0) / pass->dy;
+
+    if (dec->pass_width && dec->pass_height) {
+      dec->row = 0;
+      dec->row_bytes = get_png_row_bytes(dec->ihdr_chunk, dec->pass_width);
+      set_png_decoder_scanline(dec);
+      return;
+    }
+  }
+}
+
+/* Build the table that expands palette and grayscale scanlines. Palette
+ * entries take their alpha from tRNS, gray levels are scaled to 8 bits and the
+ * tRNS gray level becomes transparent. Out-of-range palette indices come out
+ * as opaque black. */
+void build_png_expand_table(struct png_decoder *dec, png_chunk_plte *plte_chunk,
+                            png_chunk_trns *trns_chunk) {
+  struct pixel lut[256];
+  uint32_t levels = 1 << dec->bit_depth;
+
+  for (uint32_t idx = 0; idx < 256; idx++) {
+    lut[idx].red = lut[idx].green = lut[idx].blue = 0;
+    lut[idx].alpha = 0xff;
+  }
+
+  if (dec->color_type == PNG_IHDR_COLOR_PALETTE) {
+    struct plte_entry *plte_entries =
+        (struct plte_entry *)plte_chunk->chunk_data;
+    uint8_t *trns_entries = trns_chunk ? trns_chunk->chunk_data : NULL;
+
+    for (uint32_t idx = 0; idx < plte_chunk->length / 3; idx++) {
+      lut[idx].red = plte_entries[idx].red;
+      lut[idx].green = plte_entries[idx].green;
+      lut[idx].blue = plte_entries[idx].blue;
+    }
+
+    for (uint32_t idx = 0; trns_chunk && idx < trns_chunk->length; idx++) {
+      lut[idx].alpha = trns_entries[idx];
+    }
+  } else {
+    for (uint32_t idx = 0; idx < levels; idx++) {
+      uint8_t gray = idx * 0xff / (levels - 1);
+      lut[idx].red = lut[idx].green = lut[idx].blue = gray;
+    }
+
+    if (dec->key && dec->key[0] < levels) {
+      lut[dec->key[0]].alpha = 0;
+    }
+  }
+
+  build_expand_table(lut, dec->bit_depth, dec->expand_table);
+}
+
+/* zlib allocates its state through the allocator of the decoder */
+voidpf alloc_png_zlib_memory(voidpf opaque, uInt items, uInt size) {
+  return alloc_png_memory(opaque, (size_t)items * size);
+}
+
+void free_png_zlib_memory(voidpf opaque, voidpf ptr) {
+  free_png_memory(opaque, ptr);
+}
+
+/* Set up everything of a decoder but its inflate state: see
+ * start_png_decode */
+int prepare_png_decode(struct png_decoder *dec, png_chunk_ihdr *ihdr_chunk,
+                       png_chunk_plte *plte_chunk, png_chunk_trns *trns_chunk,
+                       const struct image_view *dst, uint32_t scale_shift,
+                       const struct png_allocator *allocator) {
   struct png_header_ihdr *ihdr_header =
       (struct png_header_ihdr *)ihdr_chunk->chunk_data;
 
-  switch (ihdr_header->interlace) {
-  case PNG_IHDR_INTERLACE_NO_INTERLACE:
-    return parse_png_no_interlace(ihdr_chunk, plte_chunk, inflated_buf,
-                                  inflated_size);
-  case PNG_IHDR_INTERLACE_ADAM7:
-  default:
-    return NULL;
+  memset(dec, 0, sizeof(*dec));
+  dec->allocator = allocator;
+  dec->ihdr_chunk = ihdr_chunk;
+  dec->color_type = ihdr_header->color_type;
+  dec->bit_depth = ihdr_header->bit_depth;
+  dec->width = ihdr_header->width;
+  dec->height = ihdr_header->height;
+  dec->px = dst->px;
+  dec->px_rows = dst->size_y;
+  dec->px_width = dst->size_x;
+  dec->px_stride = dst->stride / sizeof(struct pixel);
+  dec->passes = png_single_pass;
+  dec->num_passes = 1;
+
+  // Adam7 passes go over every row of the image again and again
+  if (is_interlaced(ihdr_chunk)) {
+    if ((uint64_t)dec->px_rows << scale_shift < dec->height) {
+      return 1;
+    }
+
+    dec->passes = png_adam7_passes;
+    dec->num_passes = 7;
+  }
+
+  // The palette must precede the image data
+  if (ihdr_header->color_type == PNG_IHDR_COLOR_PALETTE && !plte_chunk) {
+    return 1;
+  }
+
+  dec->row_bytes = get_png_row_bytes(ihdr_chunk, dec->width);
+  dec->bpp = get_png_filter_bpp(ihdr_chunk);
+
+  // Scanlines must fit a 32-bit byte count
+  if (!dec->width || !dec->height || !dec->row_bytes) {
+    return 1;
+  }
+
+  // The transparent color of grayscale and RGB images
+  if (trns_chunk && dec->color_type != PNG_IHDR_COLOR_PALETTE) {
+    uint8_t *key = trns_chunk->chunk_data;
+
+    for (uint32_t idx = 0; idx < trns_chunk->length / 2; idx++) {
+      dec->trns_key[idx] = key[2 * idx] << 8 | key[2 * idx + 1];
+    }
+    dec->key = dec->trns_key;
+  }
+
+  if (dec->color_type == PNG_IHDR_COLOR_PALETTE ||
+      (dec->color_type == PNG_IHDR_COLOR_GRAYSCALE && dec->bit_depth <= 8)) {
+    build_png_expand_table(dec, plte_chunk, trns_chunk);
+  }
+
+  if (dec->px_width != dec->width || scale_shift ||
+      !is_png_row_in_place(ihdr_chunk, dec->px_rows)) {
+    dec->ring_rows = 2;
+    dec->row_buf = alloc_png_memory(allocator, 2 * (size_t)dec->row_bytes);
+    if (!dec->row_buf) {
+      return 1;
+    }
+  }
+
+  // Scaled scanlines are converted here before they are summed up
+  if (dec->num_passes > 1 || scale_shift) {
+    dec->pass_px =
+        alloc_png_memory(allocator, sizeof(struct pixel) * dec->width);
+    if (!dec->pass_px) {
+      return 1;
+    }
+  }
+
+  if (scale_shift) {
+    size_t sums_size;
+
+    dec->scale_shift = scale_shift;
+    dec->sum_rows = dec->num_passes > 1 ? dec->px_rows : 1;
+    sums_size = sizeof(uint16_t) * 4 * dec->px_width * dec->sum_rows;
+
+    dec->sums = alloc_png_memory(allocator, sums_size);
+    if (!dec->sums) {
+      return 1;
+    }
+    memset(dec->sums, 0, sums_size);
+  }
+
+  for (uint32_t p = 0; p < dec->num_passes; p++) {
+    const struct png_pass *pass = &dec->passes[p];
+
+    if (dec->width > pass->x0) {
+      dec->rows_total += (dec->height + pass->dy - 1 - pass->y0) / pass->dy;
+    }
+  }
+  dec->last_row = dec->rows_total;
+
+  start_png_pass(dec);
+  return 0;
+}
+
+/* Prepare the decoder for the first IDAT chunk. Decoded rows go to dst, whose
+ * size_y rows are px_rows rows of the image. Its stride must be resolved.
+ * Scratch memory comes from allocator.
+ *
+ * With a scale_shift, the image is reduced by 2^scale_shift while it is
+ * decoded, and dst holds all of the reduced image.
+ */
+int start_png_decode(struct png_decoder *dec, png_chunk_ihdr *ihdr_chunk,
+                     png_chunk_plte *plte_chunk, png_chunk_trns *trns_chunk,
+                     const struct image_view *dst, uint32_t scale_shift,
+                     const struct png_allocator *allocator) {
+  if (prepare_png_decode(dec, ihdr_chunk, plte_chunk, trns_chunk, dst,
+                         scale_shift, allocator)) {
+    return 1;
+  }
+
+  /* allocate inflate state */
+  if (allocator) {
+    dec->strm.zalloc = alloc_png_zlib_memory;
+    dec->strm.zfree = free_png_zlib_memory;
+    dec->strm.opaque = (voidpf)allocator;
+  } else {
+    dec->strm.zalloc = Z_NULL;
+    dec->strm.zfree = Z_NULL;
+    dec->strm.opaque = Z_NULL;
+  }
+  dec->strm.avail_in = 0;
+  dec->strm.next_in = Z_NULL;
+
+  if (inflateInit(&dec->strm) != Z_OK) {
+    return 1;
+  }
+
+  dec->stream_end = 0;
+  return 0;
+}
+
+/* Start a decoder like start_png_decode, but keep the inflate state that it
+ * was set up with for an earlier image, as the decoder of a codec context
+ * does. The state is only reset, and it outlives the decode. */
+int restart_png_decode(struct png_decoder *dec, png_chunk_ihdr *ihdr_chunk,
+                       png_chunk_plte *plte_chunk, png_chunk_trns *trns_chunk,
+                       const struct image_view *dst, uint32_t scale_shift,
+                       const struct png_allocator *allocator) {
+  // zlib refers back to the stream, which has to stay where it is
+  z_stream strm = dec->strm;
+  int result = prepare_png_decode(dec, ihdr_chunk, plte_chunk, trns_chunk, dst,
+                                  scale_shift, allocator);
+
+  dec->strm = strm;
+  dec->kept = 1;
+  dec->strm.avail_in = 0;
+  dec->strm.next_in = Z_NULL;
+
+  return result || inflateReset(&dec->strm) != Z_OK;
+}
+
+/* Point a decoder that was started on the whole image at one band of a file
+ * with a band index. The band is raw deflate data, which starts at first_row
+ * of a non-interlaced image. A decoder can go through any number of bands,
+ * its inflate state is reused. */
+int start_png_band_decode(struct png_decoder *dec, uint32_t first_row) {
+  if (dec->num_passes > 1 || first_row >= dec->height) {
+    return 1;
+  }
+
+  if (inflateReset2(&dec->strm, -MAX_WBITS) != Z_OK) {
+    return 1;
+  }
+
+  dec->stream_end = 0;
+  dec->raw = 1;
+  dec->adler = adler32(0L, Z_NULL, 0);
+  dec->first_row = dec->row = dec->rows_done = first_row;
+  set_png_decoder_scanline(dec);
+  return 0;
+}
+
+/* Convert an RGBA scanline that could not be inflated in place */
+void convert_rgb_alpha_scanline(uint8_t *scanline, struct pixel *px,
+                                uint32_t width) {
+  memcpy(px, scanline, sizeof(struct pixel) * width);
+}
+
+/* Undo the filter of the freshly inflated scanline. The previous scanline is
+ * either the row above in px or the one before in row_buf. */
+int reverse_filter_on_scanlines(struct png_decoder *dec) {
+  uint8_t *prev = NULL;
+
+  if (dec->row > dec->first_row) {
+    if (dec->row_buf) {
+      prev = dec->row_buf +
+             (size_t)((dec->row - 1) % dec->ring_rows) * dec->row_bytes;
+    } else {
+      prev = (uint8_t *)get_png_decoder_row(dec, dec->row - 1);
+    }
+  }
+
+  return unfilter_scanline(dec->filter_type, dec->scanline, prev,
+                           dec->row_bytes, dec->bpp);
+}
+
+/* Check the filter of the freshly inflated scanline and undo it */
+int unfilter_png_scanline(struct png_decoder *dec) {
+  if (!is_filter_type_valid(dec->filter_type)) {
+    return 1;
+  }
+
+  // A band cannot refer to the row above it, which belongs to another band
+  if (dec->first_row && dec->row == dec->first_row &&
+      dec->filter_type > PNG_FILTER_TYPE_SUB) {
+    return 1;
+  }
+
+  return reverse_filter_on_scanlines(dec);
+}
+
+/* Dispatch function for unfiltering the freshly inflated scanline and
+ * expanding width of its pixels, starting with pixel x0, into px */
+int convert_scanline_to_pixels(struct png_decoder *dec, struct pixel *px,
+                               uint32_t x0, uint32_t width) {
+  const uint8_t *src = dec->scanline;
+
+  if (unfilter_png_scanline(dec)) {
+    return 1;
+  }
+
+  if (dec->bit_depth < 8) {
+    uint32_t per_byte = 8 / dec->bit_depth;
+    uint32_t lead = x0 % per_byte;
+
+    src += x0 / per_byte;
+
+    // x0 may be in the middle of a byte, whose pixels the table has in a row
+    if (lead) {
+      uint32_t count = per_byte - lead < width ? per_byte - lead : width;
+
+      memcpy(px, dec->expand_table + per_byte * *src + lead,
+             sizeof(struct pixel) * count);
+      px += count;
+      width -= count;
+      src++;
+    }
+  } else {
+    src += (size_t)x0 * dec->bpp;
+  }
+
+  switch (dec->color_type) {
+  case PNG_IHDR_COLOR_PALETTE:
+    expand_packed(src, px, width, dec->bit_depth, dec->expand_table);
+    return 0;
+  case PNG_IHDR_COLOR_GRAYSCALE:
+    if (dec->bit_depth == 16) {
+      expand_gray16(src, px, width, dec->key);
+    } else {
+      expand_packed(src, px, width, dec->bit_depth, dec->expand_table);
+    }
+    return 0;
+  case PNG_IHDR_COLOR_RGB:
+    if (dec->bit_depth == 16) {
+      expand_rgb16(src, px, width, dec->key);
+    } else {
+      expand_rgb8(src, px, width, dec->key);
+    }
+    return 0;
+  case PNG_IHDR_COLOR_GRAYSCALE_ALPHA:
+    if (dec->bit_depth == 16) {
+      expand_gray_alpha16(src, px, width);
+    } else {
+      expand_gray_alpha8(src, px, width);
+    }
+    return 0;
+  case PNG_IHDR_COLOR_RGB_ALPHA:
+    if (dec->bit_depth == 16) {
+      expand_rgb_alpha16(src, px, width);
+    } else if (src != (uint8_t *)px) {
+      convert_rgb_alpha_scanline((uint8_t *)src, px, width);
+    }
+    return 0;
+  default:
+    return 1;
+  }
+}
+
+/* Copy the pixels of an interlaced scanline to their columns of the row */
+void scatter_pass_pixels(struct png_decoder *dec, struct pixel *row) {
+  const struct png_pass *pass = &dec->passes[dec->pass];
+
+  for (uint32_t i = 0; i < dec->pass_width; i++) {
+    row[pass->x0 + i * pass->dx] = dec->pass_px[i];
+  }
+}
+
+/* Convert a freshly inflated scanline and add its pixels to the sums of
+ * their blocks. A row of blocks of a non-interlaced image is complete with
+ * its last scanline. */
+int scale_scanline_to_image(struct png_decoder *dec) {
+  const struct png_pass *pass = &dec->passes[dec->pass];
+  uint32_t y = get_png_pass_y(dec, dec->row);
+  uint32_t block_y = y >> dec->scale_shift;
+  uint16_t *sums =
+      dec->sums + (size_t)(block_y % dec->sum_rows) * dec->px_width * 4;
+
+  if (convert_scanline_to_pixels(dec, dec->pass_px, 0, dec->pass_width)) {
+    return 1;
+  }
+
+  for (uint32_t i = 0; i < dec->pass_width; i++) {
+    uint16_t *sum = &sums[4 * ((pass->x0 + i * pass->dx) >> dec->scale_shift)];
+
+    sum[0] += dec->pass_px[i].red;
+    sum[1] += dec->pass_px[i].green;
+    sum[2] += dec->pass_px[i].blue;
+    sum[3] += dec->pass_px[i].alpha;
+  }
+
+  if (dec->num_passes == 1 &&
+      ((y + 1) >> dec->scale_shift != block_y || y + 1 == dec->height)) {
+    emit_png_scaled_row(dec, block_y);
+  }
+
+  return 0;
+}
+
+/* Convert a freshly inflated scanline into its row of the image */
+int convert_scanline_to_image(struct png_decoder *dec) {
+  uint32_t y = get_png_pass_y(dec, dec->row);
+  // A region only converts its own columns
+  uint32_t width =
+      dec->pass_width < dec->px_width ? dec->pass_width : dec->px_width;
+  struct pixel *row, *px;
+
+  if (dec->scale_shift) {
+    return scale_scanline_to_image(dec);
+  }
+
+  // Rows above a region are only needed to unfilter the rows below them
+  if (y < dec->y0) {
+    return unfilter_png_scanline(dec);
+  }
+
+  row = get_png_decoder_row(dec, y - dec->y0);
+  px = dec->passes[dec->pass].dx > 1 ? dec->pass_px : row;
+
+  if (convert_scanline_to_pixels(dec, px, dec->x0, width)) {
+    return 1;
+  }
+
+  if (px != row) {
+    scatter_pass_pixels(dec, row);
+  }
+
+  return 0;
+}
+
+/* A decoder whose scanlines are unfiltered and converted on a second thread.
+ * The decoder inflates scanlines into its ring and hands them over one by
+ * one. The converter works through them in order, with a copy of the decoder
+ * of its own, one row behind. A slot of the ring is reused once the converter
+ * is done with its scanline and with the next one, which is unfiltered
+ * against it.
+ *
+ * Unfiltering refers to the row above, so a single converter is all the rows
+ * can keep busy.
+ */
+struct png_pipeline {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t inflated;  // rows_inflated went up, or closed was set
+  pthread_cond_t converted; // rows_converted went up, or failed was set
+  uint32_t rows_inflated;
+  uint32_t rows_converted;
+  int closed;
+  int failed;
+  struct png_decoder conv;
+};
+
+void *run_png_converter(void *arg) {
+  struct png_pipeline *pipe = arg;
+  struct png_decoder *conv = &pipe->conv;
+
+  for (uint32_t row = 0; row < conv->rows_total; row++) {
+    pthread_mutex_lock(&pipe->lock);
+    while (pipe->rows_inflated <= row && !pipe->closed) {
+      pthread_cond_wait(&pipe->inflated, &pipe->lock);
+    }
+
+    // The decoder gave up before this row
+    if (pipe->rows_inflated <= row) {
+      pthread_mutex_unlock(&pipe->lock);
+      break;
+    }
+    pthread_mutex_unlock(&pipe->lock);
+
+    conv->row = row;
+    conv->scanline =
+        conv->row_buf + (size_t)(row % conv->ring_rows) * conv->row_bytes;
+    conv->filter_type = conv->filters[row % conv->ring_rows];
+
+    if (convert_scanline_to_image(conv)) {
+      pthread_mutex_lock(&pipe->lock);
+      pipe->failed = 1;
+      pthread_cond_signal(&pipe->converted);
+      pthread_mutex_unlock(&pipe->lock);
+      break;
+    }
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->rows_converted = row + 1;
+    pthread_cond_signal(&pipe->converted);
+    pthread_mutex_unlock(&pipe->lock);
+  }
+
+  return NULL;
+}
+
+/* Turn a decoder that was just started on a non-interlaced image at its full
+ * size into a pipeline. Its scanlines go to a ring, which the converter
+ * thread works through. Returns a non-zero value if the decoder has to do
+ * without, in which case it is left as it was. */
+int start_png_pipeline(struct png_decoder *dec, struct png_pipeline *pipe) {
+  uint32_t ring_rows = PNG_PIPELINE_RING_SIZE / dec->row_bytes;
+  uint8_t *ring;
+
+  if (dec->num_passes > 1 || dec->scale_shift || dec->x0 || dec->y0 ||
+      dec->rows_done) {
+    return 1;
+  }
+
+  // On a single core, the threads would only take turns
+  if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+    return 1;
+  }
+
+  if (ring_rows < PNG_PIPELINE_MIN_ROWS) {
+    ring_rows = PNG_PIPELINE_MIN_ROWS;
+  }
+
+  ring = alloc_png_memory(dec->allocator,
+                          (size_t)ring_rows * (dec->row_bytes + 1));
+  if (!ring) {
+    return 1;
+  }
+
+  memset(pipe, 0, sizeof(*pipe));
+  pthread_mutex_init(&pipe->lock, NULL);
+  pthread_cond_init(&pipe->inflated, NULL);
+  pthread_cond_init(&pipe->converted, NULL);
+
+  pipe->conv = *dec;
+  pipe->conv.row_buf = ring;
+  pipe->conv.ring_rows = ring_rows;
+  pipe->conv.filters = ring + (size_t)ring_rows * dec->row_bytes;
+
+  if (pthread_create(&pipe->thread, NULL, run_png_converter, pipe)) {
+    pthread_cond_destroy(&pipe->converted);
+    pthread_cond_destroy(&pipe->inflated);
+    pthread_mutex_destroy(&pipe->lock);
+    free_png_memory(dec->allocator, ring);
+    return 1;
+  }
+
+  free_png_memory(dec->allocator, dec->row_buf);
+  dec->row_buf = ring;
+  dec->ring_rows = ring_rows;
+  dec->filters = pipe->conv.filters;
+  dec->pipeline = pipe;
+  set_png_decoder_scanline(dec);
+  return 0;
+}
+
+/* Hand the freshly inflated scanline to the converter, and wait until the
+ * slot of the next one is free */
+int hand_off_png_scanline(struct png_decoder *dec) {
+  struct png_pipeline *pipe = dec->pipeline;
+  uint32_t next = dec->row + 1;
+  int failed;
+
+  dec->filters[dec->row % dec->ring_rows] = dec->filter_type;
+
+  pthread_mutex_lock(&pipe->lock);
+  pipe->rows_inflated = next;
+  pthread_cond_signal(&pipe->inflated);
+
+  if (next < dec->rows_total) {
+    while (pipe->rows_converted + dec->ring_rows < next + 2 && !pipe->failed) {
+      pthread_cond_wait(&pipe->converted, &pipe->lock);
+    }
+  }
+
+  failed = pipe->failed;
+  pthread_mutex_unlock(&pipe->lock);
+  return failed;
+}
+
+/* Let the converter finish the scanlines it was handed and wait for it.
+ * Returns a non-zero value if it failed or did not get every row. */
+int stop_png_pipeline(struct png_decoder *dec) {
+  struct png_pipeline *pipe = dec->pipeline;
+  int result;
+
+  pthread_mutex_lock(&pipe->lock);
+  pipe->closed = 1;
+  pthread_cond_signal(&pipe->inflated);
+  pthread_mutex_unlock(&pipe->lock);
+
+  pthread_join(pipe->thread, NULL);
+  result = pipe->failed || pipe->rows_converted != dec->rows_total;
+
+  pthread_cond_destroy(&pipe->converted);
+  pthread_cond_destroy(&pipe->inflated);
+  pthread_mutex_destroy(&pipe->lock);
+  dec->pipeline = NULL;
+  return result;
+}
+
+/* Inflate the pending input until the decoder has completed last_row
+ * scanlines or needs more input. Anything that follows the last scanline is
+ * inflated and dropped. Stops early if the progress callback asks for it. */
+int inflate_png_scanlines(struct png_decoder *dec, uint32_t last_row) {
+  int ret;
+  unsigned avail_out;
+  unsigned char excess[PNG_OUTPUT_CHUNK_SIZE];
+  z_stream *strm = &dec->strm;
+
+  if (last_row > dec->rows_total) {
+    last_row = dec->rows_total;
+  }
+
+  /* run inflate() while there is input, or output zlib could not hand out */
+  while (!dec->stream_end && !dec->stopped &&
+         (dec->rows_done < last_row || last_row == dec->rows_total) &&
+         (strm->avail_in || !strm->avail_out)) {
+    if (is_png_decode_complete(dec)) {
+      strm->next_out = excess;
+      strm->avail_out = PNG_OUTPUT_CHUNK_SIZE;
+    } else if (!dec->row_filled) {
+      strm->next_out = &dec->filter_type;
+      strm->avail_out = 1;
+    } else {
+      strm->next_out = dec->scanline + dec->row_filled - 1;
+      strm->avail_out = dec->row_bytes - (dec->row_filled - 1);
+    }
+
+    avail_out = strm->avail_out;
+    ret = inflate(strm, Z_NO_FLUSH);
+
+    switch (ret) {
+    case Z_STREAM_END:
+      dec->stream_end = 1;
+      break;
+    case Z_OK:
+    case Z_BUF_ERROR:
+      break;
+    default:
+      return 1;
+    }
+
+    if (dec->raw) {
+      uInt length = avail_out - strm->avail_out;
+
+      dec->adler = adler32(dec->adler, strm->next_out - length, length);
+    }
+
+    if (is_png_decode_complete(dec)) {
+      continue;
+    }
+
+    dec->row_filled += avail_out - strm->avail_out;
+
+    // Scanline complete
+    if (dec->row_filled == 1 + dec->row_bytes) {
+      if (dec->pipeline ? hand_off_png_scanline(dec)
+                        : convert_scanline_to_image(dec)) {
+        return 1;
+      }
+
+      dec->row++;
+      dec->rows_done++;
+
+      if (dec->row < dec->pass_height) {
+        set_png_decoder_scanline(dec);
+      } else {
+        end_png_pass(dec);
+        start_png_pass(dec);
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* Hand the payload of one IDAT chunk to the decoder */
+void feed_png_decoder(struct png_decoder *dec, uint8_t *compressed_data,
+                      uint32_t input_length) {
+  dec->strm.next_in = compressed_data;
+  dec->strm.avail_in = input_length;
+}
+
+/* Decompress the payload of one IDAT chunk, scanline by scanline */
+int inflate_png_idat(struct png_decoder *dec, uint8_t *compressed_data,
+                     uint32_t input_length) {
+  feed_png_decoder(dec, compressed_data, input_length);
+
+  return inflate_png_scanlines(dec, dec->last_row);
+}
+
+/* Decompress the payload of one IDAT chunk whose CRC has not been checked
+ * yet. The CRC is computed slice by slice, right before the slice is
+ * inflated, so the data only comes into the cache once. */
+int inflate_png_idat_fused(struct png_decoder *dec, struct png_chunk *chunk) {
+  uint8_t *data = chunk->chunk_data;
+  uint32_t crc_value = get_png_chunk_type_crc(chunk);
+
+  for (uint32_t done = 0; done < chunk->length;) {
+    uint32_t slice = chunk->length - done < PNG_CRC_SLICE_SIZE
+                         ? chunk->length - done
+                         : PNG_CRC_SLICE_SIZE;
+
+    crc_value = crc32(crc_value, data + done, slice);
+
+    if (inflate_png_idat(dec, data + done, slice)) {
+      return 1;
+    }
+
+    done += slice;
+  }
+
+  return !is_png_crc_valid(chunk, crc_value);
+}
+
+/* Release whatever the decoder still owns */
+void abort_png_decode(struct png_decoder *dec) {
+  // The converter may still be working on the ring
+  if (dec->pipeline) {
+    (void)stop_png_pipeline(dec);
+  }
+
+  if (!dec->kept) {
+    (void)inflateEnd(&dec->strm);
+  }
+
+  if (dec->row_buf) {
+    free_png_memory(dec->allocator, dec->row_buf);
+    dec->row_buf = NULL;
+  }
+
+  if (dec->pass_px) {
+    free_png_memory(dec->allocator, dec->pass_px);
+    dec->pass_px = NULL;
+  }
+
+  if (dec->sums) {
+    free_png_memory(dec->allocator, dec->sums);
+    dec->sums = NULL;
+  }
+}
+
+/* Finish the IDAT train. The stream must be complete and must have covered
+ * every scanline. */
+int finish_png_decode(struct png_decoder *dec) {
+  int result = !dec->stream_end || !is_png_decode_complete(dec);
+
+  if (dec->pipeline && stop_png_pipeline(dec)) {
+    result = 1;
+  }
+
+  abort_png_decode(dec);
+  return result;
+}
+
+/* Allocate an image of size_x by size_y pixels */
+struct image *alloc_png_image(uint32_t size_x, uint32_t size_y) {
+  struct image *img;
+
+  // struct image cannot represent anything larger
+  if (!size_x || !size_y || size_x > UINT16_MAX || size_y > UINT16_MAX) {
+    return NULL;
+  }
+
+  img = malloc(sizeof(struct image));
+  if (!img) {
+    return NULL;
+  }
+
+  img->size_y = size_y;
+  img->size_x = size_x;
+  img->px = malloc(sizeof(struct pixel) * img->size_x * img->size_y);
+
+  if (!img->px) {
+    free(img);
+    return NULL;
+  }
+
+  return img;
+}
+
+/* One IDAT chunk of a mapped file, at offset in the zlib stream */
+struct png_idat_segment {
+  const uint8_t *data;
+  uint32_t length;
+  size_t offset;
+};
+
+/* The Adler-32 of what one band inflated, and how many bytes that was */
+struct png_band_sum {
+  uLong adler;
+  uLong length;
+};
+
+/* Bands of an image that are being inflated in parallel. Workers take the
+ * next band from next_band until there is none left or one of them failed. */
+struct png_band_job {
+  struct png_parser *parser;
+  const struct image_view *dst;
+  struct png_idat_segment *segments;
+  uint32_t segment_count;
+  size_t stream_length;
+  struct png_band_sum *sums;
+  size_t trailer; // Where the Adler-32 of the stream is, after the last band
+  uint32_t next_band;
+  int failed;
+};
+
+/* Inflate one band into its rows of the image. The band ends where the next
+ * one starts, or with the stream, which the last band has to reach. */
+int decode_png_band(struct png_band_job *job, struct png_decoder *dec,
+                    uint32_t band) {
+  struct png_parser *parser = job->parser;
+  int last = band + 1 == parser->band_count;
+  uint32_t first_row = band * parser->band_rows;
+  uint32_t last_row = job->dst->size_y - first_row > parser->band_rows
+                          ? first_row + parser->band_rows
+                          : job->dst->size_y;
+  size_t offset = parser->band_offsets[band];
+  size_t end = band + 1 < parser->band_count ? parser->band_offsets[band + 1]
+                                             : job->stream_length;
+  uint32_t seg = 0;
+
+  if (start_png_band_decode(dec, first_row)) {
+    return 1;
+  }
+
+  while (job->segments[seg].offset + job->segments[seg].length <= offset) {
+    seg++;
+  }
+
+  for (; offset < end && (dec->rows_done < last_row || last) &&
+         !dec->stream_end;
+       seg++) {
+    struct png_idat_segment *segment = &job->segments[seg];
+    size_t stop = segment->offset + segment->length;
+
+    if (stop > end) {
+      stop = end;
+    }
+
+    feed_png_decoder(dec, (uint8_t *)segment->data + (offset - segment->offset),
+                     stop - offset);
+
+    if (inflate_png_scanlines(dec, last_row)) {
+      return 1;
+    }
+
+    offset = stop - dec->strm.avail_in;
+  }
+
+  job->sums[band].adler = dec->adler;
+  job->sums[band].length = dec->strm.total_out;
+
+  if (last) {
+    if (!dec->stream_end || job->stream_length - offset < 4) {
+      return 1;
+    }
+    job->trailer = offset;
+  }
+
+  return dec->rows_done != last_row;
+}
+
+/* Does the Adler-32 at the end of the stream match the data of all bands? */
+int is_png_band_adler_valid(struct png_band_job *job) {
+  uLong adler = job->sums[0].adler;
+  uint32_t expected = 0;
+  size_t offset = job->trailer;
+
+  for (uint32_t band = 1; band < job->parser->band_count; band++) {
+    adler = adler32_combine(adler, job->sums[band].adler,
+                            (z_off_t)job->sums[band].length);
+  }
+
+  // The trailer may be split over two IDAT chunks
+  for (uint32_t seg = 0; seg < job->segment_count; seg++) {
+    struct png_idat_segment *segment = &job->segments[seg];
+
+    while (offset < segment->offset + segment->length &&
+           offset < job->trailer + 4) {
+      expected = expected << 8 | segment->data[offset - segment->offset];
+      offset++;
+    }
+  }
+
+  return adler == expected;
+}
+
+/* Every worker has a decoder of its own, which goes through the bands it
+ * takes one after the other */
+void *run_png_band_worker(void *arg) {
+  struct png_band_job *job = arg;
+  struct png_parser *parser = job->parser;
+  struct png_decoder dec;
+
+  if (start_png_decode(&dec, parser->ihdr_chunk, parser->plte_chunk,
+                       parser->trns_chunk, job->dst, 0, parser->allocator)) {
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    abort_png_decode(&dec);
+    return NULL;
+  }
+
+  while (!__atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+    uint32_t band = __atomic_fetch_add(&job->next_band, 1, __ATOMIC_RELAXED);
+
+    if (band >= parser->band_count) {
+      break;
+    }
+
+    if (decode_png_band(job, &dec, band)) {
+      __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  abort_png_decode(&dec);
+  return NULL;
+}
+
+/* Does the band index fit the image and the IDAT train? */
+int is_png_band_index_valid(struct png_parser *parser, size_t stream_length) {
+  uint32_t height = parser->ihdr_header.height;
+
+  if (!parser->band_rows || is_interlaced(parser->ihdr_chunk) ||
+      parser->band_count != (height - 1) / parser->band_rows + 1) {
+    return 0;
+  }
+
+  // The first band follows the two byte zlib header
+  if (parser->band_offsets[0] < 2) {
+    return 0;
+  }
+
+  for (uint32_t idx = 1; idx < parser->band_count; idx++) {
+    if (parser->band_offsets[idx] <= parser->band_offsets[idx - 1]) {
+      return 0;
+    }
+  }
+
+  return parser->band_offsets[parser->band_count - 1] < stream_length;
+}
+
+/* Inflate a file with a band index on all cores. The IDAT train is walked
+ * first, so its chunks can be handed out in any order. Only mapped files and
+ * PNGs in memory can be decoded this way: a streamed file does not keep its
+ * chunks around, and could not be rewound if this fails.
+ *
+ * Returns 0 if the whole image was decoded, and a non-zero value if it has to
+ * be decoded as one stream after all.
+ */
+int decode_png_bands(struct png_parser *parser, struct png_chunk *idat_chunk,
+                     const struct image_view *dst) {
+  struct png_band_job job;
+  pthread_t threads[PNG_MAX_BAND_THREADS];
+  uint32_t capacity = 0, thread_count = 0;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+  memset(&job, 0, sizeof(job));
+  job.parser = parser;
+  job.dst = dst;
+
+  do {
+    // The bands are inflated out of order, so IDAT CRCs are checked up front
+    if (parser->crc_mode == PNG_CRC_FUSED && !is_png_chunk_valid(idat_chunk)) {
+      goto error;
+    }
+
+    if (job.segment_count == capacity) {
+      struct png_idat_segment *segments;
+
+      capacity = capacity ? 2 * capacity : 16;
+      segments = resize_png_memory(parser->allocator, job.segments,
+                                   sizeof(*segments) * job.segment_count,
+                                   sizeof(*segments) * capacity);
+      if (!segments) {
+        goto error;
+      }
+      job.segments = segments;
+    }
+
+    job.segments[job.segment_count].data = idat_chunk->chunk_data;
+    job.segments[job.segment_count].length = idat_chunk->length;
+    job.segments[job.segment_count].offset = job.stream_length;
+    job.segment_count++;
+    job.stream_length += idat_chunk->length;
+  } while (!read_png_idat(parser, idat_chunk));
+
+  if (!is_png_parser_done(parser) ||
+      !is_png_band_index_valid(parser, job.stream_length)) {
+    goto error;
+  }
+
+  job.sums = alloc_png_memory(parser->allocator,
+                              sizeof(*job.sums) * parser->band_count);
+  if (!job.sums) {
+    goto error;
+  }
+
+  // The calling thread is a worker too
+  while (thread_count + 1 < parser->band_count &&
+         thread_count + 1 < (uint32_t)cores &&
+         thread_count < PNG_MAX_BAND_THREADS) {
+    if (pthread_create(&threads[thread_count], NULL, run_png_band_worker,
+                       &job)) {
+      break;
+    }
+    thread_count++;
+  }
+
+  run_png_band_worker(&job);
+
+  while (thread_count) {
+    pthread_join(threads[--thread_count], NULL);
+  }
+
+  // Raw inflate leaves the checksum to us
+  if (job.failed || !is_png_band_adler_valid(&job)) {
+    goto error;
+  }
+
+  free_png_memory(parser->allocator, job.sums);
+  free_png_memory(parser->allocator, job.segments);
+  return 0;
+
+error:
+  free_png_memory(parser->allocator, job.sums);
+  free_png_memory(parser->allocator, job.segments);
+  return 1;
+}
+
+/* Reads the signature and IHDR of a PNG and nothing else. They are the first
+ * 33 bytes of every valid file, so a single read is enough and the file is
+ * neither mapped nor walked any further. */
+int png_probe(const char *filename, struct png_info *info) {
+  uint8_t head[sizeof(struct png_header_filesig) + 3 * sizeof(int32_t) +
+               sizeof(struct png_header_ihdr)];
+  struct png_buffer buf;
+  struct png_header_filesig filesig;
+  struct png_header_ihdr ihdr_header;
+  struct png_chunk chunk;
+  size_t length = 0;
+  int fd = open(filename, O_RDONLY);
+
+  if (fd < 0) {
+    return 1;
+  }
+
+  // Pipes may hand the bytes out in pieces
+  while (length < sizeof(head)) {
+    ssize_t have = read(fd, head + length, sizeof(head) - length);
+    if (have <= 0) {
+      close(fd);
+      return 1;
+    }
+    length += have;
+  }
+
+  close(fd);
+
+  memset(&buf, 0, sizeof(buf));
+  buf.data = head;
+  buf.length = length;
+
+  if (read_png_filesig(&buf, &filesig) || !is_png_filesig_valid(&filesig)) {
+    return 1;
+  }
+
+  if (read_png_chunk(&buf, &chunk, PNG_CRC_CHECK) ||
+      !format_ihdr_chunk(&chunk, &ihdr_header)) {
+    return 1;
+  }
+
+  info->width = ihdr_header.width;
+  info->height = ihdr_header.height;
+  info->color_type = ihdr_header.color_type;
+  info->bit_depth = ihdr_header.bit_depth;
+  info->interlace = ihdr_header.interlace;
+  return 0;
+}
+
+/* Check that dst is size_x by size_y pixels and keeps the alignment it
+ * promises, and copy it to view with its stride resolved. Rows are whole
+ * pixels apart. */
+int resolve_image_view(const struct image_view *dst, uint32_t size_x,
+                       uint32_t size_y, struct image_view *view) {
+  size_t alignment = dst->alignment ? dst->alignment : 1;
+  size_t row_size = sizeof(struct pixel) * (size_t)dst->size_x;
+
+  if (!dst->px || dst->size_x != size_x || dst->size_y != size_y) {
+    return 1;
+  }
+
+  // The alignment is a power of 2 that px keeps
+  if (alignment & (alignment - 1) || (uintptr_t)dst->px % alignment) {
+    return 1;
+  }
+
+  *view = *dst;
+  if (!view->stride) {
+    size_t step = alignment > sizeof(struct pixel) ? alignment
+                                                   : sizeof(struct pixel);
+
+    view->stride = (row_size + step - 1) / step * step;
+  }
+
+  return view->stride < row_size || view->stride % sizeof(struct pixel) ||
+         view->stride % alignment;
+}
+
+/* Start dec on the image of the parser, see start_png_decode. If dec is the
+ * decoder of the codec context that the load runs in, its inflate state is
+ * reused. */
+int start_png_image_decode(struct png_parser *parser, struct png_decoder *dec,
+                           const struct image_view *dst,
+                           uint32_t scale_shift) {
+  if (dec == parser->decoder) {
+    return restart_png_decode(dec, parser->ihdr_chunk, parser->plte_chunk,
+                              parser->trns_chunk, dst, scale_shift,
+                              parser->allocator);
+  }
+
+  return start_png_decode(dec, parser->ihdr_chunk, parser->plte_chunk,
+                          parser->trns_chunk, dst, scale_shift,
+                          parser->allocator);
+}
+
+/* Inflate the IDAT train that starts with idat_chunk into dst, reducing the
+ * image by 2^scale_shift on the way. Interlaced images are previewed in
+ * preview after every pass if progress is set, and dst must view preview
+ * then. With pipeline set, other images are converted on a second thread.
+ *
+ * Returns 0 if the image was decoded, or if progress stopped the decode, and
+ * a non-zero value on failure.
+ */
+int decode_png_image(struct png_parser *parser, struct png_chunk *idat_chunk,
+                     const struct image_view *dst, uint32_t scale_shift,
+                     int pipeline, struct image *preview,
+                     png_progress_fn progress, void *arg) {
+  struct png_decoder fresh, *dec = parser->decoder ? parser->decoder : &fresh;
+  struct png_pipeline pipe;
+
+  // Files with a band index can be inflated on all cores. The blocks of a
+  // scaled image may span bands, so those are inflated as one stream, and so
+  // are streamed files, which the band decode cannot walk twice.
+  if (parser->band_offsets && !scale_shift && !parser->input.file) {
+    if (!decode_png_bands(parser, idat_chunk, dst)) {
+      return 0;
+    }
+
+    // The index does not fit the image data, inflate it as one stream
+    rewind_png_parser(parser);
+    if (read_png_idat(parser, idat_chunk)) {
+      return 1;
+    }
+  }
+
+  if (start_png_image_decode(parser, dec, dst, scale_shift)) {
+    goto error;
+  }
+
+  if (preview && !scale_shift && is_interlaced(parser->ihdr_chunk)) {
+    dec->progress = progress;
+    dec->progress_arg = arg;
+    dec->preview = preview;
+  }
+
+  // Without a second thread, the image is decoded on this one
+  if (pipeline) {
+    (void)start_png_pipeline(dec, &pipe);
+  }
+
+  // Inflate IDAT data straight from the buffer
+  do {
+    int ret;
+
+    prefetch_png_buffer(&parser->input);
+
+    if (parser->crc_mode == PNG_CRC_FUSED) {
+      ret = inflate_png_idat_fused(dec, idat_chunk);
+    } else {
+      ret = inflate_png_idat(dec, idat_chunk->chunk_data, idat_chunk->length);
+    }
+
+    if (ret) {
+      goto error;
+    }
+
+    release_png_buffer(&parser->input);
+  } while (!dec->stopped && !read_png_idat(parser, idat_chunk));
+
+  // The caller settled for the preview
+  if (dec->stopped) {
+    abort_png_decode(dec);
+    return 0;
+  }
+
+  // After we finish looping, we should have processed IEND
+  if (!is_png_parser_done(parser)) {
+    goto error;
+  }
+
+  return finish_png_decode(dec);
+
+error:
+  abort_png_decode(dec);
+  return 1;
+}
+
+/* Inflate the IDAT train that starts with idat_chunk only as far as the last
+ * row of the region of the image at x0, y0 that dst views, and read no
+ * further. The image must not be interlaced.
+ *
+ * Returns 0 if the region was decoded and a non-zero value on failure.
+ */
+int decode_png_region(struct png_parser *parser, struct png_chunk *idat_chunk,
+                      const struct image_view *dst, uint32_t x0, uint32_t y0) {
+  struct png_decoder fresh, *dec = parser->decoder ? parser->decoder : &fresh;
+  int result = 1;
+
+  if (start_png_image_decode(parser, dec, dst, 0)) {
+    goto out;
+  }
+
+  dec->x0 = x0;
+  dec->y0 = y0;
+  dec->last_row = y0 + dst->size_y;
+
+  do {
+    int ret;
+
+    prefetch_png_buffer(&parser->input);
+
+    if (parser->crc_mode == PNG_CRC_FUSED) {
+      ret = inflate_png_idat_fused(dec, idat_chunk);
+    } else {
+      ret = inflate_png_idat(dec, idat_chunk->chunk_data, idat_chunk->length);
+    }
+
+    if (ret) {
+      goto out;
+    }
+
+    release_png_buffer(&parser->input);
+  } while (dec->rows_done < dec->last_row &&
+           !read_png_idat(parser, idat_chunk));
+
+  result = dec->rows_done < dec->last_row;
+
+out:
+  abort_png_decode(dec);
+  return result;
+}
+
+/* Copy the region of img at x0, y0 into dst */
+void crop_png_image(struct image *img, uint32_t x0, uint32_t y0,
+                    const struct image_view *dst) {
+  for (uint32_t y = 0; y < dst->size_y; y++) {
+    memcpy((uint8_t *)dst->px + y * dst->stride,
+           &img->px[(size_t)(y0 + y) * img->size_x + x0],
+           sizeof(struct pixel) * dst->size_x);
+  }
+}
+
+/* The deflate parameters of a store, see struct png_store_opts */
+struct png_deflate_params {
+  int level;
+  int strategy;
+  int mem_level;
+  int window_bits;
+};
+
+/* Deflate state and scratch buffers of a store. A store without a codec
+ * context sets one up and releases it at the end. */
+struct png_encoder {
+  z_stream strm;
+  int deflate_ready;
+  struct png_deflate_params params;        // Those of the current store
+  struct png_deflate_params stream_params; // Those strm was set up with
+  int threads; // That deflate the blocks of the current store, 0 for all
+  uint32_t idat_size; // Largest IDAT chunk of the current store
+  uint8_t *scanlines; // Filtered scanlines, ready for deflate
+  size_t scanlines_size;
+  uint8_t *compressed; // The zlib stream
+  size_t compressed_size;
+};
+
+/* What a codec context keeps from one image to the next: a decoder with its
+ * inflate state, an arena for the rest of the temporary memory of loads, and
+ * an encoder. */
+struct png_codec_ctx {
+  struct png_arena *arena;
+  struct png_allocator allocator;
+  struct png_decoder dec;
+  int inflate_ready;
+  struct png_encoder enc;
+};
+
+/* The decoder of a codec context, with its inflate state set up the first
+ * time. Returns NULL if that fails. */
+struct png_decoder *get_png_ctx_decoder(struct png_codec_ctx *ctx) {
+  if (!ctx->inflate_ready) {
+    memset(&ctx->dec.strm, 0, sizeof(ctx->dec.strm));
+    if (inflateInit(&ctx->dec.strm) != Z_OK) {
+      return NULL;
+    }
+    ctx->inflate_ready = 1;
+  }
+
+  return &ctx->dec;
+}
+
+/* What a load produces: a new image in img, or the pixels of dst if that is
+ * not NULL. A region of size_x by size_y pixels at x0, y0 is decoded instead
+ * of the whole image if size_x is not 0. Otherwise, the whole image may be
+ * reduced by 2^scale_shift, or converted on a second thread if pipeline is
+ * set. Interlaced images are previewed after every pass if progress is set. */
+struct png_load_target {
+  struct image **img;
+  const struct image_view *dst;
+  uint32_t x0;
+  uint32_t y0;
+  uint32_t size_x;
+  uint32_t size_y;
+  uint32_t scale_shift;
+  int pipeline;
+  png_progress_fn progress;
+  void *arg;
+};
+
+/* Reads a Y0l0 PNG from an open parser and parses it into the target. The
+ * parser is closed in any case.
+ *
+ * The chunks of the file are walked in place. The image is the only large
+ * allocation: the IDAT train is inflated into it scanline by scanline.
+ */
+int load_png_parser(struct png_parser *parser,
+                    const struct png_load_target *target) {
+  struct png_chunk idat_chunk;
+  struct image_view view;
+  struct image *image = NULL, *full = NULL;
+  uint32_t x0 = 0, y0 = 0, size_x, size_y;
+
+  // The first IDAT chunk. IHDR and PLTE must come before it.
+  if (read_png_idat(parser, &idat_chunk)) {
+    goto error;
+  }
+
+  size_x = parser->ihdr_header.width;
+  size_y = parser->ihdr_header.height;
+
+  if (target->size_x) {
+    // The region has to lie within the image
+    if (target->x0 >= size_x || target->size_x > size_x - target->x0 ||
+        target->y0 >= size_y || !target->size_y ||
+        target->size_y > size_y - target->y0) {
+      goto error;
+    }
+
+    x0 = target->x0;
+    y0 = target->y0;
+    size_x = target->size_x;
+    size_y = target->size_y;
+  } else if (target->scale_shift) {
+    uint32_t scale = 1u << target->scale_shift;
+
+    size_x = (size_x - 1) / scale + 1;
+    size_y = (size_y - 1) / scale + 1;
+  }
+
+  if (target->dst) {
+    if (resolve_image_view(target->dst, size_x, size_y, &view)) {
+      goto error;
+    }
+  } else {
+    image = alloc_png_image(size_x, size_y);
+    if (!image) {
+      goto error;
+    }
+
+    view.px = image->px;
+    view.size_x = image->size_x;
+    view.size_y = image->size_y;
+    view.stride = sizeof(struct pixel) * image->size_x;
+    view.alignment = 0;
+  }
+
+  if (!target->size_x) {
+    if (decode_png_image(parser, &idat_chunk, &view, target->scale_shift,
+                         target->pipeline, image, target->progress,
+                         target->arg)) {
+      goto error;
+    }
+  } else if (!is_interlaced(parser->ihdr_chunk)) {
+    if (decode_png_region(parser, &idat_chunk, &view, x0, y0)) {
+      goto error;
+    }
+  } else {
+    struct image_view full_view;
+
+    // Every pass covers the whole image, so it is decoded and cropped
+    full = alloc_png_image(parser->ihdr_header.width,
+                           parser->ihdr_header.height);
+    if (!full) {
+      goto error;
+    }
+
+    full_view.px = full->px;
+    full_view.size_x = full->size_x;
+    full_view.size_y = full->size_y;
+    full_view.stride = sizeof(struct pixel) * full->size_x;
+    full_view.alignment = 0;
+
+    if (decode_png_image(parser, &idat_chunk, &full_view, 0, 0, NULL, NULL,
+                         NULL)) {
+      goto error;
+    }
+
+    crop_png_image(full, x0, y0, &view);
+    free(full->px);
+    free(full);
+  }
+
+  close_png_parser(parser);
+  if (image) {
+    *target->img = image;
+  }
+  return 0;
+
+error:
+  if (full) {
+    free(full->px);
+    free(full);
+  }
+
+  if (image) {
+    free(image->px);
+    free(image);
+  }
+
+  close_png_parser(parser);
+  return 1;
+}
+
+/* Reads a Y0l0 PNG from the file denoted by filename or, if that is NULL,
+ * from the len bytes at buf, into the target. A file is memory mapped, or
+ * streamed if it cannot be mapped, and memory is walked where it is.
+ *
+ * Temporary memory comes from the allocator in opts, or from an arena that
+ * only lives for this load.
+ */
+int load_png_input(const char *filename, const uint8_t *buf, size_t len,
+                   const struct png_load_opts *opts,
+                   const struct png_load_target *target) {
+  struct png_parser parser;
+  struct png_load_target scaled = *target;
+  struct png_arena *arena = NULL;
+  struct png_allocator arena_allocator;
+  const struct png_allocator *allocator = opts ? opts->allocator : NULL;
+  struct png_codec_ctx *ctx = opts ? opts->ctx : NULL;
+  int result = 1;
+
+  // The image can be reduced by 2, 4 or 8
+  if (opts && opts->scale > 1) {
+    if (opts->scale > 8 || opts->scale & (opts->scale - 1)) {
+      return 1;
+    }
+
+    while (1u << scaled.scale_shift < (uint32_t)opts->scale) {
+      scaled.scale_shift++;
+    }
+  }
+
+  if (!allocator && ctx) {
+    allocator = &ctx->allocator;
+  }
+
+  if (!allocator) {
+    arena = png_arena_create();
+    if (!arena) {
+      return 1;
+    }
+
+    arena_allocator = png_arena_allocator(arena);
+    allocator = &arena_allocator;
+  }
+
+  if (filename ? open_png_parser(filename, &parser, allocator)
+               : open_png_parser_memory(buf, len, &parser, allocator)) {
+    goto out;
+  }
+
+  if (opts) {
+    parser.crc_mode = opts->crc;
+    scaled.pipeline = opts->pipeline;
+  }
+
+  if (ctx) {
+    parser.decoder = get_png_ctx_decoder(ctx);
+  }
+
+  result = load_png_parser(&parser, &scaled);
+
+out:
+  png_arena_destroy(arena);
+  return result;
+}
+
+int load_png_progressive(const char *filename, struct image **img,
+                         png_progress_fn progress, void *arg) {
+  struct png_load_target target = {.img = img, .progress = progress,
+                                   .arg = arg};
+
+  return load_png_input(filename, NULL, 0, NULL, &target);
+}
+
+int load_png_ex(const char *filename, struct image **img,
+                const struct png_load_opts *opts) {
+  struct png_load_target target = {.img = img};
+
+  return load_png_input(filename, NULL, 0, opts, &target);
+}
+
+int load_png_into(const char *filename, const struct image_view *dst) {
+  struct png_load_target target = {.dst = dst};
+
+  return load_png_input(filename, NULL, 0, NULL, &target);
+}
+
+int load_png_region(const char *filename, uint32_t x0, uint32_t y0,
+                    uint32_t w, uint32_t h, struct image **img) {
+  struct png_load_target target = {
+      .img = img, .x0 = x0, .y0 = y0, .size_x = w, .size_y = h};
+
+  // A region of nothing would be taken for the whole image
+  if (!w || !h) {
+    return 1;
+  }
+
+  return load_png_input(filename, NULL, 0, NULL, &target);
+}
+
+int load_png_mem(const uint8_t *buf, size_t len, struct image **img) {
+  struct png_load_target target = {.img = img};
+
+  return load_png_input(NULL, buf, len, NULL, &target);
+}
+
+int load_png_mem_ex(const uint8_t *buf, size_t len, struct image **img,
+                    const struct png_load_opts *opts) {
+  struct png_load_target target = {.img = img};
+
+  return load_png_input(NULL, buf, len, opts, &target);
+}
+
+int load_png(const char *filename, struct image **img) {
+  return load_png_progressive(filename, img, NULL, NULL);
+}
+
+int load_png_ctx(const char *filename, struct image **img,
+                 struct png_codec_ctx *ctx) {
+  struct png_load_opts opts = {.ctx = ctx};
+
+  return load_png_ex(filename, img, &opts);
+}
+
+struct png_codec_ctx *png_codec_ctx_create(void) {
+  struct png_codec_ctx *ctx = malloc(sizeof(struct png_codec_ctx));
+
+  if (!ctx) {
+    return NULL;
+  }
+
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->arena = png_arena_create();
+  if (!ctx->arena) {
+    free(ctx);
+    return NULL;
+  }
+
+  ctx->allocator = png_arena_allocator(ctx->arena);
+  return ctx;
+}
+
+/* Reads a PNG one row at a time. Scanlines are inflated into the decoder's
+ * scratch buffer and converted into a single row of pixels, which the caller
+ * is free to modify. Interlaced images are decoded whole into the window
+ * before their first row is handed out. */
+struct png_reader {
+  struct png_parser parser;
+  struct png_decoder dec;
+  struct pixel *window;
+  uint32_t rows_read;
+};
+
+int png_reader_open(const char *filename, struct png_reader **reader,
+                    uint32_t *size_x, uint32_t *size_y) {
+  struct png_chunk idat_chunk;
+  struct image_view window;
+  uint32_t rows = 1;
+  struct png_reader *rd = malloc(sizeof(struct png_reader));
+
+  if (!rd) {
+    return 1;
+  }
+
+  if (open_png_parser(filename, &rd->parser, NULL)) {
+    free(rd);
+    return 1;
+  }
+
+  // Stop at the first IDAT chunk. IHDR and PLTE must come before it.
+  if (read_png_idat(&rd->parser, &idat_chunk)) {
+    goto error_parser;
+  }
+
+  // Rows are handed out before a chunk is inflated to its end, so CRCs are
+  // checked up front from here on. The first IDAT chunk was read without it.
+  rd->parser.crc_mode = PNG_CRC_CHECK;
+  if (!is_png_chunk_valid(&idat_chunk)) {
+    goto error_parser;
+  }
+
+  // Rows of interlaced images are only complete after the last pass, so the
+  // window has to hold all of them
+  if (is_interlaced(rd->parser.ihdr_chunk)) {
+    rows = rd->parser.ihdr_header.height;
+  }
+
+  if ((uint64_t)rd->parser.ihdr_header.width * rows >
+      SIZE_MAX / sizeof(struct pixel)) {
+    goto error_parser;
+  }
+
+  rd->rows_read = 0;
+  rd->window =
+      malloc(sizeof(struct pixel) * rd->parser.ihdr_header.width * rows);
+  if (!rd->window) {
+    goto error_parser;
+  }
+
+  window.px = rd->window;
+  window.size_x = rd->parser.ihdr_header.width;
+  window.size_y = rows;
+  window.stride = sizeof(struct pixel) * window.size_x;
+  window.alignment = 0;
+
+  if (start_png_decode(&rd->dec, rd->parser.ihdr_chunk, rd->parser.plte_chunk,
+                       rd->parser.trns_chunk, &window, 0, NULL)) {
+    goto error_decoder;
+  }
+
+  prefetch_png_buffer(&rd->parser.input);
+  feed_png_decoder(&rd->dec, idat_chunk.chunk_data, idat_chunk.length);
+
+  *size_x = rd->parser.ihdr_header.width;
+  *size_y = rd->parser.ihdr_header.height;
+  *reader = rd;
+  return 0;
+
+error_decoder:
+  abort_png_decode(&rd->dec);
+  free(rd->window);
+error_parser:
+  close_png_parser(&rd->parser);
+  free(rd);
+  return 1;
+}
+
+int png_reader_next_row(struct png_reader *reader, struct pixel **row) {
+  struct png_decoder *dec = &reader->dec;
+  struct png_chunk idat_chunk;
+  // Scanlines to inflate, over all passes, before the row is complete
+  uint32_t needed =
+      dec->num_passes > 1 ? dec->rows_total : reader->rows_read + 1;
+
+  if (reader->rows_read == dec->height) {
+    return 1;
+  }
+
+  for (;;) {
+    if (inflate_png_scanlines(dec, needed)) {
+      return 1;
+    }
+
+    if (dec->rows_done >= needed) {
+      break;
+    }
+
+    // The stream ended early
+    if (dec->stream_end) {
+      return 1;
+    }
+
+    // This IDAT chunk is used up, move on to the next one
+    release_png_buffer(&reader->parser.input);
+
+    if (read_png_idat(&reader->parser, &idat_chunk)) {
+      return 1;
+    }
+
+    prefetch_png_buffer(&reader->parser.input);
+    feed_png_decoder(dec, idat_chunk.chunk_data, idat_chunk.length);
   }
+
+  *row = get_png_decoder_row(dec, reader->rows_read);
+  reader->rows_read++;
+  return 0;
 }
 
-/* Reads a Y0l0 PNG from file and parses it into an image */
-int load_png(const char *filename, struct image **img) {
-  struct png_header_filesig filesig;
-  png_chunk_ihdr *ihdr_chunk = NULL;
-  png_chunk_plte *plte_chunk = NULL;
-  png_chunk_iend *iend_chunk = NULL;
+void png_reader_close(struct png_reader *reader) {
+  abort_png_decode(&reader->dec);
+  free(reader->window);
+  close_png_parser(&reader->parser);
+  free(reader);
+}
+
+/* Decodes a PNG whose bytes arrive in slices of any size. The signature, the
+ * chunk headers and CRCs are collected across calls. The data of IDAT chunks
+ * is inflated as it arrives and never stored, the data of other chunks that
+ * decoding uses is collected in chunk_buf, and the data of unused ancillary
+ * chunks is dropped. Rows go to the callback as soon as they are complete.
+ */
+enum png_push_state {
+  PNG_PUSH_SIGNATURE,
+  PNG_PUSH_HEADER,
+  PNG_PUSH_DATA,
+  PNG_PUSH_CRC,
+};
 
-  uint32_t deflated_data_length = 0;
-  uint32_t deflated_data_idx = 0;
-  uint8_t *deflated_buf = NULL;
+struct png_push_decoder {
+  struct png_parser parser;
+  struct png_decoder dec;
+  int decoding;
+  struct pixel *window; // One row, or the whole image if it is interlaced
+  struct png_info info;
+  uint32_t rows_emitted;
+  png_row_fn row_fn;
+  void *row_arg;
+
+  enum png_push_state state;
+  uint8_t field[8]; // Signature, chunk header or CRC being collected
+  uint32_t field_filled;
+  struct png_chunk chunk;
+  uint32_t data_left;  // Bytes of chunk data that are still to come
+  uint32_t crc_value;  // Computed over the chunk so far
+  int skipping;        // The chunk data is dropped
+  uint8_t *chunk_buf;  // The chunk data, unless it is IDAT or dropped
+  uint32_t chunk_size; // Size of chunk_buf
+  int failed;
+};
 
-  uint8_t *inflated_buf = NULL;
-  uint32_t inflated_size = 0;
+int png_decoder_open(struct png_push_decoder **dec, png_row_fn row_fn,
+                     void *arg) {
+  struct png_push_decoder *pd = malloc(sizeof(struct png_push_decoder));
 
-  int idat_train_started = 0;
-  int idat_train_finished = 0;
+  if (!pd) {
+    return 1;
+  }
 
-  int chunk_idx = -1;
+  memset(pd, 0, sizeof(*pd));
+  pd->parser.chunk_idx = -1;
+  pd->row_fn = row_fn;
+  pd->row_arg = arg;
+  pd->state = PNG_PUSH_SIGNATURE;
 
-  struct png_chunk *current_chunk = malloc(sizeof(struct png_chunk));
+  *dec = pd;
+  return 0;
+}
 
-  FILE *input = fopen(filename, "rb");
+/* Start decoding at the first IDAT chunk, IHDR and PLTE are known by then.
+ * Rows are converted into a window of one row, but interlaced images only
+ * complete their rows with the last pass and are decoded in full. */
+int start_png_push_decode(struct png_push_decoder *pd) {
+  struct png_parser *parser = &pd->parser;
+  struct image_view window;
+  uint32_t rows = 1;
 
-  // Has the file been open properly?
-  if (!input) {
-    goto error;
+  if (is_interlaced(parser->ihdr_chunk)) {
+    rows = parser->ihdr_header.height;
   }
 
-  // Did we read the starting bytes properly?
-  if (read_png_filesig(input, &filesig)) {
-    goto error;
+  window.size_x = parser->ihdr_header.width;
+  window.size_y = rows;
+  window.stride = sizeof(struct pixel) * (size_t)window.size_x;
+  window.alignment = 0;
+  window.px = malloc(window.stride * rows);
+  if (!window.px) {
+    return 1;
   }
+  pd->window = window.px;
 
-  // Are the starting bytes correct?
-  if (!is_png_filesig_valid(&filesig)) {
-    goto error;
+  if (start_png_decode(&pd->dec, parser->ihdr_chunk, parser->plte_chunk,
+                       parser->trns_chunk, &window, 0, NULL)) {
+    abort_png_decode(&pd->dec);
+    return 1;
   }
+  pd->decoding = 1;
 
-  // Read all PNG chunks
-  for (; !read_png_chunk(input, current_chunk);
-       current_chunk = malloc(sizeof(struct png_chunk))) {
-    chunk_idx++;
-    // We have more chunks after IEND for some reason
-    // IEND must be the last chunk
-    if (iend_chunk)
-      goto error;
+  pd->info.width = parser->ihdr_header.width;
+  pd->info.height = parser->ihdr_header.height;
+  pd->info.color_type = parser->ihdr_header.color_type;
+  pd->info.bit_depth = parser->ihdr_header.bit_depth;
+  pd->info.interlace = parser->ihdr_header.interlace;
+  return 0;
+}
 
-    // All IDAT chunks need to occur in sequence
-    // We end the IDAT sequence here if we encounter a different chunk
-    if (idat_train_started && !is_chunk_idat(current_chunk)) {
-      idat_train_finished = 1;
-      idat_train_started = 0;
-    }
+/* Hand every row that is complete to the callback */
+int emit_png_push_rows(struct png_push_decoder *pd) {
+  struct png_decoder *dec = &pd->dec;
+  uint32_t complete = dec->num_passes > 1 ? 0 : dec->rows_done;
 
-    // The first iteration: We must have IHDR!
-    if (!chunk_idx) {
-      if (!is_chunk_ihdr(current_chunk)) {
-        goto error;
-      }
+  if (is_png_decode_complete(dec)) {
+    complete = dec->height;
+  }
+
+  for (; pd->rows_emitted < complete; pd->rows_emitted++) {
+    if (pd->row_fn &&
+        pd->row_fn(get_png_decoder_row(dec, pd->rows_emitted),
+                   pd->rows_emitted, &pd->info, pd->row_arg)) {
+      return 1;
     }
+  }
 
-    if (is_chunk_ihdr(current_chunk)) {
-      // The second IHDR?
-      if (ihdr_chunk) {
-        goto error;
-      }
+  return 0;
+}
 
-      ihdr_chunk = format_ihdr_chunk(current_chunk);
+/* Inflate a slice of IDAT data. Rows of a non-interlaced image are inflated
+ * one at a time, so each one is emitted before the next one overwrites it. */
+int inflate_png_push_data(struct png_push_decoder *pd, const uint8_t *data,
+                          uint32_t length) {
+  struct png_decoder *dec = &pd->dec;
 
-      if (!ihdr_chunk) {
-        goto error;
-      }
+  pd->crc_value = crc32(pd->crc_value, data, length);
+  feed_png_decoder(dec, (uint8_t *)data, length);
 
-      continue;
-    }
+  for (;;) {
+    uint32_t rows_done = dec->rows_done;
 
-    // PLTE chunk encountered
-    if (is_chunk_plte(current_chunk)) {
-      // Only 1 PLTE is allowed
-      if (plte_chunk) {
-        goto error;
-      }
+    if (inflate_png_scanlines(dec, rows_done + 1) || emit_png_push_rows(pd)) {
+      return 1;
+    }
 
-      plte_chunk = format_plte_chunk(current_chunk);
+    if (dec->rows_done == rows_done) {
+      return 0;
+    }
+  }
+}
 
-      if (!plte_chunk) {
-        goto error;
-      }
+/* A chunk header is complete: decide what happens to its data */
+int start_png_push_chunk(struct png_push_decoder *pd) {
+  struct png_chunk *chunk = &pd->chunk;
 
-      continue;
-    }
+  memcpy(&chunk->length, pd->field, sizeof(int32_t));
+  memcpy(&chunk->chunk_type, pd->field + sizeof(int32_t), sizeof(int32_t));
+  chunk->length = to_little_endian(chunk->length);
+  chunk->chunk_data = NULL;
 
-    // IEND chunk
-    if (is_chunk_iend(current_chunk)) {
-      iend_chunk = format_iend_chunk(current_chunk);
+  if (chunk->length > PNG_MAX_CHUNK_LENGTH) {
+    return 1;
+  }
 
-      if (!iend_chunk) {
-        goto error;
-      }
+  pd->data_left = chunk->length;
+  pd->crc_value = get_png_chunk_type_crc(chunk);
+  pd->skipping = is_chunk_skippable(chunk);
 
-      continue;
+  // The place of image data is checked before any of it arrives
+  if (is_chunk_idat(chunk)) {
+    if (accept_png_chunk(&pd->parser, chunk)) {
+      return 1;
     }
 
-    // Aggregate all IDAT data together before decompressing
-    if (is_chunk_idat(current_chunk)) {
-      png_chunk_idat *idat_chunk;
+    return !pd->decoding && start_png_push_decode(pd);
+  }
 
-      // If we have already processed a sequence of IDATs, why do we see another
-      // one here?
-      if (idat_train_finished) {
-        goto error;
-      }
-      idat_train_started = 1;
+  if (pd->skipping || chunk->length <= pd->chunk_size) {
+    return 0;
+  }
 
-      idat_chunk = format_idat_chunk(current_chunk);
+  free(pd->chunk_buf);
+  pd->chunk_size = 0;
+  pd->chunk_buf = malloc(chunk->length);
+  if (!pd->chunk_buf) {
+    return 1;
+  }
+  pd->chunk_size = chunk->length;
+  return 0;
+}
 
-      deflated_data_length += idat_chunk->length;
-      deflated_buf = realloc(deflated_buf, deflated_data_length);
+/* A chunk is complete with its CRC */
+int end_png_push_chunk(struct png_push_decoder *pd) {
+  struct png_chunk *chunk = &pd->chunk;
+  uint32_t crc;
 
-      memcpy(deflated_buf + deflated_data_idx, idat_chunk->chunk_data,
-             idat_chunk->length);
+  memcpy(&crc, pd->field, sizeof(int32_t));
+  chunk->crc = to_little_endian(crc);
 
-      if (idat_chunk->chunk_data) {
-        free(idat_chunk->chunk_data);
-      }
+  if (is_chunk_idat(chunk)) {
+    return !is_png_crc_valid(chunk, pd->crc_value);
+  }
+
+  if (!pd->skipping) {
+    if (chunk->length) {
+      chunk->chunk_data = pd->chunk_buf;
+    }
 
-      free(idat_chunk);
+    if (!is_png_chunk_valid(chunk)) {
+      return 1;
     }
   }
 
-  // After we finish looping, we should have processed IEND
-  if (!iend_chunk) {
-    goto error;
+  if (accept_png_chunk(&pd->parser, chunk)) {
+    return 1;
   }
 
-  // Decompress IDAT data
-  if (decompress_png_data(deflated_buf, deflated_data_length, &inflated_buf,
-                          &inflated_size)) {
-    goto error;
+  // The image data is over
+  if (pd->decoding && pd->parser.iend_chunk) {
+    return finish_png_decode(&pd->dec);
   }
 
-  // Process decompressed data
-  *img = parse_png(ihdr_chunk, plte_chunk, inflated_buf, inflated_size);
+  return 0;
+}
 
-  if (!*img) {
-    goto error;
-  }
+/* Collect up to size bytes of a field that may arrive in pieces. Returns
+ * whether it is complete. */
+int fill_png_push_field(struct png_push_decoder *pd, uint32_t size,
+                        const uint8_t **bytes, size_t *len) {
+  uint32_t count = size - pd->field_filled;
 
-success:
-  fclose(input);
+  if (count > *len) {
+    count = *len;
+  }
 
-  if (deflated_buf)
-    free(deflated_buf);
+  memcpy(pd->field + pd->field_filled, *bytes, count);
+  pd->field_filled += count;
+  *bytes += count;
+  *len -= count;
 
-  if (current_chunk) {
-    if (current_chunk->chunk_data) {
-      free(current_chunk->chunk_data);
-    }
-    free(current_chunk);
+  if (pd->field_filled < size) {
+    return 0;
   }
 
-  if (plte_chunk)
-    free(plte_chunk);
+  pd->field_filled = 0;
+  return 1;
+}
 
-  if (ihdr_chunk)
-    free(ihdr_chunk);
+int png_decoder_push(struct png_push_decoder *pd, const uint8_t *bytes,
+                     size_t len) {
+  if (pd->failed) {
+    return 1;
+  }
 
-  return 0;
-error:
-  fclose(input);
+  while (len) {
+    switch (pd->state) {
+    case PNG_PUSH_SIGNATURE:
+      if (fill_png_push_field(pd, sizeof(struct png_header_filesig), &bytes,
+                              &len)) {
+        if (!is_png_filesig_valid((struct png_header_filesig *)pd->field)) {
+          goto error;
+        }
+        pd->state = PNG_PUSH_HEADER;
+      }
+      break;
+
+    case PNG_PUSH_HEADER:
+      if (fill_png_push_field(pd, 2 * sizeof(int32_t), &bytes, &len)) {
+        if (start_png_push_chunk(pd)) {
+          goto error;
+        }
+        pd->state = pd->data_left ? PNG_PUSH_DATA : PNG_PUSH_CRC;
+      }
+      break;
+
+    case PNG_PUSH_DATA: {
+      uint32_t count = pd->data_left < len ? pd->data_left : len;
+      uint32_t offset = pd->chunk.length - pd->data_left;
+
+      if (is_chunk_idat(&pd->chunk)) {
+        if (inflate_png_push_data(pd, bytes, count)) {
+          goto error;
+        }
+      } else if (!pd->skipping) {
+        memcpy(pd->chunk_buf + offset, bytes, count);
+      }
 
-  if (deflated_buf)
-    free(deflated_buf);
+      bytes += count;
+      len -= count;
+      pd->data_left -= count;
+      if (!pd->data_left) {
+        pd->state = PNG_PUSH_CRC;
+      }
+      break;
+    }
 
-  if (current_chunk) {
-    if (current_chunk->chunk_data) {
-      free(current_chunk->chunk_data);
+    case PNG_PUSH_CRC:
+      if (fill_png_push_field(pd, sizeof(int32_t), &bytes, &len)) {
+        if (end_png_push_chunk(pd)) {
+          goto error;
+        }
+        pd->state = PNG_PUSH_HEADER;
+      }
+      break;
     }
-    free(current_chunk);
   }
 
-  if (plte_chunk)
-    free(plte_chunk);
-
-  if (ihdr_chunk)
-    free(ihdr_chunk);
+  return 0;
 
+error:
+  pd->failed = 1;
   return 1;
 }
 
+int png_decoder_close(struct png_push_decoder *pd) {
+  int result = pd->failed || !pd->decoding ||
+               !is_png_parser_done(&pd->parser) ||
+               pd->rows_emitted != pd->info.height;
+
+  // The decoder is finished at IEND, and nothing is left to release then
+  if (pd->decoding && !pd->parser.iend_chunk) {
+    abort_png_decode(&pd->dec);
+  }
+
+  free(pd->window);
+  free(pd->chunk_buf);
+  free(pd->parser.band_offsets);
+  free(pd);
+  return result;
+}
+
 // Store a valid file signature
 int store_filesig(FILE *output) {
   return fwrite("\211PNG\r\n\032\n", 8, 1, output) != 1;
@@ -751,115 +3256,448 @@ struct png_header_ihdr fill_ihdr_plte(struct image *img) {
   ihdr.height = to_big_endian(img->size_y);
   ihdr.width = to_big_endian(img->size_x);
 
-  return ihdr;
-}
+  return ihdr;
+}
+
+// Expects the length in the little endian format and converts it to big endian
+// Calculates and fills the CRC value for a chunk
+void fill_chunk_crc(struct png_chunk *chunk) {
+  chunk->crc =
+      crc((unsigned char *)&chunk->chunk_type, sizeof(chunk->chunk_type));
+  if (chunk->length) {
+    chunk->crc = update_crc(chunk->crc ^ 0xffffffffL,
+                            (unsigned char *)chunk->chunk_data, chunk->length) ^
+                 0xffffffffL;
+  }
+  chunk->crc = to_big_endian(chunk->crc);
+  chunk->length = to_big_endian(chunk->length);
+}
+
+// Fills the IHDR image metadata chunk
+png_chunk_ihdr fill_ihdr_chunk(struct png_header_ihdr *ihdr) {
+  png_chunk_ihdr ihdr_chunk;
+  memcpy(&ihdr_chunk.chunk_type, "IHDR", 4);
+  ihdr_chunk.length = sizeof(*ihdr);
+  ihdr_chunk.chunk_data = ihdr;
+  fill_chunk_crc((struct png_chunk *)&ihdr_chunk);
+  return ihdr_chunk;
+}
+
+// Chunk needs to already be in the big endian format
+// Writes a chunk to the file
+int store_png_chunk(FILE *output, struct png_chunk *chunk) {
+  fwrite(&chunk->length, 4, 1, output);
+  fwrite(&chunk->chunk_type, 4, 1, output);
+  fwrite(chunk->chunk_data, to_little_endian(chunk->length), 1, output);
+  fwrite(&chunk->crc, 4, 1, output);
+}
+
+// Writes a RGBA metadata chunk
+int store_ihdr_rgb_alpha(FILE *output, struct image *img) {
+  struct png_header_ihdr ihdr = fill_ihdr_rgb_alpha(img);
+  png_chunk_ihdr ihdr_chunk = fill_ihdr_chunk(&ihdr);
+  store_png_chunk(output, (struct png_chunk *)&ihdr_chunk);
+  return 0;
+}
+
+// Writes a palette metadata chunk
+int store_ihdr_plte(FILE *output, struct image *img) {
+  struct png_header_ihdr ihdr = fill_ihdr_plte(img);
+  png_chunk_ihdr ihdr_chunk = fill_ihdr_chunk(&ihdr);
+  store_png_chunk(output, (struct png_chunk *)&ihdr_chunk);
+  return 0;
+}
+
+// Returns a buffer of the encoder that holds at least size bytes. Its
+// contents are kept when it grows.
+uint8_t *get_png_encoder_buffer(uint8_t **buf, size_t *buf_size, size_t size) {
+  uint8_t *grown;
+
+  if (size <= *buf_size) {
+    return *buf;
+  }
+
+  if (size < 2 * *buf_size) {
+    size = 2 * *buf_size;
+  }
+
+  grown = realloc(*buf, size);
+  if (!grown) {
+    return NULL;
+  }
+
+  *buf = grown;
+  *buf_size = size;
+  return grown;
+}
+
+// Releases the deflate state and the buffers of an encoder
+void release_png_encoder(struct png_encoder *enc) {
+  if (enc->deflate_ready) {
+    (void)deflateEnd(&enc->strm);
+  }
+
+  free(enc->scanlines);
+  free(enc->compressed);
+  memset(enc, 0, sizeof(*enc));
+}
+
+// Gets the deflate state of an encoder ready for a new stream with the
+// parameters of the current store. It is set up once and only reset for the
+// images that follow.
+int start_png_deflate(struct png_encoder *enc) {
+  z_stream *strm = &enc->strm;
+  struct png_deflate_params *params = &enc->params;
+
+  // A store with other parameters than the last one sets the state up anew.
+  // deflateParams cannot change the window, and may emit a block if the
+  // stream was used before.
+  if (enc->deflate_ready &&
+      memcmp(params, &enc->stream_params, sizeof(*params))) {
+    (void)deflateEnd(strm);
+    enc->deflate_ready = 0;
+  }
+
+  if (enc->deflate_ready) {
+    return deflateReset(strm) != Z_OK;
+  }
+
+  /* allocate deflate state */
+  strm->zalloc = Z_NULL;
+  strm->zfree = Z_NULL;
+  strm->opaque = Z_NULL;
+  if (deflateInit2(strm, params->level, Z_DEFLATED, params->window_bits,
+                   params->mem_level, params->strategy) != Z_OK) {
+    return 1;
+  }
+
+  enc->deflate_ready = 1;
+  enc->stream_params = *params;
+  return 0;
+}
+
+/* One block of the scanlines of a large store, deflated on its own */
+struct png_deflate_block {
+  uint32_t offset;      // Of its input in the scanlines
+  uint32_t length;      // Of its input
+  uint32_t dict_length; // Input before offset that primes the window
+  int last;             // Ends the stream, every other block is flushed
+  uint8_t *out;         // Raw deflate data, which ends on a byte boundary
+  uint32_t out_length;
+  uint32_t adler;       // Adler-32 of its input
+};
+
+/* The blocks of a store, which workers take in turn */
+struct png_deflate_job {
+  const struct png_deflate_params *params;
+  const uint8_t *data;
+  struct png_deflate_block *blocks;
+  uint32_t block_count;
+  uint32_t next_block;
+  int failed;
+};
+
+/* Deflate one block with a raw stream. Every block but the last one ends with
+ * Z_SYNC_FLUSH, so the blocks can simply be put one after the other. */
+int deflate_png_block(z_stream *strm, const uint8_t *data,
+                      struct png_deflate_block *block) {
+  uLong size;
+  int ret;
+
+  if (deflateReset(strm) != Z_OK) {
+    return 1;
+  }
+
+  if (block->dict_length &&
+      deflateSetDictionary(strm, data + block->offset - block->dict_length,
+                           block->dict_length) != Z_OK) {
+    return 1;
+  }
+
+  size = deflateBound(strm, block->length) + PNG_DEFLATE_FLUSH_MARGIN;
+  block->out = malloc(size);
+  if (!block->out) {
+    return 1;
+  }
+
+  strm->next_in = (Bytef *)data + block->offset;
+  strm->avail_in = block->length;
+  strm->next_out = block->out;
+  strm->avail_out = size;
+
+  ret = deflate(strm, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+  if (block->last ? ret != Z_STREAM_END : (ret != Z_OK || !strm->avail_out)) {
+    return 1;
+  }
+
+  block->out_length = size - strm->avail_out;
+  block->adler = adler32(1, data + block->offset, block->length);
+  return 0;
+}
+
+/* Every worker has a deflate state of its own, which goes through the blocks
+ * it takes one after the other */
+void *run_png_deflate_worker(void *arg) {
+  struct png_deflate_job *job = arg;
+  const struct png_deflate_params *params = job->params;
+  z_stream strm;
+
+  memset(&strm, 0, sizeof(strm));
+  if (deflateInit2(&strm, params->level, Z_DEFLATED, -params->window_bits,
+                   params->mem_level, params->strategy) != Z_OK) {
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  while (!__atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+    uint32_t block =
+        __atomic_fetch_add(&job->next_block, 1, __ATOMIC_RELAXED);
+
+    if (block >= job->block_count) {
+      break;
+    }
+
+    if (deflate_png_block(&strm, job->data, &job->blocks[block])) {
+      __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  (void)deflateEnd(&strm);
+  return NULL;
+}
+
+/* The two byte zlib header that deflate would write with these parameters */
+uint16_t get_png_zlib_header(const struct png_deflate_params *params) {
+  uint16_t header = (Z_DEFLATED | (params->window_bits - 8) << 4) << 8;
+
+  if (params->level >= 2 && params->strategy < Z_HUFFMAN_ONLY) {
+    header |= (params->level < 6 ? 1 : params->level == 6 ? 2 : 3) << 6;
+  }
+
+  return header + 31 - header % 31;
+}
+
+/* Splits the data into blocks, which never span two bands. A block is primed
+ * with the window of input before it, unless it starts a band. Returns the
+ * number of blocks, and fills blocks in if it is not NULL. */
+uint32_t split_png_deflate_blocks(uint32_t length, uint32_t band_length,
+                                  uint32_t window,
+                                  struct png_deflate_block *blocks) {
+  uint32_t count = 0;
+
+  if (!band_length) {
+    band_length = length;
+  }
+
+  for (uint32_t band = 0; band < length; band += band_length) {
+    uint32_t band_end = length - band > band_length ? band + band_length
+                                                    : length;
+
+    for (uint32_t offset = band; offset < band_end;
+         offset += PNG_DEFLATE_BLOCK_SIZE) {
+      if (blocks) {
+        struct png_deflate_block *block = &blocks[count];
+
+        block->offset = offset;
+        block->length = band_end - offset > PNG_DEFLATE_BLOCK_SIZE
+                            ? PNG_DEFLATE_BLOCK_SIZE
+                            : band_end - offset;
+        block->dict_length = offset - band > window ? window : offset - band;
+        block->last = offset + block->length == length;
+      }
+      count++;
+    }
+  }
+
+  return count;
+}
+
+/* Deflates large image data on all cores, pigz style: the data is split into
+ * blocks of PNG_DEFLATE_BLOCK_SIZE bytes that are deflated independently,
+ * each one primed with the window of input before it, and joined behind the
+ * zlib header. Their Adler-32 checksums are combined for the trailer. The
+ * blocks do not depend on the number of threads, so neither does the output.
+ * Bands start on a block without a dictionary, which is as independent as a
+ * band behind Z_FULL_FLUSH. */
+int compress_png_blocks(struct png_encoder *enc, uint8_t *decompressed_data,
+                        uint32_t decompressed_length, uint32_t *compressed_length,
+                        uint32_t band_length, uint32_t *band_offsets) {
+  struct png_deflate_job job;
+  pthread_t threads[PNG_MAX_DEFLATE_THREADS];
+  uint32_t thread_count = 0, band = 0;
+  uint32_t window = 1u << enc->params.window_bits;
+  long cores = enc->threads ? enc->threads : sysconf(_SC_NPROCESSORS_ONLN);
+  uint16_t header = get_png_zlib_header(&enc->params);
+  uint32_t adler = 1;
+  uint8_t *out;
+
+  memset(&job, 0, sizeof(job));
+  job.params = &enc->params;
+  job.data = decompressed_data;
+  job.block_count = split_png_deflate_blocks(decompressed_length, band_length,
+                                             window, NULL);
+  job.blocks = calloc(job.block_count, sizeof(struct png_deflate_block));
+  if (!job.blocks) {
+    return 1;
+  }
+  split_png_deflate_blocks(decompressed_length, band_length, window,
+                           job.blocks);
+
+  // The calling thread is a worker too
+  while (thread_count + 1 < job.block_count &&
+         thread_count + 1 < (uint32_t)cores &&
+         thread_count < PNG_MAX_DEFLATE_THREADS) {
+    if (pthread_create(&threads[thread_count], NULL, run_png_deflate_worker,
+                       &job)) {
+      break;
+    }
+    thread_count++;
+  }
+
+  run_png_deflate_worker(&job);
+
+  while (thread_count) {
+    pthread_join(threads[--thread_count], NULL);
+  }
+
+  if (job.failed) {
+    goto error;
+  }
+
+  out = get_png_encoder_buffer(&enc->compressed, &enc->compressed_size, 2);
+  if (!out) {
+    goto error;
+  }
+  out[0] = header >> 8;
+  out[1] = header & 0xff;
+  *compressed_length = 2;
+
+  for (uint32_t idx = 0; idx < job.block_count; idx++) {
+    struct png_deflate_block *block = &job.blocks[idx];
+
+    if (band_length && block->offset % band_length == 0) {
+      band_offsets[band++] = *compressed_length;
+    }
+
+    out = get_png_encoder_buffer(&enc->compressed, &enc->compressed_size,
+                                 (size_t)*compressed_length +
+                                     block->out_length + 4);
+    if (!out) {
+      goto error;
+    }
 
-// Expects the length in the little endian format and converts it to big endian
-// Calculates and fills the CRC value for a chunk
-void fill_chunk_crc(struct png_chunk *chunk) {
-  chunk->crc =
-      crc((unsigned char *)&chunk->chunk_type, sizeof(chunk->chunk_type));
-  if (chunk->length) {
-    chunk->crc = update_crc(chunk->crc ^ 0xffffffffL,
-                            (unsigned char *)chunk->chunk_data, chunk->length) ^
-                 0xffffffffL;
+    memcpy(out + *compressed_length, block->out, block->out_length);
+    *compressed_length += block->out_length;
+    adler = adler32_combine(adler, block->adler, block->length);
   }
-  chunk->crc = to_big_endian(chunk->crc);
-  chunk->length = to_big_endian(chunk->length);
-}
-
-// Fills the IHDR image metadata chunk
-png_chunk_ihdr fill_ihdr_chunk(struct png_header_ihdr *ihdr) {
-  png_chunk_ihdr ihdr_chunk;
-  memcpy(&ihdr_chunk.chunk_type, "IHDR", 4);
-  ihdr_chunk.length = sizeof(*ihdr);
-  ihdr_chunk.chunk_data = ihdr;
-  fill_chunk_crc((struct png_chunk *)&ihdr_chunk);
-  return ihdr_chunk;
-}
 
-// Chunk needs to already be in the big endian format
-// Writes a chunk to the file
-int store_png_chunk(FILE *output, struct png_chunk *chunk) {
-  fwrite(&chunk->length, 4, 1, output);
-  fwrite(&chunk->chunk_type, 4, 1, output);
-  fwrite(chunk->chunk_data, to_little_endian(chunk->length), 1, output);
-  fwrite(&chunk->crc, 4, 1, output);
-}
+  adler = to_big_endian(adler);
+  memcpy(out + *compressed_length, &adler, 4);
+  *compressed_length += 4;
 
-// Writes a RGBA metadata chunk
-int store_ihdr_rgb_alpha(FILE *output, struct image *img) {
-  struct png_header_ihdr ihdr = fill_ihdr_rgb_alpha(img);
-  png_chunk_ihdr ihdr_chunk = fill_ihdr_chunk(&ihdr);
-  store_png_chunk(output, (struct png_chunk *)&ihdr_chunk);
+  for (uint32_t idx = 0; idx < job.block_count; idx++) {
+    free(job.blocks[idx].out);
+  }
+  free(job.blocks);
   return 0;
-}
 
-// Writes a palette metadata chunk
-int store_ihdr_plte(FILE *output, struct image *img) {
-  struct png_header_ihdr ihdr = fill_ihdr_plte(img);
-  png_chunk_ihdr ihdr_chunk = fill_ihdr_chunk(&ihdr);
-  store_png_chunk(output, (struct png_chunk *)&ihdr_chunk);
-  return 0;
+error:
+  for (uint32_t idx = 0; idx < job.block_count; idx++) {
+    free(job.blocks[idx].out);
+  }
+  free(job.blocks);
+  return 1;
 }
 
-// Compresses image data using deflate
-int compress_png_data(uint8_t *decompressed_data, uint32_t decompressed_length,
-                      uint8_t **compressed_data, uint32_t *compressed_length) {
+// Compresses image data using deflate. With a non-zero band_length, the data
+// is split into bands of band_length bytes that are flushed with
+// Z_FULL_FLUSH, so each of them can be inflated on its own. The offset of
+// every band in the compressed data goes to band_offsets.
+//
+// The compressed data belongs to the encoder.
+int compress_png_data(struct png_encoder *enc, uint8_t *decompressed_data,
+                      uint32_t decompressed_length, uint8_t **compressed_data,
+                      uint32_t *compressed_length, uint32_t band_length,
+                      uint32_t *band_offsets) {
   int ret, flush;
-  unsigned have;
-  z_stream strm;
-  unsigned char out[PNG_OUTPUT_CHUNK_SIZE];
-  int level = 1;
+  z_stream *strm = &enc->strm;
+  uint32_t band = 0;
 
   *compressed_data = NULL;
   *compressed_length = 0;
-  /* allocate deflate state */
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-  ret = deflateInit(&strm, level);
-  if (ret != Z_OK)
-    return ret;
+
+  if (decompressed_length > PNG_DEFLATE_BLOCK_SIZE) {
+    if (compress_png_blocks(enc, decompressed_data, decompressed_length,
+                            compressed_length, band_length, band_offsets)) {
+      return 1;
+    }
+
+    *compressed_data = enc->compressed;
+    return 0;
+  }
+
+  if (start_png_deflate(enc)) {
+    return 1;
+  }
 
   /* compress until end of file */
 
-  strm.avail_in = decompressed_length;
-  flush = Z_FINISH;
-  strm.next_in = decompressed_data;
+  strm->next_in = decompressed_data;
 
-  /* run deflate() on input until output buffer not full, finish
-      compression if all of source has been read in */
   do {
-    strm.avail_out = PNG_OUTPUT_CHUNK_SIZE;
-    strm.next_out = out;
-    ret = deflate(&strm, flush); /* no bad return value */
-    if (ret == Z_STREAM_ERROR) {
-      goto error;
+    uint32_t remaining = decompressed_length - strm->total_in;
+
+    strm->avail_in = remaining;
+    flush = Z_FINISH;
+
+    if (band_length && remaining > band_length) {
+      strm->avail_in = band_length;
+      flush = Z_FULL_FLUSH;
     }
-    have = PNG_OUTPUT_CHUNK_SIZE - strm.avail_out;
 
-    *compressed_data = realloc(*compressed_data, *compressed_length + have);
-    memcpy(*compressed_data + *compressed_length, out, have);
-    *compressed_length += have;
+    // The first band follows the zlib header
+    if (band_length) {
+      band_offsets[band] = band ? *compressed_length : 2;
+      band++;
+    }
 
-  } while (strm.avail_out == 0);
-  if (strm.avail_in != 0) {
-    goto error;
-  }
+    /* run deflate() on input until output buffer not full, finish
+        compression if all of source has been read in. The output goes
+        straight to the end of the compressed data. */
+    do {
+      uint8_t *out = get_png_encoder_buffer(
+          &enc->compressed, &enc->compressed_size,
+          (size_t)*compressed_length + PNG_OUTPUT_CHUNK_SIZE);
+      if (!out) {
+        goto error;
+      }
+
+      strm->avail_out = PNG_OUTPUT_CHUNK_SIZE;
+      strm->next_out = out + *compressed_length;
+      ret = deflate(strm, flush); /* no bad return value */
+      if (ret == Z_STREAM_ERROR) {
+        goto error;
+      }
+      *compressed_length += PNG_OUTPUT_CHUNK_SIZE - strm->avail_out;
+
+    } while (strm->avail_out == 0);
+    if (strm->avail_in != 0) {
+      goto error;
+    }
+  } while (flush != Z_FINISH);
 
   if (ret != Z_STREAM_END) {
     goto error;
   }
 
-  /* clean up and return */
-  (void)deflateEnd(&strm);
+  *compressed_data = enc->compressed;
   return 0;
 
 error:
-  if (*compressed_data) {
-    free(*compressed_data);
-  }
+  // The stream is in the middle of an image, start over with the next one
+  (void)deflateEnd(strm);
+  enc->deflate_ready = 0;
+  return 1;
 }
 
 // Fills IDAT with compressed data
@@ -872,89 +3710,182 @@ png_chunk_idat fill_idat_chunk(uint8_t *data, uint32_t length) {
   return idat;
 }
 
-// Writes an IDAT chunk from image data to a file
-int store_idat_rgb_alpha(FILE *output, struct image *img) {
-  uint32_t non_compressed_length = img->size_y * (1 + img->size_x * 4);
-  uint8_t *non_compressed_buf = malloc(non_compressed_length);
+// Writes compressed data as IDAT chunks of at most idat_size bytes
+void store_idat_chunks(FILE *output, uint8_t *data, uint32_t length,
+                       uint32_t idat_size) {
+  do {
+    uint32_t chunk_length = length > idat_size ? idat_size : length;
+    png_chunk_idat idat = fill_idat_chunk(data, chunk_length);
 
-  for (uint32_t id_y = 0; id_y < img->size_y; id_y++) {
-    non_compressed_buf[id_y * (1 + img->size_x * 4)] = 0;
-    for (uint32_t id_x = 0; id_x < img->size_x; id_x++) {
-      uint32_t id_pix_buf = id_y * (1 + img->size_x * 4) + 1 + 4 * id_x;
-      uint32_t id_pix = id_y * img->size_x + id_x;
+    store_png_chunk(output, (struct png_chunk *)&idat);
+    data += chunk_length;
+    length -= chunk_length;
+  } while (length);
+}
 
-      non_compressed_buf[id_pix_buf] = img->px[id_pix].red;
-      non_compressed_buf[id_pix_buf + 1] = img->px[id_pix].green;
-      non_compressed_buf[id_pix_buf + 2] = img->px[id_pix].blue;
-      non_compressed_buf[id_pix_buf + 3] = img->px[id_pix].alpha;
-    }
+// Writes the band index: the rows per band and the offset of each band in
+// the zlib stream, all big endian
+int store_band_index(FILE *output, uint32_t band_rows, uint32_t *band_offsets,
+                     uint32_t band_count) {
+  png_chunk_idat bndx;
+  uint32_t *fields = malloc(sizeof(uint32_t) * (band_count + 1));
+
+  if (!fields) {
+    return 1;
+  }
+
+  fields[0] = to_big_endian(band_rows);
+  for (uint32_t idx = 0; idx < band_count; idx++) {
+    fields[idx + 1] = to_big_endian(band_offsets[idx]);
   }
 
+  memcpy(&bndx.chunk_type, "bnDX", 4);
+  bndx.chunk_data = fields;
+  bndx.length = sizeof(uint32_t) * (band_count + 1);
+  fill_chunk_crc(&bndx);
+  store_png_chunk(output, &bndx);
+
+  free(fields);
+  return 0;
+}
+
+// Compresses the scanlines of an image and writes them as IDAT, preceded by
+// the band index if band_rows is not zero
+int store_idat_data(FILE *output, struct image *img, uint8_t *scanlines,
+                    uint32_t scanline_length, uint32_t band_rows,
+                    struct png_encoder *enc) {
   uint8_t *compressed_data_buf;
   uint32_t compressed_length;
+  uint32_t band_count;
+  uint32_t *band_offsets = NULL;
+  uint64_t data_length = (uint64_t)scanline_length * img->size_y;
+
+  // A band can hold no more than the whole image
+  if (band_rows > img->size_y) {
+    band_rows = img->size_y;
+  }
+
+  if (data_length > UINT32_MAX) {
+    return 1;
+  }
+
+  band_count = band_rows ? (img->size_y - 1) / band_rows + 1 : 0;
+  if (band_count) {
+    band_offsets = malloc(sizeof(uint32_t) * band_count);
+    if (!band_offsets) {
+      return 1;
+    }
+  }
+
+  if (compress_png_data(enc, scanlines, data_length, &compressed_data_buf,
+                        &compressed_length, band_rows * scanline_length,
+                        band_offsets)) {
+    free(band_offsets);
+    return 1;
+  }
+
+  if (band_count &&
+      store_band_index(output, band_rows, band_offsets, band_count)) {
+    free(band_offsets);
+    return 1;
+  }
 
-  compress_png_data(non_compressed_buf, non_compressed_length,
-                    &compressed_data_buf, &compressed_length);
+  store_idat_chunks(output, compressed_data_buf, compressed_length,
+                    enc->idat_size);
 
-  png_chunk_idat idat = fill_idat_chunk(compressed_data_buf, compressed_length);
-  store_png_chunk(output, (struct png_chunk *)&idat);
+  free(band_offsets);
   return 0;
 }
 
-// Finds a color in a palette and returns its index
-int find_color(struct pixel *palette, uint32_t palette_length,
-               struct pixel *target) {
-  for (int idx = 0; idx < palette_length; idx++) {
-    if (palette[idx].red == target->red &&
-        palette[idx].green == target->green &&
-        palette[idx].blue == target->blue) {
-      return idx;
+// Does the image use no more colors than a palette holds?
+int has_few_colors(struct image *img) {
+  return collect_palette(img->px, (size_t)img->size_x * img->size_y, NULL) != 0;
+}
+
+// Writes an IDAT chunk from image data to a file
+int store_idat_rgb_alpha(FILE *output, struct image *img, uint32_t band_rows,
+                         struct png_encoder *enc) {
+  uint64_t non_compressed_length =
+      (uint64_t)img->size_y * (1 + img->size_x * 4);
+  uint8_t *non_compressed_buf;
+
+  // The image data has to fit the 32-bit lengths of deflate
+  if (non_compressed_length > UINT32_MAX) {
+    return 1;
+  }
+
+  non_compressed_buf = get_png_encoder_buffer(
+      &enc->scanlines, &enc->scanlines_size, non_compressed_length);
+  if (!non_compressed_buf) {
+    return 1;
+  }
+
+  // Images of few colors, like those of a palette, compress best unfiltered:
+  // deflate finds their runs of colors, which filters break up. Nor are
+  // filters worth their time if the data is not compressed at all.
+  int adaptive = enc->params.level && !has_few_colors(img);
+
+  // Rows of struct pixel already are RGBA scanlines. Each one gets the filter
+  // that suits it best, but the first row of a band must not refer to the
+  // band above it.
+  for (uint32_t id_y = 0; id_y < img->size_y; id_y++) {
+    const uint8_t *row =
+        (const uint8_t *)&img->px[(size_t)id_y * img->size_x];
+    uint8_t *out = non_compressed_buf + (size_t)id_y * (1 + img->size_x * 4);
+    const uint8_t *prev = NULL;
+
+    if (!adaptive) {
+      out[0] = 0;
+      memcpy(out + 1, row, img->size_x * 4);
+      continue;
+    }
+
+    if (id_y && (!band_rows || id_y % band_rows)) {
+      prev = row - img->size_x * 4;
     }
+
+    filter_scanline(row, prev, img->size_x * 4, 4, out);
   }
 
-  return -1;
+  return store_idat_data(output, img, non_compressed_buf, 1 + img->size_x * 4,
+                         band_rows, enc);
 }
 
-// Writes an IDAT chunk for a palette image
+// Writes an IDAT chunk for a palette image. Colors are looked up in a hash
+// table of the palette, with or without their alpha.
 int store_idat_plte(FILE *output, struct image *img, struct pixel *palette,
-                    uint32_t palette_length) {
+                    uint32_t palette_length, int with_alpha,
+                    uint32_t band_rows, struct png_encoder *enc) {
+  struct palette_index index;
   uint32_t non_compressed_length = img->size_y * (1 + img->size_x);
-  uint8_t *non_compressed_buf = malloc(non_compressed_length);
+  uint8_t *non_compressed_buf = get_png_encoder_buffer(
+      &enc->scanlines, &enc->scanlines_size, non_compressed_length);
 
-  for (uint32_t id_y = 0; id_y < img->size_y; id_y++) {
-    non_compressed_buf[id_y * (1 + img->size_x)] = 0;
-    for (uint32_t id_x = 0; id_x < img->size_x; id_x++) {
-      uint32_t id_pix_buf = id_y * (1 + img->size_x) + 1 + id_x;
-      uint32_t id_pix = id_y * img->size_x + id_x;
-      int code = find_color(palette, palette_length, &img->px[id_pix]);
-      if (code < 0) {
-        goto error;
-      }
-      non_compressed_buf[id_pix_buf] = code;
-    }
+  if (!non_compressed_buf) {
+    return 1;
   }
 
-  uint8_t *compressed_data_buf = NULL;
-  uint32_t compressed_length;
-
-  compress_png_data(non_compressed_buf, non_compressed_length,
-                    &compressed_data_buf, &compressed_length);
+  build_palette_index(&index, palette, palette_length, with_alpha);
 
-  png_chunk_idat idat = fill_idat_chunk(compressed_data_buf, compressed_length);
-  store_png_chunk(output, (struct png_chunk *)&idat);
-  return 0;
+  for (uint32_t id_y = 0; id_y < img->size_y; id_y++) {
+    uint8_t *out = non_compressed_buf + id_y * (1 + img->size_x);
 
-error:
-  if (compressed_data_buf) {
-    free(compressed_data_buf);
+    out[0] = 0;
+    if (map_palette_row(&index, &img->px[id_y * img->size_x], img->size_x,
+                        out + 1)) {
+      return 1;
+    }
   }
-  return 1;
+
+  return store_idat_data(output, img, non_compressed_buf, 1 + img->size_x,
+                         band_rows, enc);
 }
 
 // Writes the first two chunks for a RGBA image
-int store_png_rgb_alpha(FILE *output, struct image *img) {
+int store_png_rgb_alpha(FILE *output, struct image *img, uint32_t band_rows,
+                        struct png_encoder *enc) {
   store_ihdr_rgb_alpha(output, img);
-  store_idat_rgb_alpha(output, img);
+  return store_idat_rgb_alpha(output, img, band_rows, enc);
 }
 
 // Creates a PLTE chunk from PLTE entries (colors)
@@ -983,12 +3914,44 @@ int store_plte(FILE *output, struct pixel *palette, uint32_t palette_length) {
   store_png_chunk(output, (struct png_chunk *)&plte_chunk);
 }
 
-// Writes the first 3 chunks for a palette Y0L0 PNG image
+// Writes the alpha of the palette entries up to the last one that is not
+// opaque, if there is any
+void store_trns(FILE *output, struct pixel *palette, uint32_t palette_length) {
+  uint8_t alpha[256];
+  png_chunk_trns trns;
+  uint32_t length = 0;
+
+  for (uint32_t idx = 0; idx < palette_length; idx++) {
+    alpha[idx] = palette[idx].alpha;
+    if (alpha[idx] != 0xff) {
+      length = idx + 1;
+    }
+  }
+
+  if (!length) {
+    return;
+  }
+
+  memcpy(&trns.chunk_type, "tRNS", 4);
+  trns.chunk_data = alpha;
+  trns.length = length;
+  fill_chunk_crc(&trns);
+  store_png_chunk(output, &trns);
+}
+
+// Writes the first 3 chunks for a palette Y0L0 PNG image. With with_alpha,
+// the alpha of the palette goes to a tRNS chunk, otherwise only the colors
+// count.
 int store_png_palette(FILE *output, struct image *img, struct pixel *palette,
-                      uint32_t palette_length) {
+                      uint32_t palette_length, int with_alpha,
+                      uint32_t band_rows, struct png_encoder *enc) {
   store_ihdr_plte(output, img);
   store_plte(output, palette, palette_length);
-  store_idat_plte(output, img, palette, palette_length);
+  if (with_alpha) {
+    store_trns(output, palette, palette_length);
+  }
+  return store_idat_plte(output, img, palette, palette_length, with_alpha,
+                         band_rows, enc);
 }
 
 // Stores an IEND chunk to a file
@@ -1000,25 +3963,307 @@ int store_png_chunk_iend(FILE *output) {
   store_png_chunk(output, &iend);
 }
 
+// Fills in the deflate parameters of a store, see struct png_store_opts.
+// Returns a non-zero value if zlib would not take them.
+int get_png_deflate_params(const struct png_store_opts *opts,
+                           struct png_deflate_params *params) {
+  struct png_store_opts defaults = {0};
+
+  if (!opts) {
+    opts = &defaults;
+  }
+
+  params->level = opts->level ? opts->level : PNG_DEFAULT_LEVEL;
+  if (params->level < 0) {
+    params->level = Z_NO_COMPRESSION;
+  }
+
+  params->strategy = opts->strategy;
+  params->mem_level = opts->mem_level ? opts->mem_level : 8;
+  params->window_bits = opts->window_bits ? opts->window_bits : MAX_WBITS;
+
+  // zlib has no 256 byte window and takes 512 bytes instead
+  if (params->window_bits == 8) {
+    params->window_bits = 9;
+  }
+
+  return params->level > Z_BEST_COMPRESSION || params->strategy < 0 ||
+         params->strategy > Z_FIXED || params->mem_level < 1 ||
+         params->mem_level > MAX_MEM_LEVEL || params->window_bits < 9 ||
+         params->window_bits > MAX_WBITS;
+}
+
+// Sets an encoder up for a store with the options in opts. Returns a non-zero
+// value if they are not valid.
+int prepare_png_encoder(struct png_encoder *enc,
+                        const struct png_store_opts *opts) {
+  if (get_png_deflate_params(opts, &enc->params)) {
+    return 1;
+  }
+
+  enc->threads = opts ? opts->threads : 0;
+  enc->idat_size = opts && opts->idat_size ? opts->idat_size : PNG_IDAT_SIZE;
+  return enc->idat_size > PNG_MAX_CHUNK_LENGTH;
+}
+
 // Store a Y0L0 PNG to a file. Provide an array of pixels if you want to use a
-// palette format. If it is NULL, RGBA is selected.
-int store_png(const char *filename, struct image *img, struct pixel *palette,
-              uint8_t palette_length) {
+// palette format. If it is NULL, RGBA is selected, or a palette of the colors
+// of the image if opts asks for one and they fit. With a non-zero band_rows,
+// the image data is flushed every band_rows rows and a band index is written.
+// The encoder of the codec context in opts is used if there is one, otherwise
+// a fresh one.
+int store_png_file(const char *filename, struct image *img,
+                   struct pixel *palette, uint8_t palette_length,
+                   uint32_t band_rows, const struct png_store_opts *opts) {
   int result = 0;
-  FILE *output = fopen(filename, "wb");
+  struct png_encoder fresh = {0};
+  struct png_encoder *enc = opts && opts->ctx ? &opts->ctx->enc : &fresh;
+  struct pixel auto_palette[PALETTE_MAX_COLORS];
+  uint32_t auto_length = 0;
+  FILE *output;
 
+  if (prepare_png_encoder(enc, opts)) {
+    return 1;
+  }
+
+  if (!palette && opts && opts->auto_palette) {
+    auto_length = collect_palette(
+        img->px, (size_t)img->size_x * img->size_y, auto_palette);
+  }
+
+  output = fopen(filename, "wb");
   if (!output)
     return 1;
 
   store_filesig(output);
 
   if (palette) {
-    store_png_palette(output, img, palette, palette_length);
+    result = store_png_palette(output, img, palette, palette_length, 0,
+                               band_rows, enc);
+  } else if (auto_length) {
+    result = store_png_palette(output, img, auto_palette, auto_length, 1,
+                               band_rows, enc);
   } else {
-    store_png_rgb_alpha(output, img);
+    result = store_png_rgb_alpha(output, img, band_rows, enc);
   }
 
   store_png_chunk_iend(output);
   fclose(output);
+  release_png_encoder(&fresh);
+  return result;
+}
+
+int store_png_banded(const char *filename, struct image *img,
+                     struct pixel *palette, uint8_t palette_length,
+                     uint32_t band_rows) {
+  return store_png_file(filename, img, palette, palette_length, band_rows,
+                        NULL);
+}
+
+int store_png(const char *filename, struct image *img, struct pixel *palette,
+              uint8_t palette_length) {
+  return store_png_file(filename, img, palette, palette_length, 0, NULL);
+}
+
+int store_png_ex(const char *filename, struct image *img,
+                 struct pixel *palette, uint8_t palette_length,
+                 const struct png_store_opts *opts) {
+  return store_png_file(filename, img, palette, palette_length, 0, opts);
+}
+
+int store_png_ctx(const char *filename, struct image *img,
+                  struct pixel *palette, uint8_t palette_length,
+                  struct png_codec_ctx *ctx) {
+  struct png_store_opts opts = {0};
+
+  opts.ctx = ctx;
+  return store_png_file(filename, img, palette, palette_length, 0, &opts);
+}
+
+// Writes a RGBA PNG row by row. Rows are filtered against a copy of the row
+// before them and deflated as they come, and the compressed data goes out in
+// IDAT chunks as soon as one is full.
+struct png_writer {
+  FILE *output;
+  uint32_t width;
+  uint32_t height;
+  uint32_t rows_written;
+  struct png_encoder *enc;
+  struct png_encoder fresh; // The encoder if there is no codec context
+  uint8_t *prev;            // The last row, unfiltered
+  uint8_t *scanline;        // The filter type and the filtered row
+  uint8_t *idat;            // The IDAT chunk being filled
+  uint32_t idat_length;
+  int failed;
+};
+
+// Writes the IDAT chunk that has been filled so far
+void flush_png_writer(struct png_writer *writer) {
+  if (writer->idat_length) {
+    store_idat_chunks(writer->output, writer->idat, writer->idat_length,
+                      writer->enc->idat_size);
+    writer->idat_length = 0;
+  }
+}
+
+// Runs deflate on the input that is set up, and writes IDAT chunks whenever
+// one fills up
+int deflate_png_writer(struct png_writer *writer, int flush) {
+  z_stream *strm = &writer->enc->strm;
+  uint32_t idat_size = writer->enc->idat_size;
+  int ret;
+
+  do {
+    strm->next_out = writer->idat + writer->idat_length;
+    strm->avail_out = idat_size - writer->idat_length;
+
+    ret = deflate(strm, flush);
+    if (ret == Z_STREAM_ERROR) {
+      return 1;
+    }
+
+    writer->idat_length = idat_size - strm->avail_out;
+    if (writer->idat_length == idat_size) {
+      flush_png_writer(writer);
+    }
+  } while (strm->avail_in || (flush == Z_FINISH && ret != Z_STREAM_END));
+
+  return 0;
+}
+
+int png_writer_begin(struct png_writer **writer, const char *filename,
+                     uint32_t width, uint32_t height,
+                     const struct png_store_opts *opts) {
+  struct png_writer *new_writer;
+  struct png_header_ihdr ihdr;
+  png_chunk_ihdr ihdr_chunk;
+  size_t row_length = (size_t)width * 4;
+
+  *writer = NULL;
+
+  if (!width || !height || width > PNG_MAX_CHUNK_LENGTH / 4) {
+    return 1;
+  }
+
+  new_writer = calloc(1, sizeof(struct png_writer));
+  if (!new_writer) {
+    return 1;
+  }
+
+  new_writer->width = width;
+  new_writer->height = height;
+  new_writer->enc =
+      opts && opts->ctx ? &opts->ctx->enc : &new_writer->fresh;
+
+  if (prepare_png_encoder(new_writer->enc, opts) ||
+      start_png_deflate(new_writer->enc)) {
+    goto error;
+  }
+
+  // The encoder's buffers hold the last two rows and the IDAT chunk
+  new_writer->prev = get_png_encoder_buffer(&new_writer->enc->scanlines,
+                                            &new_writer->enc->scanlines_size,
+                                            2 * row_length + 1);
+  new_writer->idat = get_png_encoder_buffer(&new_writer->enc->compressed,
+                                            &new_writer->enc->compressed_size,
+                                            new_writer->enc->idat_size);
+  if (!new_writer->prev || !new_writer->idat) {
+    goto error;
+  }
+  new_writer->scanline = new_writer->prev + row_length;
+
+  new_writer->output = fopen(filename, "wb");
+  if (!new_writer->output) {
+    goto error;
+  }
+
+  ihdr.bit_depth = 8;
+  ihdr.color_type = PNG_IHDR_COLOR_RGB_ALPHA;
+  ihdr.compression = 0;
+  ihdr.filter = 0;
+  ihdr.interlace = 0;
+  ihdr.height = to_big_endian(height);
+  ihdr.width = to_big_endian(width);
+  ihdr_chunk = fill_ihdr_chunk(&ihdr);
+
+  store_filesig(new_writer->output);
+  store_png_chunk(new_writer->output, (struct png_chunk *)&ihdr_chunk);
+
+  *writer = new_writer;
+  return 0;
+
+error:
+  release_png_encoder(&new_writer->fresh);
+  free(new_writer);
+  return 1;
+}
+
+int png_writer_write_rows(struct png_writer *writer, const struct pixel *rows,
+                          uint32_t count) {
+  size_t row_length = (size_t)writer->width * 4;
+  z_stream *strm = &writer->enc->strm;
+
+  if (writer->failed || count > writer->height - writer->rows_written) {
+    writer->failed = 1;
+    return 1;
+  }
+
+  for (uint32_t idx = 0; idx < count; idx++) {
+    const uint8_t *row = (const uint8_t *)&rows[(size_t)idx * writer->width];
+
+    // Filters are not worth their time if the data is not compressed at all
+    if (!writer->enc->params.level) {
+      writer->scanline[0] = PNG_FILTER_TYPE_NONE;
+      memcpy(writer->scanline + 1, row, row_length);
+    } else {
+      filter_scanline(row, writer->rows_written ? writer->prev : NULL,
+                      row_length, 4, writer->scanline);
+    }
+    memcpy(writer->prev, row, row_length);
+
+    strm->next_in = writer->scanline;
+    strm->avail_in = row_length + 1;
+    if (deflate_png_writer(writer, Z_NO_FLUSH)) {
+      writer->failed = 1;
+      return 1;
+    }
+
+    writer->rows_written++;
+  }
+
   return 0;
 }
+
+int png_writer_end(struct png_writer *writer) {
+  int result = writer->failed || writer->rows_written != writer->height;
+
+  if (!result) {
+    writer->enc->strm.avail_in = 0;
+    result = deflate_png_writer(writer, Z_FINISH);
+  }
+
+  if (!result) {
+    flush_png_writer(writer);
+    store_png_chunk_iend(writer->output);
+  }
+
+  result |= ferror(writer->output) != 0;
+  result |= fclose(writer->output) != 0;
+  release_png_encoder(&writer->fresh);
+  free(writer);
+  return result;
+}
+
+void png_codec_ctx_destroy(struct png_codec_ctx *ctx) {
+  if (!ctx) {
+    return;
+  }
+
+  if (ctx->inflate_ready) {
+    (void)inflateEnd(&ctx->dec.strm);
+  }
+
+  release_png_encoder(&ctx->enc);
+  png_arena_destroy(ctx->arena);
+  free(ctx);
+}
@@ -51,6 +51,10 @@ struct image {
 /* load_png loads a png file denoted by filename and writes a pointer to struct
  * image into the memory pointed to by img.
  *
+ * Every PNG color type and bit depth is accepted. The pixels are always
+ * expanded to 8-bit RGBA, 16-bit channels keep their most significant byte.
+ * Files written by store_png_banded are inflated on all available cores.
+ *
  * Please remember to free both img and img->px after you are finished using the
  * image. Please also remember to do it in the correct order :)
  *
@@ -58,6 +62,273 @@ struct image {
  */
 int load_png(const char *filename, struct image **img);
 
+/* load_png_mem works like load_png, but decodes a PNG of len bytes that is
+ * already in memory at buf, e.g. received from a socket. The bytes are parsed
+ * where they are and are not modified. They must stay valid for the call.
+ *
+ * This function returns 0 on success and a non-zero value on failure.
+ */
+int load_png_mem(const uint8_t *buf, size_t len, struct image **img);
+
+/* An image_view describes pixels in memory that the caller owns, e.g. a
+ * pooled slab or a shared memory segment. Row y of the view starts stride
+ * bytes after row y - 1, at (uint8_t *)px + y * stride, and holds size_x
+ * pixels.
+ *
+ * alignment is 0, or a power of 2 that px and stride are multiples of. A
+ * stride of 0 means that rows follow each other directly, each padded to a
+ * multiple of alignment. Otherwise, stride has to hold a row and be a
+ * multiple of sizeof(struct pixel).
+ */
+struct image_view {
+  struct pixel *px;
+  uint32_t size_x;
+  uint32_t size_y;
+  size_t stride;
+  size_t alignment;
+};
+
+/* load_png_into works like load_png, but decodes straight into the rows of
+ * dst instead of allocating an image. The size of dst must be the size of the
+ * image, which png_probe tells. Images too large for struct image can be
+ * loaded this way. Bytes between the rows are left alone.
+ *
+ * On failure, dst may have been partially written.
+ *
+ * This function returns 0 on success and a non-zero value on failure.
+ */
+int load_png_into(const char *filename, const struct image_view *dst);
+
+/* load_png_region works like load_png, but only loads the region of w by h
+ * pixels whose top left corner is at x0, y0. The region has to lie within the
+ * image. img receives an image of w by h pixels.
+ *
+ * Only the rows down to the last one of the region are inflated, only the
+ * columns of the region are converted, and the rest of the file is not read.
+ * Interlaced images are the exception: every pass covers the whole image, so
+ * they are decoded in full and cropped.
+ *
+ * This function returns 0 on success and a non-zero value on failure.
+ */
+int load_png_region(const char *filename, uint32_t x0, uint32_t y0,
+                    uint32_t w, uint32_t h, struct image **img);
+
+/* load_png_batch loads the n png files denoted by paths into imgs, which has
+ * room for n pointers. The files are opened and read through io_uring, many at
+ * a time, and decoded on all cores while the rest are being read. Kernels
+ * without io_uring, or without the requests it needs, get plain reads
+ * instead. Files that cannot be read ahead, such as pipes, are loaded like
+ * load_png loads them.
+ *
+ * Every image that loads is written to its place in imgs, the others are set
+ * to NULL. Free the images like those of load_png.
+ *
+ * This function returns 0 if every file was loaded and a non-zero value if
+ * any of them failed.
+ */
+int load_png_batch(const char **paths, size_t n, struct image **imgs);
+
+/* load_png_progressive works like load_png, and additionally reports the
+ * progress of Adam7 interlaced images. After each of the 7 passes, progress is
+ * called with a coarse preview of the full frame, in which every decoded pixel
+ * is replicated over the block that later passes fill in, and with the number
+ * of the pass (1 to 7). The preview is the image being loaded: it may be read,
+ * but not modified or kept past the call.
+ *
+ * If progress returns a non-zero value, decoding stops there and the preview
+ * is what img receives. The rest of the file is not read.
+ *
+ * progress may be NULL, and is never called for non-interlaced images.
+ */
+typedef int (*png_progress_fn)(const struct image *img, int pass, void *arg);
+
+int load_png_progressive(const char *filename, struct image **img,
+                         png_progress_fn progress, void *arg);
+
+/* load_png_ex works like load_png, with the options in opts. opts may be NULL,
+ * and a zeroed struct png_load_opts gives the defaults of load_png.
+ *
+ * crc tells how the CRCs of the chunks are checked:
+ *  - PNG_CRC_FUSED (the default) checks the CRC of image data in the same pass
+ *    that inflates it, so the data goes through the cache once. A corrupted
+ *    chunk still fails the load.
+ *  - PNG_CRC_CHECK checks every chunk before it is used.
+ *  - PNG_CRC_SKIP checks nothing. Use it only for trusted files, e.g. those
+ *    we wrote ourselves.
+ *
+ * Except with PNG_CRC_CHECK, ancillary chunks that decoding does not use, such
+ * as text, color profiles or Exif data, are skipped without being read.
+ *
+ * This function returns 0 on success and a non-zero value on failure.
+ */
+#define PNG_CRC_FUSED 0
+#define PNG_CRC_CHECK 1
+#define PNG_CRC_SKIP 2
+
+/* A png_allocator serves the temporary memory of a load: the inflate state,
+ * scratch rows and the like. All of it is freed before the load returns. The
+ * image itself is always allocated with malloc.
+ *
+ * alloc returns size bytes aligned for any type, or NULL on failure. free is
+ * never called with NULL. Both receive arg. Files written by store_png_banded
+ * are inflated on several threads, which call them at the same time.
+ */
+struct png_allocator {
+  void *(*alloc)(void *arg, size_t size);
+  void (*free)(void *arg, void *ptr);
+  void *arg;
+};
+
+/* allocator may be NULL, in which case every load gets a fresh png_arena.
+ *
+ * A scale of 2, 4 or 8 reduces the image by that factor while it is decoded,
+ * e.g. for thumbnails: every pixel is the average of a block of scale by
+ * scale pixels, and the full size image is never held in memory. The blocks
+ * at the right and bottom edges may be smaller. 0 or 1 loads the image as it
+ * is. Interlaced images are reduced as well, but need room for the sums of
+ * all blocks while their passes are decoded.
+ *
+ * A non-zero pipeline splits the decode of a single image over two cores:
+ * the calling thread inflates the image data while a second thread unfilters
+ * and converts the rows behind it. This cuts the time it takes to load one
+ * large image. Interlaced and reduced images are decoded on one thread, and
+ * files written by store_png_banded on all cores, as usual.
+ *
+ * ctx may be NULL, or a codec context (see png_codec_ctx_create) whose
+ * inflate state and memory the load reuses.
+ */
+struct png_codec_ctx;
+
+struct png_load_opts {
+  int crc;
+  const struct png_allocator *allocator;
+  int scale;
+  int pipeline;
+  struct png_codec_ctx *ctx;
+};
+
+int load_png_ex(const char *filename, struct image **img,
+                const struct png_load_opts *opts);
+
+/* load_png_mem_ex works like load_png_mem, with the options of load_png_ex */
+int load_png_mem_ex(const uint8_t *buf, size_t len, struct image **img,
+                    const struct png_load_opts *opts);
+
+/* A png_codec_ctx keeps what loading and storing an image sets up, for the
+ * images that follow: the inflate and deflate state of zlib, which is only
+ * reset, and the scratch memory of both. When many small images are loaded
+ * or stored one after the other, setting these up takes longer than the
+ * images themselves.
+ *
+ * load_png_ctx and store_png_ctx work like load_png and store_png, through
+ * ctx. A context may be used for any number of images, but only by one
+ * thread at a time.
+ *
+ * png_codec_ctx_create returns NULL on failure. png_codec_ctx_destroy
+ * releases the context.
+ */
+struct png_codec_ctx *png_codec_ctx_create(void);
+void png_codec_ctx_destroy(struct png_codec_ctx *ctx);
+
+int load_png_ctx(const char *filename, struct image **img,
+                 struct png_codec_ctx *ctx);
+int store_png_ctx(const char *filename, struct image *img,
+                  struct pixel *palette, uint8_t palette_length,
+                  struct png_codec_ctx *ctx);
+
+/* A png_arena is a bump allocator: its memory is handed out front to back and
+ * taken back all at once, as soon as everything has been freed, which is at
+ * the end of every load. An arena can be reused for any number of loads, and
+ * a batch of similar images is loaded through it without calling malloc for
+ * anything but the images.
+ *
+ * png_arena_create returns NULL on failure. png_arena_allocator returns an
+ * allocator for the options of load_png_ex. png_arena_destroy releases the
+ * arena, which must not be in use anymore.
+ */
+struct png_arena;
+
+struct png_arena *png_arena_create(void);
+struct png_allocator png_arena_allocator(struct png_arena *arena);
+void png_arena_destroy(struct png_arena *arena);
+
+/* png_probe reads the metadata of a png file denoted by filename without
+ * decoding it: only the signature and the IHDR chunk, which are the first 33
+ * bytes of the file, are read. Nothing is allocated.
+ *
+ * color_type, bit_depth and interlace hold the raw IHDR values: color type 0
+ * (grayscale), 2 (RGB), 3 (palette), 4 (grayscale with alpha) or 6 (RGBA), and
+ * interlace 0 (none) or 1 (Adam7).
+ *
+ * This function returns 0 on success and a non-zero value on failure.
+ */
+struct png_info {
+  uint32_t width;
+  uint32_t height;
+  uint8_t color_type;
+  uint8_t bit_depth;
+  uint8_t interlace;
+};
+
+int png_probe(const char *filename, struct png_info *info);
+
+/* png_reader decodes a png file one row at a time, so the memory it needs
+ * does not grow with the height of the image. This lets row-local filters run
+ * on images that are too large for struct image or for RAM. Interlaced images
+ * are the exception: their rows are only complete after the last pass, so the
+ * whole image is decoded into memory before the first row is handed out.
+ *
+ * png_reader_open opens the file denoted by filename, decodes its metadata and
+ * writes the dimensions of the image into size_x and size_y.
+ *
+ * png_reader_next_row decodes the next row and writes a pointer to its size_x
+ * pixels into row. The row belongs to the reader and stays valid until the
+ * next call. Rows may be modified in place.
+ *
+ * png_reader_close releases the reader.
+ *
+ * png_reader_open and png_reader_next_row return 0 on success and a non-zero
+ * value on failure or once all rows have been read.
+ */
+struct png_reader;
+
+int png_reader_open(const char *filename, struct png_reader **reader,
+                    uint32_t *size_x, uint32_t *size_y);
+int png_reader_next_row(struct png_reader *reader, struct pixel **row);
+void png_reader_close(struct png_reader *reader);
+
+/* png_push_decoder decodes a png whose bytes arrive in slices, e.g. from a
+ * socket, so decoding overlaps the transfer. Slices may be of any size and
+ * may split chunks anywhere. Image data is inflated as it arrives, and only
+ * a single row is kept, unless the image is interlaced: its rows are only
+ * complete after the last pass, so the whole image is kept until then.
+ *
+ * png_decoder_open creates a decoder that hands every completed row to
+ * row_fn, top to bottom, together with the row's y, the metadata of the image
+ * and arg. The row belongs to the decoder and stays valid until row_fn
+ * returns. If row_fn returns a non-zero value, decoding stops with a failure.
+ *
+ * png_decoder_push decodes the next len bytes of the file. Rows are handed out
+ * before the CRC of their chunk has arrived, so a corrupted chunk may show up
+ * after some of its rows.
+ *
+ * png_decoder_close releases the decoder and tells whether it received a
+ * complete and valid file and emitted all of its rows.
+ *
+ * These functions return 0 on success and a non-zero value on failure. Once
+ * png_decoder_push has failed, it keeps failing.
+ */
+typedef int (*png_row_fn)(const struct pixel *row, uint32_t y,
+                          const struct png_info *info, void *arg);
+
+struct png_push_decoder;
+
+int png_decoder_open(struct png_push_decoder **dec, png_row_fn row_fn,
+                     void *arg);
+int png_decoder_push(struct png_push_decoder *dec, const uint8_t *bytes,
+                     size_t len);
+int png_decoder_close(struct png_push_decoder *dec);
+
 /* store_png stores an image pointed to by img into a file whose name is passed
  * as a filename argument If the argument palette is NULL, the file will be
  * stored in the RGBA format. Otherwise, we will try to represent the image
@@ -69,4 +340,95 @@ int load_png(const char *filename, struct image **img);
 int store_png(const char *filename, struct image *img, struct pixel *palette,
               uint8_t palette_length);
 
+/* store_png_banded works like store_png, but lays the image data out so that
+ * load_png can inflate it on all cores. Every band_rows rows, the compressor
+ * is flushed with Z_FULL_FLUSH, which lets each band be inflated on its own,
+ * and a private ancillary chunk (bnDX) lists where each band starts. Other
+ * decoders skip that chunk and read the file as usual.
+ *
+ * A band_rows of 0 writes a plain file, exactly like store_png.
+ */
+int store_png_banded(const char *filename, struct image *img,
+                     struct pixel *palette, uint8_t palette_length,
+                     uint32_t band_rows);
+
+/* store_png_ex works like store_png, with the deflate parameters in opts.
+ * opts may be NULL, and a zeroed struct png_store_opts gives the defaults of
+ * store_png.
+ *
+ * level goes from 1 (fastest) to 9 (smallest file). 0 picks the default of
+ * 1, and a negative level stores the data without compressing it, which is
+ * the fastest write of all, e.g. for scratch files.
+ *
+ * strategy is one of zlib's: Z_DEFAULT_STRATEGY (0), Z_FILTERED,
+ * Z_HUFFMAN_ONLY or Z_RLE. Z_RLE is nearly as fast as Huffman coding alone
+ * and compresses images almost as well as the default strategy.
+ *
+ * mem_level (1 to 9) and window_bits (9 to 15) set the memory that deflate
+ * uses, see deflateInit2. 0 picks the defaults of zlib, 8 and 15.
+ *
+ * ctx may be NULL, or a codec context whose deflate state and buffers the
+ * store reuses. The state is only set up anew if the parameters differ from
+ * those of the last store through ctx.
+ *
+ * Image data of more than 128 KiB is split into blocks that are deflated on
+ * all cores, each one primed with the window of data before it. threads
+ * limits the number of threads that do so, 0 uses all cores. The file is
+ * the same for any number of threads.
+ *
+ * The image data is written in IDAT chunks of at most idat_size bytes, 0
+ * picks 64 KiB.
+ *
+ * A non-zero auto_palette stores images of at most 256 colors, counting
+ * alpha, as palette PNGs when no palette is passed. The palette holds the
+ * colors in the order they first appear, and their alpha goes to a tRNS
+ * chunk. Drawn images of few colors take about a quarter of the space this
+ * way. Other images are stored as RGBA.
+ */
+struct png_store_opts {
+  int level;
+  int strategy;
+  int mem_level;
+  int window_bits;
+  struct png_codec_ctx *ctx;
+  int threads;
+  uint32_t idat_size;
+  int auto_palette;
+};
+
+int store_png_ex(const char *filename, struct image *img,
+                 struct pixel *palette, uint8_t palette_length,
+                 const struct png_store_opts *opts);
+
+/* A png_writer stores a RGBA image of width by height pixels that is handed
+ * over a few rows at a time, e.g. as a filter produces them. Every row is
+ * filtered and deflated as soon as it arrives, and the data goes to the file
+ * an IDAT chunk at a time. Only a couple of rows and one chunk are held in
+ * memory, never the whole image, and images too large for struct image can
+ * be written too.
+ *
+ * png_writer_begin creates the file and writes its header. opts works like
+ * for store_png_ex, except that the data is deflated on the calling thread.
+ * A codec context in opts must not be used for anything else until the
+ * writer ends.
+ *
+ * png_writer_write_rows writes count rows of width pixels each, which follow
+ * each other at rows.
+ *
+ * png_writer_end finishes the file once all height rows have been written,
+ * and releases the writer. It has to be called for every writer that began,
+ * even after a failure, and fails itself if any row was missing or could not
+ * be written.
+ *
+ * These functions return 0 on success and a non-zero value on failure.
+ */
+struct png_writer;
+
+int png_writer_begin(struct png_writer **writer, const char *filename,
+                     uint32_t width, uint32_t height,
+                     const struct png_store_opts *opts);
+int png_writer_write_rows(struct png_writer *writer, const struct pixel *rows,
+                          uint32_t count);
+int png_writer_end(struct png_writer *writer);
+
 #endif
@@ -0,0 +1,64 @@
+#ifndef PREDICTOR_H
+#define PREDICTOR_H
+
+/* The predictors of the Average and Paeth filters, shared by the filters
+ * (scanfilter.c) and their reversal (unfilter.c). Both have to predict every
+ * byte exactly alike, so there is only this one copy of each.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#endif
+
+/* The Paeth predictor of a (left), b (above) and c (above left) */
+static inline uint8_t paeth_predictor(int a, int b, int c) {
+  int pa = abs(b - c);
+  int pb = abs(a - c);
+  int pc = abs(a + b - 2 * c);
+
+  if (pa <= pb && pa <= pc)
+    return a;
+  if (pb <= pc)
+    return b;
+  return c;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+static inline __m128i abs_epi16(__m128i x) {
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+static inline __m128i select_si128(__m128i mask, __m128i a, __m128i b) {
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+/* Floor of (a + b) / 2 per byte. pavgb rounds up, so we take the carry back
+ * when a + b is odd. */
+static inline __m128i average_floor(__m128i a, __m128i b) {
+  __m128i odd = _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1));
+  return _mm_sub_epi8(_mm_avg_epu8(a, b), odd);
+}
+
+/* The Paeth predictor of 8 bytes, widened to 16 bits so that a + b - c cannot
+ * overflow */
+static inline __m128i paeth_epi16(__m128i a, __m128i b, __m128i c) {
+  __m128i pa = _mm_sub_epi16(b, c);
+  __m128i pb = _mm_sub_epi16(a, c);
+  __m128i pc = abs_epi16(_mm_add_epi16(pa, pb));
+  __m128i smallest, predictor;
+
+  pa = abs_epi16(pa);
+  pb = abs_epi16(pb);
+  smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+
+  // Ties go to a, then to b
+  predictor = select_si128(_mm_cmpeq_epi16(pb, smallest), b, c);
+  return select_si128(_mm_cmpeq_epi16(pa, smallest), a, predictor);
+}
+
+#endif
+
+#endif
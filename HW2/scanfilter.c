@@ -0,0 +1,214 @@
+/* Applying the PNG scanline filters when an image is stored.
+ *
+ * See https://www.w3.org/TR/png/#9Filters for the definition of the filters,
+ * and https://www.w3.org/TR/png/#12Filter-selection for the heuristic that
+ * picks one per scanline. Unlike their reversal (see unfilter.c), the filters
+ * only depend on the original bytes, so every filter works on whole registers.
+ * A first pass computes the score of all filters at once, a second one writes
+ * the output of the best one.
+ */
+#include "scanfilter.h"
+#include "predictor.h"
+#include "unfilter.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define FILTER_COUNT 5
+
+/* The output of every filter for the byte x, whose neighbors are a (left),
+ * b (above) and c (above left) */
+static void filter_byte(uint8_t x, uint8_t a, uint8_t b, uint8_t c,
+                        uint8_t residuals[FILTER_COUNT]) {
+  residuals[PNG_FILTER_TYPE_NONE] = x;
+  residuals[PNG_FILTER_TYPE_SUB] = x - a;
+  residuals[PNG_FILTER_TYPE_UP] = x - b;
+  residuals[PNG_FILTER_TYPE_AVERAGE] = x - ((a + b) >> 1);
+  residuals[PNG_FILTER_TYPE_PAETH] = x - paeth_predictor(a, b, c);
+}
+
+/* Bytes at the beginning of a scanline have no left neighbor, those of the
+ * first scanline nothing above them */
+static void load_neighbors(const uint8_t *row, const uint8_t *prev, uint32_t i,
+                           uint32_t bpp, uint8_t *a, uint8_t *b, uint8_t *c) {
+  *a = i >= bpp ? row[i - bpp] : 0;
+  *b = prev ? prev[i] : 0;
+  *c = prev && i >= bpp ? prev[i - bpp] : 0;
+}
+
+static void score_filters_scalar(const uint8_t *row, const uint8_t *prev,
+                                 uint32_t start, uint32_t end, uint32_t bpp,
+                                 uint64_t scores[FILTER_COUNT]) {
+  for (uint32_t i = start; i < end; i++) {
+    uint8_t a, b, c, residuals[FILTER_COUNT];
+
+    load_neighbors(row, prev, i, bpp, &a, &b, &c);
+    filter_byte(row[i], a, b, c, residuals);
+
+    for (int f = 0; f < FILTER_COUNT; f++) {
+      scores[f] += abs((int8_t)residuals[f]);
+    }
+  }
+}
+
+static void apply_filter_scalar(uint8_t type, const uint8_t *row,
+                                const uint8_t *prev, uint32_t start,
+                                uint32_t end, uint32_t bpp, uint8_t *out) {
+  for (uint32_t i = start; i < end; i++) {
+    uint8_t a, b, c, residuals[FILTER_COUNT];
+
+    load_neighbors(row, prev, i, bpp, &a, &b, &c);
+    filter_byte(row[i], a, b, c, residuals);
+    out[i] = residuals[type];
+  }
+}
+
+#ifdef __SSE2__
+
+static inline __m128i paeth_sse2(__m128i a, __m128i b, __m128i c) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i lo = paeth_epi16(_mm_unpacklo_epi8(a, zero),
+                           _mm_unpacklo_epi8(b, zero),
+                           _mm_unpacklo_epi8(c, zero));
+  __m128i hi = paeth_epi16(_mm_unpackhi_epi8(a, zero),
+                           _mm_unpackhi_epi8(b, zero),
+                           _mm_unpackhi_epi8(c, zero));
+
+  return _mm_packus_epi16(lo, hi);
+}
+
+/* The output of one filter for 16 bytes */
+static inline __m128i filter_sse2(uint8_t type, __m128i x, __m128i a,
+                                  __m128i b, __m128i c) {
+  switch (type) {
+  case PNG_FILTER_TYPE_SUB:
+    return _mm_sub_epi8(x, a);
+  case PNG_FILTER_TYPE_UP:
+    return _mm_sub_epi8(x, b);
+  case PNG_FILTER_TYPE_AVERAGE:
+    return _mm_sub_epi8(x, average_floor(a, b));
+  case PNG_FILTER_TYPE_PAETH:
+    return _mm_sub_epi8(x, paeth_sse2(a, b, c));
+  default:
+    return x;
+  }
+}
+
+/* Sum of the absolute values of 16 signed bytes, in two 64-bit halves. As
+ * unsigned bytes, the absolute value of x is the smaller of x and -x. */
+static inline __m128i abs_sum_sse2(__m128i x) {
+  __m128i zero = _mm_setzero_si128();
+  return _mm_sad_epu8(_mm_min_epu8(x, _mm_sub_epi8(zero, x)), zero);
+}
+
+/* Score the bytes from bpp on, which have all of their neighbors, 16 at a
+ * time. Returns where the scalar code has to take over. */
+static uint32_t score_filters_sse2(const uint8_t *row, const uint8_t *prev,
+                                   uint32_t length, uint32_t bpp,
+                                   uint64_t scores[FILTER_COUNT]) {
+  __m128i sums[FILTER_COUNT];
+  uint64_t halves[2];
+  uint32_t i = bpp;
+
+  for (int f = 0; f < FILTER_COUNT; f++) {
+    sums[f] = _mm_setzero_si128();
+  }
+
+  for (; i + 16 <= length; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(row + i));
+    __m128i a = _mm_loadu_si128((const __m128i *)(row + i - bpp));
+    __m128i b = _mm_loadu_si128((const __m128i *)(prev + i));
+    __m128i c = _mm_loadu_si128((const __m128i *)(prev + i - bpp));
+
+    for (int f = 0; f < FILTER_COUNT; f++) {
+      __m128i residuals = filter_sse2(f, x, a, b, c);
+      sums[f] = _mm_add_epi64(sums[f], abs_sum_sse2(residuals));
+    }
+  }
+
+  for (int f = 0; f < FILTER_COUNT; f++) {
+    _mm_storeu_si128((__m128i *)halves, sums[f]);
+    scores[f] += halves[0] + halves[1];
+  }
+
+  return i;
+}
+
+static uint32_t apply_filter_sse2(uint8_t type, const uint8_t *row,
+                                  const uint8_t *prev, uint32_t length,
+                                  uint32_t bpp, uint8_t *out) {
+  uint32_t i = bpp;
+
+  for (; i + 16 <= length; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(row + i));
+    __m128i a = _mm_loadu_si128((const __m128i *)(row + i - bpp));
+    __m128i b = _mm_loadu_si128((const __m128i *)(prev + i));
+    __m128i c = _mm_loadu_si128((const __m128i *)(prev + i - bpp));
+
+    _mm_storeu_si128((__m128i *)(out + i), filter_sse2(type, x, a, b, c));
+  }
+
+  return i;
+}
+
+#endif
+
+/* Score every filter over the whole scanline */
+static void score_filters(const uint8_t *row, const uint8_t *prev,
+                          uint32_t length, uint32_t bpp,
+                          uint64_t scores[FILTER_COUNT]) {
+  uint32_t start = 0;
+
+  memset(scores, 0, sizeof(uint64_t) * FILTER_COUNT);
+
+#ifdef __SSE2__
+  // The first pixel has no left neighbor
+  if (prev && length > bpp) {
+    score_filters_scalar(row, prev, 0, bpp, bpp, scores);
+    start = score_filters_sse2(row, prev, length, bpp, scores);
+  }
+#endif
+
+  score_filters_scalar(row, prev, start, length, bpp, scores);
+}
+
+static void apply_filter(uint8_t type, const uint8_t *row, const uint8_t *prev,
+                         uint32_t length, uint32_t bpp, uint8_t *out) {
+  uint32_t start = 0;
+
+  if (type == PNG_FILTER_TYPE_NONE) {
+    memcpy(out, row, length);
+    return;
+  }
+
+#ifdef __SSE2__
+  if (prev && length > bpp) {
+    apply_filter_scalar(type, row, prev, 0, bpp, bpp, out);
+    start = apply_filter_sse2(type, row, prev, length, bpp, out);
+  }
+#endif
+
+  apply_filter_scalar(type, row, prev, start, length, bpp, out);
+}
+
+void filter_scanline(const uint8_t *scanline, const uint8_t *prev,
+                     uint32_t length, uint32_t bpp, uint8_t *out) {
+  uint64_t scores[FILTER_COUNT];
+  int candidates = prev ? FILTER_COUNT : PNG_FILTER_TYPE_SUB + 1;
+  uint8_t best = PNG_FILTER_TYPE_NONE;
+
+  score_filters(scanline, prev, length, bpp, scores);
+
+  // Ties go to the simpler filter
+  for (int f = 1; f < candidates; f++) {
+    if (scores[f] < scores[best]) {
+      best = f;
+    }
+  }
+
+  out[0] = best;
+  apply_filter(best, scanline, prev, length, bpp, out + 1);
+}
@@ -0,0 +1,20 @@
+#ifndef SCANFILTER_H
+#define SCANFILTER_H
+
+#include <stdint.h>
+
+/* Filter one scanline of length bytes for storing. bpp is the number of bytes
+ * per pixel (at least 1), prev the previous scanline before it was filtered,
+ * or NULL if the scanline has to stand on its own: the first one of the image
+ * or of a band.
+ *
+ * The filter is picked per scanline: the one whose output has the smallest
+ * sum of absolute values, taken as signed bytes, which tends to compress
+ * best. Without prev, only None and Sub are tried.
+ *
+ * out receives the filter type byte followed by the length filtered bytes.
+ */
+void filter_scanline(const uint8_t *scanline, const uint8_t *prev,
+                     uint32_t length, uint32_t bpp, uint8_t *out);
+
+#endif
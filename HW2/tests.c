@@ -3,9 +3,12 @@
 #include <check.h>
 #include <float.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include "filter.h"
+#include "zlib.h"
 
 struct image generate_rand_img()
 {
@@ -833,6 +836,1103 @@ START_TEST(transparency_edge_case)
 }
 END_TEST
 
+/* Reads a whole file into a buffer that the caller frees */
+long read_stored_file(const char *path, uint8_t **buf)
+{
+  FILE *file = fopen(path, "rb");
+  long len;
+
+  ck_assert_ptr_ne(file, NULL);
+  fseek(file, 0, SEEK_END);
+  len = ftell(file);
+  rewind(file);
+  *buf = malloc(len);
+  ck_assert_int_eq(fread(*buf, 1, len, file), len);
+  fclose(file);
+  return len;
+}
+
+/* Reading an image row by row gives the same pixels as loading it whole, and
+ * the reader stops after the last row */
+START_TEST(reader_rows_match_load)
+{
+  const char *paths[] = {"test_imgs/summer.png",
+                         "test_imgs/desert_interlaced.png"};
+  struct image *img;
+  struct png_reader *reader;
+  struct pixel *row;
+  uint32_t size_x, size_y;
+
+  for (int k = 0; k < 2; k++)
+  {
+    ck_assert_int_eq(load_png(paths[k], &img), 0);
+    ck_assert_int_eq(png_reader_open(paths[k], &reader, &size_x, &size_y), 0);
+    ck_assert_uint_eq(size_x, img->size_x);
+    ck_assert_uint_eq(size_y, img->size_y);
+
+    for (uint32_t i = 0; i < size_y; i++)
+    {
+      ck_assert_int_eq(png_reader_next_row(reader, &row), 0);
+      for (uint32_t j = 0; j < size_x; j++)
+      {
+        ck_assert_uint_eq(row[j].red, img->px[i * size_x + j].red);
+        ck_assert_uint_eq(row[j].green, img->px[i * size_x + j].green);
+        ck_assert_uint_eq(row[j].blue, img->px[i * size_x + j].blue);
+        ck_assert_uint_eq(row[j].alpha, img->px[i * size_x + j].alpha);
+      }
+      /* Rows belong to the caller until the next call */
+      memset(row, 0, size_x * sizeof(struct pixel));
+    }
+    ck_assert_int_ne(png_reader_next_row(reader, &row), 0);
+
+    png_reader_close(reader);
+    free(img->px);
+    free(img);
+  }
+}
+END_TEST
+
+/* The reader hands out rows before their chunk has been inflated to its end,
+ * so it has to check the CRC of every IDAT chunk, the first one too */
+START_TEST(reader_rejects_bad_crc)
+{
+  struct png_reader *reader;
+  struct pixel *row;
+  uint32_t size_x, size_y, pos = 8;
+  uint8_t *buf;
+  long len = read_stored_file("test_imgs/summer.png", &buf);
+  char path[] = "/tmp/reader_XXXXXX";
+  int fd = mkstemp(path);
+  int failed;
+
+  ck_assert_int_ne(fd, -1);
+
+  // Flip a bit in the CRC of the first IDAT chunk
+  while (memcmp(buf + pos + 4, "IDAT", 4))
+    pos += 12 + ((uint32_t)buf[pos] << 24 | buf[pos + 1] << 16 |
+                 buf[pos + 2] << 8 | buf[pos + 3]);
+  pos += 8 + ((uint32_t)buf[pos] << 24 | buf[pos + 1] << 16 |
+              buf[pos + 2] << 8 | buf[pos + 3]);
+  buf[pos + 3] ^= 1;
+  ck_assert_int_eq(write(fd, buf, len), len);
+  close(fd);
+
+  failed = png_reader_open(path, &reader, &size_x, &size_y);
+  if (!failed)
+  {
+    failed = png_reader_next_row(reader, &row);
+    png_reader_close(reader);
+  }
+  ck_assert_int_ne(failed, 0);
+
+  unlink(path);
+  free(buf);
+}
+END_TEST
+
+/* An image whose scanlines use all five filter types decodes to the same
+ * pixels as the unfiltered original */
+START_TEST(load_filtered_image)
+{
+  struct image *img, *img_filtered;
+
+  ck_assert_int_eq(load_png("test_imgs/desert.png", &img), 0);
+  ck_assert_int_eq(load_png("test_imgs/desert_filtered.png", &img_filtered), 0);
+
+  ck_assert_uint_eq(img_filtered->size_x, img->size_x);
+  ck_assert_uint_eq(img_filtered->size_y, img->size_y);
+  for (long j = 0; j < img->size_x * img->size_y; j++)
+  {
+    ck_assert_uint_eq(img_filtered->px[j].red, img->px[j].red);
+    ck_assert_uint_eq(img_filtered->px[j].green, img->px[j].green);
+    ck_assert_uint_eq(img_filtered->px[j].blue, img->px[j].blue);
+    ck_assert_uint_eq(img_filtered->px[j].alpha, img->px[j].alpha);
+  }
+  free(img_filtered->px);
+  free(img->px);
+  free(img_filtered);
+  free(img);
+}
+END_TEST
+
+/* An RGB image without alpha channel comes out opaque, with the same colors
+ * as the RGBA original it was made from */
+START_TEST(load_rgb_image)
+{
+  struct image *img, *img_rgb;
+
+  ck_assert_int_eq(load_png("test_imgs/desert.png", &img), 0);
+  ck_assert_int_eq(load_png("test_imgs/desert_rgb.png", &img_rgb), 0);
+
+  ck_assert_uint_eq(img_rgb->size_x, img->size_x);
+  ck_assert_uint_eq(img_rgb->size_y, img->size_y);
+  for (long j = 0; j < img->size_x * img->size_y; j++)
+  {
+    ck_assert_uint_eq(img_rgb->px[j].red, img->px[j].red);
+    ck_assert_uint_eq(img_rgb->px[j].green, img->px[j].green);
+    ck_assert_uint_eq(img_rgb->px[j].blue, img->px[j].blue);
+    ck_assert_uint_eq(img_rgb->px[j].alpha, 255);
+  }
+  free(img_rgb->px);
+  free(img->px);
+  free(img_rgb);
+  free(img);
+}
+END_TEST
+
+START_TEST(load_interlaced_image)
+{
+  struct image *img, *img_interlaced;
+
+  ck_assert_int_eq(load_png("test_imgs/desert.png", &img), 0);
+  ck_assert_int_eq(load_png("test_imgs/desert_interlaced.png", &img_interlaced), 0);
+
+  ck_assert_uint_eq(img_interlaced->size_x, img->size_x);
+  ck_assert_uint_eq(img_interlaced->size_y, img->size_y);
+  for (long j = 0; j < img->size_x * img->size_y; j++)
+  {
+    ck_assert_uint_eq(img_interlaced->px[j].red, img->px[j].red);
+    ck_assert_uint_eq(img_interlaced->px[j].green, img->px[j].green);
+    ck_assert_uint_eq(img_interlaced->px[j].blue, img->px[j].blue);
+    ck_assert_uint_eq(img_interlaced->px[j].alpha, img->px[j].alpha);
+  }
+  free(img_interlaced->px);
+  free(img->px);
+  free(img_interlaced);
+  free(img);
+}
+END_TEST
+
+/* Records the pass and stops the loader right after it */
+static int stop_after_first_pass(const struct image *img, int pass, void *arg)
+{
+  *(int *)arg = pass;
+  return 1;
+}
+
+START_TEST(load_interlaced_preview)
+{
+  struct image *img, *preview;
+  int passes = 0;
+
+  ck_assert_int_eq(load_png("test_imgs/desert.png", &img), 0);
+  ck_assert_int_eq(load_png_progressive("test_imgs/desert_interlaced.png",
+                                        &preview, stop_after_first_pass,
+                                        &passes), 0);
+  ck_assert_int_eq(passes, 1);
+
+  ck_assert_uint_eq(preview->size_x, img->size_x);
+  ck_assert_uint_eq(preview->size_y, img->size_y);
+  for (long y = 0; y < img->size_y; y++)
+  {
+    for (long x = 0; x < img->size_x; x++)
+    {
+      struct pixel *p = &preview->px[y * img->size_x + x];
+      struct pixel *q = &img->px[(y & ~7) * img->size_x + (x & ~7)];
+      ck_assert_uint_eq(p->red, q->red);
+      ck_assert_uint_eq(p->green, q->green);
+      ck_assert_uint_eq(p->blue, q->blue);
+      ck_assert_uint_eq(p->alpha, q->alpha);
+    }
+  }
+  free(preview->px);
+  free(img->px);
+  free(preview);
+  free(img);
+}
+END_TEST
+
+START_TEST(probe_metadata)
+{
+  struct png_info info;
+
+  ck_assert_int_eq(png_probe("test_imgs/desert_interlaced.png", &info), 0);
+  ck_assert_uint_eq(info.width, 255);
+  ck_assert_uint_eq(info.height, 170);
+  ck_assert_uint_eq(info.color_type, 6);
+  ck_assert_uint_eq(info.bit_depth, 8);
+  ck_assert_uint_eq(info.interlace, 1);
+
+  ck_assert_int_eq(png_probe("test_imgs/desert_rgb.png", &info), 0);
+  ck_assert_uint_eq(info.color_type, 2);
+  ck_assert_uint_eq(info.interlace, 0);
+
+  ck_assert_int_ne(png_probe("tests.c", &info), 0);
+}
+END_TEST
+
+START_TEST(load_banded_image)
+{
+  struct image *img, *img_banded;
+
+  ck_assert_int_eq(load_png("test_imgs/desert.png", &img), 0);
+  ck_assert_int_eq(load_png("test_imgs/desert_banded.png", &img_banded), 0);
+
+  ck_assert_uint_eq(img_banded->size_x, img->size_x);
+  ck_assert_uint_eq(img_banded->size_y, img->size_y);
+  for (long j = 0; j < img->size_x * img->size_y; j++)
+  {
+    ck_assert_uint_eq(img_banded->px[j].red, img->px[j].red);
+    ck_assert_uint_eq(img_banded->px[j].green, img->px[j].green);
+    ck_assert_uint_eq(img_banded->px[j].blue, img->px[j].blue);
+    ck_assert_uint_eq(img_banded->px[j].alpha, img->px[j].alpha);
+  }
+  free(img_banded->px);
+  free(img->px);
+  free(img_banded);
+  free(img);
+}
+END_TEST
+
+START_TEST(load_banded_image_with_bad_checksum)
+{
+  struct png_load_opts opts = {.crc = PNG_CRC_SKIP};
+  struct image *img;
+  uint8_t *buf;
+  long len = read_stored_file("test_imgs/desert_banded.png", &buf);
+  uint32_t idat_end = 0;
+
+  // Find the end of the last IDAT chunk, where the Adler-32 of the stream is
+  for (uint32_t pos = 8; pos + 8 <= len;)
+  {
+    uint32_t length = (uint32_t)buf[pos] << 24 | buf[pos + 1] << 16 |
+                      buf[pos + 2] << 8 | buf[pos + 3];
+
+    if (!memcmp(buf + pos + 4, "IDAT", 4))
+      idat_end = pos + 8 + length;
+    pos += 12 + length;
+  }
+  ck_assert_uint_ne(idat_end, 0);
+
+  ck_assert_int_eq(load_png_mem_ex(buf, len, &img, &opts), 0);
+  free(img->px);
+  free(img);
+
+  // The bands are inflated raw, zlib does not check the stream for us
+  buf[idat_end - 1] ^= 1;
+  ck_assert_int_ne(load_png_mem_ex(buf, len, &img, &opts), 0);
+  free(buf);
+}
+END_TEST
+
+/* Copies test_imgs/desert_banded.png into the FIFO at arg */
+void *feed_banded_fifo(void *arg)
+{
+  FILE *in = fopen("test_imgs/desert_banded.png", "rb");
+  FILE *out = fopen(arg, "wb");
+  char buf[4096];
+  size_t len;
+
+  while (in && out && (len = fread(buf, 1, sizeof(buf), in)) > 0)
+  {
+    fwrite(buf, 1, len, out);
+  }
+
+  if (in)
+    fclose(in);
+  if (out)
+    fclose(out);
+  return NULL;
+}
+
+START_TEST(load_banded_image_from_pipe)
+{
+  struct image *img, *img_piped;
+  char dir[] = "/tmp/banded_XXXXXX";
+  char path[sizeof(dir) + 8];
+  pthread_t feeder;
+
+  ck_assert_ptr_ne(mkdtemp(dir), NULL);
+  snprintf(path, sizeof(path), "%s/fifo", dir);
+  ck_assert_int_eq(mkfifo(path, 0600), 0);
+
+  // A pipe cannot be walked twice, so its bands are inflated as one stream
+  ck_assert_int_eq(pthread_create(&feeder, NULL, feed_banded_fifo, path), 0);
+  ck_assert_int_eq(load_png(path, &img_piped), 0);
+  pthread_join(feeder, NULL);
+
+  ck_assert_int_eq(load_png("test_imgs/desert_banded.png", &img), 0);
+  ck_assert_uint_eq(img_piped->size_x, img->size_x);
+  ck_assert_uint_eq(img_piped->size_y, img->size_y);
+  ck_assert_int_eq(memcmp(img_piped->px, img->px,
+                          sizeof(struct pixel) * img->size_x * img->size_y),
+                   0);
+
+  unlink(path);
+  rmdir(dir);
+  free(img_piped->px);
+  free(img_piped);
+  free(img->px);
+  free(img);
+}
+END_TEST
+
+START_TEST(load_image_from_memory)
+{
+  struct image *img, *img_mem;
+  FILE *file = fopen("test_imgs/desert_rgb.png", "rb");
+  uint8_t *buf;
+  long len;
+
+  ck_assert_ptr_ne(file, NULL);
+  fseek(file, 0, SEEK_END);
+  len = ftell(file);
+  rewind(file);
+  buf = malloc(len);
+  ck_assert_int_eq(fread(buf, 1, len, file), len);
+  fclose(file);
+
+  ck_assert_int_eq(load_png("test_imgs/desert_rgb.png", &img), 0);
+  ck_assert_int_eq(load_png_mem(buf, len, &img_mem), 0);
+  ck_assert_int_ne(load_png_mem(buf, len / 2, &img_mem), 0);
+
+  ck_assert_uint_eq(img_mem->size_x, img->size_x);
+  ck_assert_uint_eq(img_mem->size_y, img->size_y);
+  for (long j = 0; j < img->size_x * img->size_y; j++)
+  {
+    ck_assert_uint_eq(img_mem->px[j].red, img->px[j].red);
+    ck_assert_uint_eq(img_mem->px[j].green, img->px[j].green);
+    ck_assert_uint_eq(img_mem->px[j].blue, img->px[j].blue);
+    ck_assert_uint_eq(img_mem->px[j].alpha, img->px[j].alpha);
+  }
+  free(img_mem->px);
+  free(img->px);
+  free(img_mem);
+  free(img);
+  free(buf);
+}
+END_TEST
+
+START_TEST(load_batch_of_images)
+{
+  const char *paths[] = {"test_imgs/ck.png", "test_imgs/missing.png",
+                         "test_imgs/desert_rgb.png", "test_imgs/ck.png"};
+  struct image *imgs[4];
+  struct image *img;
+
+  ck_assert_int_ne(load_png_batch(paths, 4, imgs), 0);
+  ck_assert_ptr_eq(imgs[1], NULL);
+
+  for (int i = 0; i < 4; i++)
+  {
+    if (i == 1)
+      continue;
+
+    ck_assert_ptr_ne(imgs[i], NULL);
+    ck_assert_int_eq(load_png(paths[i], &img), 0);
+    ck_assert_uint_eq(imgs[i]->size_x, img->size_x);
+    ck_assert_uint_eq(imgs[i]->size_y, img->size_y);
+    for (long j = 0; j < img->size_x * img->size_y; j++)
+    {
+      ck_assert_uint_eq(imgs[i]->px[j].red, img->px[j].red);
+      ck_assert_uint_eq(imgs[i]->px[j].green, img->px[j].green);
+      ck_assert_uint_eq(imgs[i]->px[j].blue, img->px[j].blue);
+      ck_assert_uint_eq(imgs[i]->px[j].alpha, img->px[j].alpha);
+    }
+    free(img->px);
+    free(img);
+    free(imgs[i]->px);
+    free(imgs[i]);
+  }
+}
+END_TEST
+
+START_TEST(load_batch_with_pipe)
+{
+  const char *paths[] = {"test_imgs/ck.png", NULL,
+                         "test_imgs/desert_banded.png"};
+  char dir[] = "/tmp/batch_XXXXXX";
+  char path[sizeof(dir) + 8];
+  struct image *imgs[3];
+  pthread_t feeder;
+
+  ck_assert_ptr_ne(mkdtemp(dir), NULL);
+  snprintf(path, sizeof(path), "%s/fifo", dir);
+  ck_assert_int_eq(mkfifo(path, 0600), 0);
+  paths[1] = path;
+
+  // The pipe cannot be read ahead, so it is loaded on its own like load_png
+  ck_assert_int_eq(pthread_create(&feeder, NULL, feed_banded_fifo, path), 0);
+  ck_assert_int_eq(load_png_batch(paths, 3, imgs), 0);
+  pthread_join(feeder, NULL);
+
+  ck_assert_uint_eq(imgs[1]->size_x, imgs[2]->size_x);
+  ck_assert_uint_eq(imgs[1]->size_y, imgs[2]->size_y);
+  ck_assert_int_eq(memcmp(imgs[1]->px, imgs[2]->px,
+                          sizeof(struct pixel) * imgs[2]->size_x *
+                              imgs[2]->size_y),
+                   0);
+
+  unlink(path);
+  rmdir(dir);
+  for (int i = 0; i < 3; i++)
+  {
+    free(imgs[i]->px);
+    free(imgs[i]);
+  }
+}
+END_TEST
+
+START_TEST(load_with_crc_modes)
+{
+  int modes[] = {PNG_CRC_FUSED, PNG_CRC_CHECK, PNG_CRC_SKIP};
+  // Whether each mode rejects a broken IDAT CRC and a broken tEXt CRC
+  int rejects_idat[] = {1, 1, 0};
+  int rejects_text[] = {0, 1, 0};
+  uint8_t text[] = {0, 0, 0, 9, 't', 'E', 'X', 't', 'C', 'o', 'm', 'm',
+                    'e', 'n', 't', 0, 'x', 0, 0, 0, 0};
+  struct image *img, *img_ex;
+  uint8_t *buf, *bad_idat, *bad_text;
+  long len = read_stored_file("test_imgs/desert_rgb.png", &buf);
+  uint32_t crc, pos = 8;
+
+  ck_assert_int_eq(load_png("test_imgs/desert_rgb.png", &img), 0);
+
+  // Flip a bit in the CRC of the first IDAT chunk
+  bad_idat = malloc(len);
+  memcpy(bad_idat, buf, len);
+  while (memcmp(bad_idat + pos + 4, "IDAT", 4))
+    pos += 12 + ((uint32_t)buf[pos] << 24 | buf[pos + 1] << 16 |
+                 buf[pos + 2] << 8 | buf[pos + 3]);
+  pos += 8 + ((uint32_t)buf[pos] << 24 | buf[pos + 1] << 16 |
+              buf[pos + 2] << 8 | buf[pos + 3]);
+  bad_idat[pos + 3] ^= 1;
+
+  // Put a tEXt chunk with a wrong CRC right after IHDR
+  crc = crc32(0, text + 4, sizeof(text) - 8) ^ 1;
+  for (int k = 0; k < 4; k++)
+    text[sizeof(text) - 4 + k] = crc >> (24 - 8 * k);
+  bad_text = malloc(len + sizeof(text));
+  memcpy(bad_text, buf, 33);
+  memcpy(bad_text + 33, text, sizeof(text));
+  memcpy(bad_text + 33 + sizeof(text), buf + 33, len - 33);
+
+  for (int i = 0; i < 3; i++)
+  {
+    struct png_load_opts opts = {.crc = modes[i]};
+
+    ck_assert_int_eq(load_png_ex("test_imgs/desert_rgb.png", &img_ex, &opts),
+                     0);
+    ck_assert_uint_eq(img_ex->size_x, img->size_x);
+    ck_assert_uint_eq(img_ex->size_y, img->size_y);
+    for (long j = 0; j < img->size_x * img->size_y; j++)
+    {
+      ck_assert_uint_eq(img_ex->px[j].red, img->px[j].red);
+      ck_assert_uint_eq(img_ex->px[j].green, img->px[j].green);
+      ck_assert_uint_eq(img_ex->px[j].blue, img->px[j].blue);
+      ck_assert_uint_eq(img_ex->px[j].alpha, img->px[j].alpha);
+    }
+    free(img_ex->px);
+    free(img_ex);
+
+    ck_assert_int_eq(load_png_mem_ex(bad_idat, len, &img_ex, &opts) != 0,
+                     rejects_idat[i]);
+    if (!rejects_idat[i])
+    {
+      ck_assert_int_eq(memcmp(img_ex->px, img->px,
+                              sizeof(struct pixel) * img->size_x *
+                                  img->size_y),
+                       0);
+      free(img_ex->px);
+      free(img_ex);
+    }
+
+    ck_assert_int_eq(load_png_mem_ex(bad_text, len + sizeof(text), &img_ex,
+                                     &opts) != 0,
+                     rejects_text[i]);
+    if (!rejects_text[i])
+    {
+      ck_assert_int_eq(memcmp(img_ex->px, img->px,
+                              sizeof(struct pixel) * img->size_x *
+                                  img->size_y),
+                       0);
+      free(img_ex->px);
+      free(img_ex);
+    }
+  }
+  free(bad_text);
+  free(bad_idat);
+  free(buf);
+  free(img->px);
+  free(img);
+}
+END_TEST
+
+START_TEST(load_through_arena)
+{
+  const char *paths[] = {"test_imgs/desert_rgb.png", "test_imgs/ck.png",
+                         "test_imgs/desert_banded.png"};
+  struct png_arena *arena = png_arena_create();
+  struct png_allocator allocator;
+  struct png_load_opts opts = {0};
+  struct image *img, *img_arena;
+
+  ck_assert_ptr_ne(arena, NULL);
+  allocator = png_arena_allocator(arena);
+  opts.allocator = &allocator;
+
+  // The arena is reused for every image
+  for (int i = 0; i < 3; i++)
+  {
+    ck_assert_int_eq(load_png(paths[i], &img), 0);
+    ck_assert_int_eq(load_png_ex(paths[i], &img_arena, &opts), 0);
+    ck_assert_uint_eq(img_arena->size_x, img->size_x);
+    ck_assert_uint_eq(img_arena->size_y, img->size_y);
+    for (long j = 0; j < img->size_x * img->size_y; j++)
+    {
+      ck_assert_uint_eq(img_arena->px[j].red, img->px[j].red);
+      ck_assert_uint_eq(img_arena->px[j].green, img->px[j].green);
+      ck_assert_uint_eq(img_arena->px[j].blue, img->px[j].blue);
+      ck_assert_uint_eq(img_arena->px[j].alpha, img->px[j].alpha);
+    }
+    free(img_arena->px);
+    free(img_arena);
+    free(img->px);
+    free(img);
+  }
+  png_arena_destroy(arena);
+}
+END_TEST
+
+START_TEST(load_image_into_view)
+{
+  struct image *img;
+  struct image_view view = {0};
+  uint8_t *rows;
+
+  ck_assert_int_eq(load_png("test_imgs/desert_rgb.png", &img), 0);
+
+  // Rows padded to 64 bytes, with room to spare after each
+  view.size_x = img->size_x;
+  view.size_y = img->size_y;
+  view.alignment = 64;
+  view.stride = (sizeof(struct pixel) * img->size_x + 63) / 64 * 64 + 64;
+  rows = aligned_alloc(64, view.stride * view.size_y);
+  ck_assert_ptr_ne(rows, NULL);
+  view.px = (struct pixel *)rows;
+
+  ck_assert_int_eq(load_png_into("test_imgs/desert_rgb.png", &view), 0);
+  for (long y = 0; y < img->size_y; y++)
+  {
+    struct pixel *row = (struct pixel *)(rows + y * view.stride);
+
+    for (long x = 0; x < img->size_x; x++)
+    {
+      struct pixel *px = &img->px[y * img->size_x + x];
+
+      ck_assert_uint_eq(row[x].red, px->red);
+      ck_assert_uint_eq(row[x].green, px->green);
+      ck_assert_uint_eq(row[x].blue, px->blue);
+      ck_assert_uint_eq(row[x].alpha, px->alpha);
+    }
+  }
+
+  // The view has to match the image and keep its alignment
+  view.size_y--;
+  ck_assert_int_ne(load_png_into("test_imgs/desert_rgb.png", &view), 0);
+  view.size_y++;
+  view.px = (struct pixel *)(rows + sizeof(struct pixel));
+  ck_assert_int_ne(load_png_into("test_imgs/desert_rgb.png", &view), 0);
+
+  free(rows);
+  free(img->px);
+  free(img);
+}
+END_TEST
+
+START_TEST(skip_unused_metadata)
+{
+  struct image *img, *img_meta;
+  struct png_load_opts opts = {.crc = PNG_CRC_CHECK};
+
+  // ck_metadata.png is ck.png with text and an eXIf chunk whose CRC is broken
+  ck_assert_int_eq(load_png("test_imgs/ck.png", &img), 0);
+  ck_assert_int_eq(load_png("test_imgs/ck_metadata.png", &img_meta), 0);
+  ck_assert_int_ne(load_png_ex("test_imgs/ck_metadata.png", &img_meta, &opts),
+                   0);
+
+  ck_assert_uint_eq(img_meta->size_x, img->size_x);
+  ck_assert_uint_eq(img_meta->size_y, img->size_y);
+  for (long j = 0; j < img->size_x * img->size_y; j++)
+  {
+    ck_assert_uint_eq(img_meta->px[j].red, img->px[j].red);
+    ck_assert_uint_eq(img_meta->px[j].green, img->px[j].green);
+    ck_assert_uint_eq(img_meta->px[j].blue, img->px[j].blue);
+    ck_assert_uint_eq(img_meta->px[j].alpha, img->px[j].alpha);
+  }
+  free(img_meta->px);
+  free(img_meta);
+  free(img->px);
+  free(img);
+}
+END_TEST
+
+START_TEST(load_image_region)
+{
+  struct image *img, *region;
+
+  ck_assert_int_eq(load_png("test_imgs/desert_gray.png", &img), 0);
+  ck_assert_int_eq(load_png_region("test_imgs/desert_gray.png", 3, 5, 17, 9,
+                                   &region),
+                   0);
+  ck_assert_uint_eq(region->size_x, 17);
+  ck_assert_uint_eq(region->size_y, 9);
+
+  for (long y = 0; y < 9; y++)
+  {
+    for (long x = 0; x < 17; x++)
+    {
+      struct pixel *px = &img->px[(y + 5) * img->size_x + x + 3];
+
+      ck_assert_uint_eq(region->px[y * 17 + x].red, px->red);
+      ck_assert_uint_eq(region->px[y * 17 + x].green, px->green);
+      ck_assert_uint_eq(region->px[y * 17 + x].blue, px->blue);
+      ck_assert_uint_eq(region->px[y * 17 + x].alpha, px->alpha);
+    }
+  }
+
+  // The region has to lie within the image
+  ck_assert_int_ne(load_png_region("test_imgs/desert_gray.png", 3,
+                                   img->size_y, 1, 1, &region),
+                   0);
+
+  free(region->px);
+  free(region);
+  free(img->px);
+  free(img);
+
+  // Full rows of RGBA images, which a whole image decodes in place
+  ck_assert_int_eq(load_png("test_imgs/desert.png", &img), 0);
+  ck_assert_int_eq(load_png_region("test_imgs/desert.png", 0, 50, img->size_x,
+                                   30, &region),
+                   0);
+  ck_assert_uint_eq(region->size_x, img->size_x);
+  ck_assert_uint_eq(region->size_y, 30);
+  ck_assert_int_eq(memcmp(region->px, &img->px[50 * img->size_x],
+                          sizeof(struct pixel) * img->size_x * 30),
+                   0);
+
+  free(region->px);
+  free(region);
+  free(img->px);
+  free(img);
+}
+END_TEST
+
+START_TEST(load_scaled_image)
+{
+  struct image *img, *thumb;
+  struct png_load_opts opts = {.scale = 4};
+
+  ck_assert_int_eq(load_png("test_imgs/desert_rgb.png", &img), 0);
+  ck_assert_int_eq(load_png_ex("test_imgs/desert_rgb.png", &thumb, &opts), 0);
+  ck_assert_uint_eq(thumb->size_x, (img->size_x + 3) / 4);
+  ck_assert_uint_eq(thumb->size_y, (img->size_y + 3) / 4);
+
+  // Every pixel is the rounded average of its block
+  for (long y = 0; y < thumb->size_y; y++)
+  {
+    for (long x = 0; x < thumb->size_x; x++)
+    {
+      long sum[4] = {0}, count = 0;
+
+      for (long j = 4 * y; j < 4 * y + 4 && j < img->size_y; j++)
+      {
+        for (long i = 4 * x; i < 4 * x + 4 && i < img->size_x; i++)
+        {
+          sum[0] += img->px[j * img->size_x + i].red;
+          sum[1] += img->px[j * img->size_x + i].green;
+          sum[2] += img->px[j * img->size_x + i].blue;
+          sum[3] += img->px[j * img->size_x + i].alpha;
+          count++;
+        }
+      }
+
+      ck_assert_uint_eq(thumb->px[y * thumb->size_x + x].red,
+                        (sum[0] + count / 2) / count);
+      ck_assert_uint_eq(thumb->px[y * thumb->size_x + x].green,
+                        (sum[1] + count / 2) / count);
+      ck_assert_uint_eq(thumb->px[y * thumb->size_x + x].blue,
+                        (sum[2] + count / 2) / count);
+      ck_assert_uint_eq(thumb->px[y * thumb->size_x + x].alpha,
+                        (sum[3] + count / 2) / count);
+    }
+  }
+
+  free(thumb->px);
+  free(thumb);
+  free(img->px);
+  free(img);
+}
+END_TEST
+
+// Checks every row that the push decoder hands out against the image
+struct pushed_rows
+{
+  struct image *img;
+  uint32_t rows;
+  int mismatch;
+};
+
+int check_pushed_row(const struct pixel *row, uint32_t y,
+                     const struct png_info *info, void *arg)
+{
+  struct pushed_rows *pushed = arg;
+
+  if (y != pushed->rows++ || info->width != pushed->img->size_x ||
+      memcmp(row, pushed->img->px + y * info->width,
+             sizeof(struct pixel) * info->width))
+  {
+    pushed->mismatch = 1;
+  }
+  return 0;
+}
+
+START_TEST(push_image_in_slices)
+{
+  struct image *img;
+  struct png_push_decoder *dec;
+  struct pushed_rows pushed = {0};
+  FILE *file = fopen("test_imgs/desert_rgb.png", "rb");
+  uint8_t *buf;
+  long len;
+
+  ck_assert_ptr_ne(file, NULL);
+  fseek(file, 0, SEEK_END);
+  len = ftell(file);
+  rewind(file);
+  buf = malloc(len);
+  ck_assert_int_eq(fread(buf, 1, len, file), len);
+  fclose(file);
+
+  ck_assert_int_eq(load_png("test_imgs/desert_rgb.png", &img), 0);
+  pushed.img = img;
+
+  // Slices of 5 bytes split the signature, chunk headers and CRCs
+  ck_assert_int_eq(png_decoder_open(&dec, check_pushed_row, &pushed), 0);
+  for (long off = 0; off < len; off += 5)
+  {
+    long slice = len - off < 5 ? len - off : 5;
+
+    ck_assert_int_eq(png_decoder_push(dec, buf + off, slice), 0);
+  }
+  ck_assert_int_eq(png_decoder_close(dec), 0);
+  ck_assert_int_eq(pushed.mismatch, 0);
+  ck_assert_uint_eq(pushed.rows, img->size_y);
+
+  // A file that stops early is not complete
+  ck_assert_int_eq(png_decoder_open(&dec, NULL, NULL), 0);
+  ck_assert_int_eq(png_decoder_push(dec, buf, len / 2), 0);
+  ck_assert_int_ne(png_decoder_close(dec), 0);
+
+  free(img->px);
+  free(img);
+  free(buf);
+}
+END_TEST
+
+START_TEST(load_image_pipelined)
+{
+  struct image *img, *img_pipelined;
+  struct png_load_opts opts = {.pipeline = 1};
+
+  ck_assert_int_eq(load_png("test_imgs/desert_rgb.png", &img), 0);
+  ck_assert_int_eq(
+      load_png_ex("test_imgs/desert_rgb.png", &img_pipelined, &opts), 0);
+
+  ck_assert_uint_eq(img_pipelined->size_x, img->size_x);
+  ck_assert_uint_eq(img_pipelined->size_y, img->size_y);
+  ck_assert_int_eq(memcmp(img_pipelined->px, img->px,
+                          sizeof(struct pixel) * img->size_x * img->size_y),
+                   0);
+
+  free(img_pipelined->px);
+  free(img_pipelined);
+  free(img->px);
+  free(img);
+}
+END_TEST
+
+START_TEST(reuse_codec_context)
+{
+  struct image *img, *img_ctx, *img_stored;
+  struct png_codec_ctx *ctx = png_codec_ctx_create();
+  char path[] = "/tmp/codec_ctx_XXXXXX";
+  int fd = mkstemp(path);
+
+  ck_assert_ptr_ne(ctx, NULL);
+  ck_assert_int_ne(fd, -1);
+  close(fd);
+
+  ck_assert_int_eq(load_png("test_imgs/desert_rgb.png", &img), 0);
+
+  // The second round runs on the state that the first one left behind
+  for (int round = 0; round < 2; round++)
+  {
+    ck_assert_int_eq(load_png_ctx("test_imgs/desert_rgb.png", &img_ctx, ctx),
+                     0);
+    ck_assert_int_eq(store_png_ctx(path, img_ctx, NULL, 0, ctx), 0);
+    ck_assert_int_eq(load_png_ctx(path, &img_stored, ctx), 0);
+
+    ck_assert_uint_eq(img_stored->size_x, img->size_x);
+    ck_assert_uint_eq(img_stored->size_y, img->size_y);
+    ck_assert_int_eq(memcmp(img_ctx->px, img->px,
+                            sizeof(struct pixel) * img->size_x * img->size_y),
+                     0);
+    ck_assert_int_eq(memcmp(img_stored->px, img->px,
+                            sizeof(struct pixel) * img->size_x * img->size_y),
+                     0);
+
+    free(img_stored->px);
+    free(img_stored);
+    free(img_ctx->px);
+    free(img_ctx);
+  }
+
+  unlink(path);
+  png_codec_ctx_destroy(ctx);
+  free(img->px);
+  free(img);
+}
+END_TEST
+
+START_TEST(store_filtered_image)
+{
+  struct image *img, *img_stored;
+  char path[] = "/tmp/filtered_XXXXXX";
+  int fd = mkstemp(path);
+
+  ck_assert_int_ne(fd, -1);
+  close(fd);
+
+  ck_assert_int_eq(load_png("test_imgs/desert_rgb.png", &img), 0);
+
+  // Rows are filtered against the row above, except at the top of a band.
+  // Bands taller than the image hold all of it.
+  uint32_t band_rows[] = {0, 7, 1073474};
+
+  for (size_t idx = 0; idx < sizeof(band_rows) / sizeof(band_rows[0]); idx++)
+  {
+    ck_assert_int_eq(store_png_banded(path, img, NULL, 0, band_rows[idx]), 0);
+    ck_assert_int_eq(load_png(path, &img_stored), 0);
+
+    ck_assert_uint_eq(img_stored->size_x, img->size_x);
+    ck_assert_uint_eq(img_stored->size_y, img->size_y);
+    ck_assert_int_eq(memcmp(img_stored->px, img->px,
+                            sizeof(struct pixel) * img->size_x * img->size_y),
+                     0);
+
+    free(img_stored->px);
+    free(img_stored);
+  }
+
+  unlink(path);
+  free(img->px);
+  free(img);
+}
+END_TEST
+
+START_TEST(store_with_deflate_options)
+{
+  struct image *img, *img_stored;
+  struct png_codec_ctx *ctx = png_codec_ctx_create();
+  struct png_store_opts opts[] = {
+      {9, Z_DEFAULT_STRATEGY, 0, 0, NULL},
+      {0, Z_RLE, 0, 0, NULL},
+      {-1, Z_DEFAULT_STRATEGY, 0, 0, NULL},
+      {6, Z_HUFFMAN_ONLY, 1, 9, NULL},
+      {6, Z_FILTERED, 9, 15, NULL},
+  };
+  size_t count = sizeof(opts) / sizeof(opts[0]);
+  struct png_store_opts bad = {10, Z_DEFAULT_STRATEGY, 0, 0, NULL};
+  char path[] = "/tmp/deflate_XXXXXX";
+  int fd = mkstemp(path);
+
+  ck_assert_ptr_ne(ctx, NULL);
+  ck_assert_int_ne(fd, -1);
+  close(fd);
+
+  ck_assert_int_eq(load_png("test_imgs/desert_rgb.png", &img), 0);
+
+  // The second time around, every store changes the parameters of ctx
+  for (size_t idx = 0; idx < 2 * count; idx++)
+  {
+    struct png_store_opts store_opts = opts[idx % count];
+
+    store_opts.ctx = idx < count ? NULL : ctx;
+    ck_assert_int_eq(store_png_ex(path, img, NULL, 0, &store_opts), 0);
+    ck_assert_int_eq(load_png(path, &img_stored), 0);
+
+    ck_assert_uint_eq(img_stored->size_x, img->size_x);
+    ck_assert_uint_eq(img_stored->size_y, img->size_y);
+    ck_assert_int_eq(memcmp(img_stored->px, img->px,
+                            sizeof(struct pixel) * img->size_x * img->size_y),
+                     0);
+
+    free(img_stored->px);
+    free(img_stored);
+  }
+
+  ck_assert_int_ne(store_png_ex(path, img, NULL, 0, &bad), 0);
+  bad.ctx = ctx;
+  ck_assert_int_ne(store_png_ex(path, img, NULL, 0, &bad), 0);
+  ck_assert_int_eq(store_png_ctx(path, img, NULL, 0, ctx), 0);
+
+  unlink(path);
+  png_codec_ctx_destroy(ctx);
+  free(img->px);
+  free(img);
+}
+END_TEST
+
+START_TEST(store_on_several_threads)
+{
+  struct image *img, *img_stored;
+  struct png_store_opts opts = {0};
+  char path[] = "/tmp/threads_XXXXXX";
+  int fd = mkstemp(path);
+  int threads[] = {2, 3, 0};
+  uint8_t *single, *several;
+  long single_len, several_len;
+
+  ck_assert_int_ne(fd, -1);
+  close(fd);
+
+  // Large enough to be deflated in several blocks
+  ck_assert_int_eq(load_png("test_imgs/summer.png", &img), 0);
+
+  opts.threads = 1;
+  ck_assert_int_eq(store_png_ex(path, img, NULL, 0, &opts), 0);
+  single_len = read_stored_file(path, &single);
+
+  for (size_t idx = 0; idx < sizeof(threads) / sizeof(threads[0]); idx++)
+  {
+    opts.threads = threads[idx];
+    ck_assert_int_eq(store_png_ex(path, img, NULL, 0, &opts), 0);
+    several_len = read_stored_file(path, &several);
+
+    ck_assert_int_eq(several_len, single_len);
+    ck_assert_int_eq(memcmp(several, single, single_len), 0);
+    free(several);
+  }
+
+  ck_assert_int_eq(load_png(path, &img_stored), 0);
+  ck_assert_uint_eq(img_stored->size_x, img->size_x);
+  ck_assert_uint_eq(img_stored->size_y, img->size_y);
+  ck_assert_int_eq(memcmp(img_stored->px, img->px,
+                          sizeof(struct pixel) * img->size_x * img->size_y),
+                   0);
+
+  unlink(path);
+  free(single);
+  free(img_stored->px);
+  free(img_stored);
+  free(img->px);
+  free(img);
+}
+END_TEST
+
+START_TEST(write_image_row_by_row)
+{
+  struct image *img, *img_stored;
+  struct png_writer *writer;
+  struct png_store_opts opts = {0};
+  char path[] = "/tmp/writer_XXXXXX";
+  int fd = mkstemp(path);
+
+  ck_assert_int_ne(fd, -1);
+  close(fd);
+
+  ck_assert_int_eq(load_png("test_imgs/desert_rgb.png", &img), 0);
+
+  // Small chunks make the writer emit many of them while rows come in
+  opts.idat_size = 1000;
+  ck_assert_int_eq(
+      png_writer_begin(&writer, path, img->size_x, img->size_y, &opts), 0);
+  for (uint32_t y = 0; y < img->size_y; y += 7)
+  {
+    uint32_t count = img->size_y - y < 7 ? img->size_y - y : 7;
+
+    ck_assert_int_eq(png_writer_write_rows(
+                         writer, &img->px[(size_t)y * img->size_x], count),
+                     0);
+  }
+  ck_assert_int_ne(png_writer_write_rows(writer, img->px, 1), 0);
+  ck_assert_int_ne(png_writer_end(writer), 0);
+
+  ck_assert_int_eq(
+      png_writer_begin(&writer, path, img->size_x, img->size_y, &opts), 0);
+  ck_assert_int_eq(png_writer_write_rows(writer, img->px, img->size_y), 0);
+  ck_assert_int_eq(png_writer_end(writer), 0);
+
+  ck_assert_int_eq(load_png(path, &img_stored), 0);
+  ck_assert_uint_eq(img_stored->size_x, img->size_x);
+  ck_assert_uint_eq(img_stored->size_y, img->size_y);
+  ck_assert_int_eq(memcmp(img_stored->px, img->px,
+                          sizeof(struct pixel) * img->size_x * img->size_y),
+                   0);
+
+  // A file with missing rows is not finished
+  ck_assert_int_eq(
+      png_writer_begin(&writer, path, img->size_x, img->size_y, NULL), 0);
+  ck_assert_int_eq(png_writer_write_rows(writer, img->px, 1), 0);
+  ck_assert_int_ne(png_writer_end(writer), 0);
+
+  unlink(path);
+  free(img_stored->px);
+  free(img_stored);
+  free(img->px);
+  free(img);
+}
+END_TEST
+
+START_TEST(store_auto_palette)
+{
+  struct image img = {64, 64, malloc(64 * 64 * sizeof(struct pixel))};
+  struct image *img_stored;
+  struct png_store_opts opts = {0};
+  struct pixel colors[] = {{0xff, 0, 0, 0xff},
+                           {0, 0xff, 0, 0x80},
+                           {0, 0, 0xff, 0xff},
+                           {0, 0, 0xff, 0}};
+  char path[] = "/tmp/auto_palette_XXXXXX";
+  int fd = mkstemp(path);
+  uint8_t *rgba, *palette;
+  long rgba_len, palette_len;
+
+  ck_assert_int_ne(fd, -1);
+  close(fd);
+
+  // Colors that only differ in alpha get entries of their own
+  for (uint32_t idx = 0; idx < 64 * 64; idx++)
+  {
+    img.px[idx] = colors[(idx / 5 + idx / 64) % 4];
+  }
+
+  ck_assert_int_eq(store_png(path, &img, NULL, 0), 0);
+  rgba_len = read_stored_file(path, &rgba);
+
+  opts.auto_palette = 1;
+  ck_assert_int_eq(store_png_ex(path, &img, NULL, 0, &opts), 0);
+  palette_len = read_stored_file(path, &palette);
+  ck_assert_int_lt(palette_len, rgba_len);
+
+  ck_assert_int_eq(load_png(path, &img_stored), 0);
+  ck_assert_uint_eq(img_stored->size_x, img.size_x);
+  ck_assert_uint_eq(img_stored->size_y, img.size_y);
+  ck_assert_int_eq(memcmp(img_stored->px, img.px,
+                          sizeof(struct pixel) * img.size_x * img.size_y),
+                   0);
+
+  unlink(path);
+  free(rgba);
+  free(palette);
+  free(img_stored->px);
+  free(img_stored);
+  free(img.px);
+}
+END_TEST
+
 int main()
 {
   Suite *s = suite_create("lib-Y0l0 tests");
@@ -871,6 +1971,33 @@ int main()
   tcase_add_loop_test(tc2, edge_example_image, 0, sizeof(edge_deserts) / sizeof(edge_deserts[0]));
   tcase_add_test(tc2, edge_checkerboard);
   tcase_add_test(tc2, keying_functionality);
+  tcase_add_test(tc2, reader_rows_match_load);
+  tcase_add_test(tc2, reader_rejects_bad_crc);
+  tcase_add_test(tc2, load_filtered_image);
+  tcase_add_test(tc2, load_rgb_image);
+  tcase_add_test(tc2, load_interlaced_image);
+  tcase_add_test(tc2, load_interlaced_preview);
+  tcase_add_test(tc2, probe_metadata);
+  tcase_add_test(tc2, load_banded_image);
+  tcase_add_test(tc2, load_banded_image_with_bad_checksum);
+  tcase_add_test(tc2, load_image_from_memory);
+  tcase_add_test(tc2, load_batch_of_images);
+  tcase_add_test(tc2, load_batch_with_pipe);
+  tcase_add_test(tc2, load_with_crc_modes);
+  tcase_add_test(tc2, load_through_arena);
+  tcase_add_test(tc2, load_image_into_view);
+  tcase_add_test(tc2, skip_unused_metadata);
+  tcase_add_test(tc2, load_image_region);
+  tcase_add_test(tc2, load_scaled_image);
+  tcase_add_test(tc2, push_image_in_slices);
+  tcase_add_test(tc2, load_image_pipelined);
+  tcase_add_test(tc2, reuse_codec_context);
+  tcase_add_test(tc2, store_filtered_image);
+  tcase_add_test(tc2, store_with_deflate_options);
+  tcase_add_test(tc2, store_on_several_threads);
+  tcase_add_test(tc2, write_image_row_by_row);
+  tcase_add_test(tc2, store_auto_palette);
+  tcase_add_test(tc2, load_banded_image_from_pipe);
 
   SRunner *sr = srunner_create(s);
   srunner_run_all(sr, CK_VERBOSE);
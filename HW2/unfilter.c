@@ -0,0 +1,364 @@
+/* Reversing the PNG scanline filters.
+ *
+ * See https://www.w3.org/TR/png/#9Filters for the definition of the filters.
+ * Every filter predicts a byte from a (the byte bpp positions to the left),
+ * b (the byte above) and c (the byte above a). Up only depends on the
+ * previous scanline, so it vectorizes over the whole row. Sub is a running sum
+ * per channel, which we compute as a prefix sum over whole registers. Average
+ * and Paeth feed every reconstructed pixel into the prediction of the next
+ * one, so their SIMD versions work on all channels of one pixel at a time.
+ *
+ * The fastest kernels the CPU supports are picked the first time a scanline is
+ * unfiltered.
+ */
+#include "unfilter.h"
+#include "predictor.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define UNFILTER_X86 1
+#include <immintrin.h>
+#endif
+
+/* Kernels for one filter type. prev is never NULL. */
+struct unfilter_kernels {
+  void (*sub)(uint8_t *row, uint32_t length, uint32_t bpp);
+  void (*up)(uint8_t *row, const uint8_t *prev, uint32_t length);
+  void (*average)(uint8_t *row, const uint8_t *prev, uint32_t length,
+                  uint32_t bpp);
+  void (*paeth)(uint8_t *row, const uint8_t *prev, uint32_t length,
+                uint32_t bpp);
+};
+
+static struct unfilter_kernels kernels;
+
+/* The kernels are selected once, by whichever thread needs them first */
+static pthread_once_t kernels_selected = PTHREAD_ONCE_INIT;
+
+static void unfilter_sub_scalar(uint8_t *row, uint32_t length, uint32_t bpp) {
+  for (uint32_t i = bpp; i < length; i++) {
+    row[i] += row[i - bpp];
+  }
+}
+
+static void unfilter_up_scalar(uint8_t *row, const uint8_t *prev,
+                               uint32_t length) {
+  for (uint32_t i = 0; i < length; i++) {
+    row[i] += prev[i];
+  }
+}
+
+static void unfilter_average_scalar(uint8_t *row, const uint8_t *prev,
+                                    uint32_t length, uint32_t bpp) {
+  uint32_t i;
+
+  for (i = 0; i < bpp && i < length; i++) {
+    row[i] += prev[i] >> 1;
+  }
+
+  for (; i < length; i++) {
+    row[i] += (row[i - bpp] + prev[i]) >> 1;
+  }
+}
+
+/* Average on the first scanline, where b is 0 */
+static void unfilter_average_first(uint8_t *row, uint32_t length,
+                                   uint32_t bpp) {
+  for (uint32_t i = bpp; i < length; i++) {
+    row[i] += row[i - bpp] >> 1;
+  }
+}
+
+static void unfilter_paeth_scalar(uint8_t *row, const uint8_t *prev,
+                                  uint32_t length, uint32_t bpp) {
+  uint32_t i;
+
+  for (i = 0; i < bpp && i < length; i++) {
+    row[i] += prev[i];
+  }
+
+  for (; i < length; i++) {
+    row[i] += paeth_predictor(row[i - bpp], prev[i], prev[i - bpp]);
+  }
+}
+
+#ifdef UNFILTER_X86
+
+/* Load and store the bpp bytes of one pixel without touching its neighbors */
+static inline __m128i load_pixel(const uint8_t *p, uint32_t bpp) {
+  uint64_t v = 0;
+
+  switch (bpp) {
+  case 3:
+    memcpy(&v, p, 3);
+    break;
+  case 4:
+    memcpy(&v, p, 4);
+    break;
+  case 6:
+    memcpy(&v, p, 6);
+    break;
+  default:
+    memcpy(&v, p, 8);
+    break;
+  }
+
+  return _mm_loadl_epi64((const __m128i *)&v);
+}
+
+static inline void store_pixel(uint8_t *p, __m128i x, uint32_t bpp) {
+  uint64_t v;
+
+  _mm_storel_epi64((__m128i *)&v, x);
+
+  switch (bpp) {
+  case 3:
+    memcpy(p, &v, 3);
+    break;
+  case 4:
+    memcpy(p, &v, 4);
+    break;
+  case 6:
+    memcpy(p, &v, 6);
+    break;
+  default:
+    memcpy(p, &v, 8);
+    break;
+  }
+}
+
+static void unfilter_up_sse2(uint8_t *row, const uint8_t *prev,
+                             uint32_t length) {
+  uint32_t i = 0;
+
+  for (; i + 16 <= length; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(row + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(prev + i));
+    _mm_storeu_si128((__m128i *)(row + i), _mm_add_epi8(x, b));
+  }
+
+  unfilter_up_scalar(row + i, prev + i, length - i);
+}
+
+/* Prefix sum of the pixels of one register, plus the last pixel of the
+ * previous register (already broadcast into carry) */
+#define SUB_PREFIX_SSE2(x, carry, bpp)                                         \
+  do {                                                                         \
+    if ((bpp) <= 1)                                                            \
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 1));                               \
+    if ((bpp) <= 2)                                                            \
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 2));                               \
+    if ((bpp) <= 4)                                                            \
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 4));                               \
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 8));                                 \
+    x = _mm_add_epi8(x, carry);                                                \
+  } while (0)
+
+static void unfilter_sub_sse2(uint8_t *row, uint32_t length, uint32_t bpp) {
+  __m128i carry = _mm_setzero_si128();
+  uint32_t i = 0;
+
+  // Pixels that do not divide a register are summed up one by one
+  if (bpp != 1 && bpp != 2 && bpp != 4 && bpp != 8) {
+    unfilter_sub_scalar(row, length, bpp);
+    return;
+  }
+
+  for (; i + 16 <= length; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(row + i));
+
+    switch (bpp) {
+    case 1:
+      SUB_PREFIX_SSE2(x, carry, 1);
+      carry = _mm_set1_epi8(_mm_extract_epi16(x, 7) >> 8);
+      break;
+    case 2:
+      SUB_PREFIX_SSE2(x, carry, 2);
+      carry = _mm_set1_epi16(_mm_extract_epi16(x, 7));
+      break;
+    case 4:
+      SUB_PREFIX_SSE2(x, carry, 4);
+      carry = _mm_shuffle_epi32(x, 0xff);
+      break;
+    default:
+      SUB_PREFIX_SSE2(x, carry, 8);
+      carry = _mm_shuffle_epi32(x, 0xee);
+      break;
+    }
+
+    _mm_storeu_si128((__m128i *)(row + i), x);
+  }
+
+  // The rest continues from the last full register
+  for (i = i ? i : bpp; i < length; i++) {
+    row[i] += row[i - bpp];
+  }
+}
+
+static void unfilter_average_sse2(uint8_t *row, const uint8_t *prev,
+                                  uint32_t length, uint32_t bpp) {
+  __m128i a = _mm_setzero_si128();
+  uint32_t i;
+
+  if (bpp < 3) {
+    unfilter_average_scalar(row, prev, length, bpp);
+    return;
+  }
+
+  for (i = 0; i + bpp <= length; i += bpp) {
+    __m128i b = load_pixel(prev + i, bpp);
+    __m128i x = load_pixel(row + i, bpp);
+    a = _mm_add_epi8(x, average_floor(a, b));
+    store_pixel(row + i, a, bpp);
+  }
+}
+
+static void unfilter_paeth_sse2(uint8_t *row, const uint8_t *prev,
+                                uint32_t length, uint32_t bpp) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero;
+  uint32_t i;
+
+  if (bpp < 3) {
+    unfilter_paeth_scalar(row, prev, length, bpp);
+    return;
+  }
+
+  // Channels are widened to 16 bits, so a + b - c cannot overflow
+  for (i = 0; i + bpp <= length; i += bpp) {
+    __m128i b = _mm_unpacklo_epi8(load_pixel(prev + i, bpp), zero);
+    __m128i x = load_pixel(row + i, bpp);
+    __m128i predictor = paeth_epi16(a, b, c);
+
+    x = _mm_add_epi8(x, _mm_packus_epi16(predictor, predictor));
+    store_pixel(row + i, x, bpp);
+
+    a = _mm_unpacklo_epi8(x, zero);
+    c = b;
+  }
+}
+
+__attribute__((target("avx2"))) static void
+unfilter_up_avx2(uint8_t *row, const uint8_t *prev, uint32_t length) {
+  uint32_t i = 0;
+
+  for (; i + 32 <= length; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(row + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(prev + i));
+    _mm256_storeu_si256((__m256i *)(row + i), _mm256_add_epi8(x, b));
+  }
+
+  unfilter_up_sse2(row + i, prev + i, length - i);
+}
+
+/* The prefix sum works per 128-bit lane, so the last pixel of the low lane is
+ * carried into the high lane afterwards. last_pixel broadcasts the last pixel
+ * of every lane across that lane. */
+__attribute__((target("avx2"))) static void
+unfilter_sub_avx2(uint8_t *row, uint32_t length, uint32_t bpp) {
+  __m256i carry = _mm256_setzero_si256();
+  __m256i last_pixel;
+  uint8_t mask[16];
+  uint32_t i = 0;
+
+  if (bpp != 1 && bpp != 2 && bpp != 4 && bpp != 8) {
+    unfilter_sub_scalar(row, length, bpp);
+    return;
+  }
+
+  for (int j = 0; j < 16; j++) {
+    mask[j] = 16 - bpp + j % bpp;
+  }
+  last_pixel = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)mask));
+
+  for (; i + 32 <= length; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(row + i));
+    __m256i lanes;
+
+    if (bpp <= 1)
+      x = _mm256_add_epi8(x, _mm256_slli_si256(x, 1));
+    if (bpp <= 2)
+      x = _mm256_add_epi8(x, _mm256_slli_si256(x, 2));
+    if (bpp <= 4)
+      x = _mm256_add_epi8(x, _mm256_slli_si256(x, 4));
+    x = _mm256_add_epi8(x, _mm256_slli_si256(x, 8));
+
+    lanes = _mm256_shuffle_epi8(x, last_pixel);
+    x = _mm256_add_epi8(x, _mm256_permute2x128_si256(lanes, lanes, 0x08));
+    x = _mm256_add_epi8(x, carry);
+    _mm256_storeu_si256((__m256i *)(row + i), x);
+
+    lanes = _mm256_shuffle_epi8(x, last_pixel);
+    carry = _mm256_permute2x128_si256(lanes, lanes, 0x11);
+  }
+
+  for (i = i ? i : bpp; i < length; i++) {
+    row[i] += row[i - bpp];
+  }
+}
+
+#endif
+
+/* Pick the kernels for this CPU */
+static void select_unfilter_kernels(void) {
+  kernels.sub = unfilter_sub_scalar;
+  kernels.up = unfilter_up_scalar;
+  kernels.average = unfilter_average_scalar;
+  kernels.paeth = unfilter_paeth_scalar;
+
+#ifdef UNFILTER_X86
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("sse2")) {
+    kernels.sub = unfilter_sub_sse2;
+    kernels.up = unfilter_up_sse2;
+    kernels.average = unfilter_average_sse2;
+    kernels.paeth = unfilter_paeth_sse2;
+  }
+
+  if (__builtin_cpu_supports("avx2")) {
+    kernels.sub = unfilter_sub_avx2;
+    kernels.up = unfilter_up_avx2;
+  }
+#endif
+}
+
+int unfilter_scanline(uint8_t filter_type, uint8_t *scanline,
+                      const uint8_t *prev, uint32_t length, uint32_t bpp) {
+  pthread_once(&kernels_selected, select_unfilter_kernels);
+
+  switch (filter_type) {
+  case PNG_FILTER_TYPE_NONE:
+    return 0;
+
+  case PNG_FILTER_TYPE_SUB:
+    kernels.sub(scanline, length, bpp);
+    return 0;
+
+  // Above the first scanline everything is 0, so Up does nothing and Paeth
+  // always picks a
+  case PNG_FILTER_TYPE_UP:
+    if (prev)
+      kernels.up(scanline, prev, length);
+    return 0;
+
+  case PNG_FILTER_TYPE_AVERAGE:
+    if (prev)
+      kernels.average(scanline, prev, length, bpp);
+    else
+      unfilter_average_first(scanline, length, bpp);
+    return 0;
+
+  case PNG_FILTER_TYPE_PAETH:
+    if (prev)
+      kernels.paeth(scanline, prev, length, bpp);
+    else
+      kernels.sub(scanline, length, bpp);
+    return 0;
+
+  default:
+    return 1;
+  }
+}
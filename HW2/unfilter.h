@@ -0,0 +1,23 @@
+#ifndef UNFILTER_H
+#define UNFILTER_H
+
+#include <stdint.h>
+
+#define PNG_FILTER_TYPE_NONE 0
+#define PNG_FILTER_TYPE_SUB 1
+#define PNG_FILTER_TYPE_UP 2
+#define PNG_FILTER_TYPE_AVERAGE 3
+#define PNG_FILTER_TYPE_PAETH 4
+
+/* Undo the PNG filter of one scanline in place. The scanline comprises length
+ * bytes without the filter byte, bpp is the number of bytes per pixel (at
+ * least 1). prev is the previous scanline after its own filter was undone, or
+ * NULL for the first scanline.
+ *
+ * This function returns 0 on success and a non-zero value for an unknown
+ * filter type.
+ */
+int unfilter_scanline(uint8_t filter_type, uint8_t *scanline,
+                      const uint8_t *prev, uint32_t length, uint32_t bpp);
+
+#endif
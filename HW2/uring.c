@@ -0,0 +1,207 @@
+/* Raw io_uring plumbing.
+ *
+ * The kernel shares two rings with us: we produce submissions at the tail of
+ * the SQ ring and it consumes them at the head, it produces completions at the
+ * tail of the CQ ring and we consume them at the head. Indices only grow and
+ * are masked into the rings. Whoever produces publishes the tail with a
+ * release store after the entry is written, whoever consumes reads it with an
+ * acquire load.
+ */
+#include "uring.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int setup_uring(struct uring *ring, unsigned entries) {
+  struct io_uring_params params;
+  uint8_t *sq_ring, *cq_ring;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+
+  ring->fd = io_uring_setup(entries, &params);
+  if (ring->fd < 0) {
+    return 1;
+  }
+
+  ring->sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  // Newer kernels map both rings with a single mapping
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+      ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = 0;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    goto error;
+  }
+
+  if (ring->cq_ring_size) {
+    ring->cq_ring =
+        mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      goto error;
+    }
+  }
+
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto error;
+  }
+
+  sq_ring = ring->sq_ring;
+  cq_ring = ring->cq_ring ? ring->cq_ring : ring->sq_ring;
+
+  ring->sq_head = (unsigned *)(sq_ring + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq_ring + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(sq_ring + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+
+  ring->cq_head = (unsigned *)(cq_ring + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq_ring + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq_ring + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+
+  return 0;
+
+error:
+  close_uring(ring);
+  return 1;
+}
+
+void close_uring(struct uring *ring) {
+  if (ring->sqes) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+
+  if (ring->cq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+
+  if (ring->sq_ring) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+
+  close(ring->fd);
+}
+
+int has_uring_ops(struct uring *ring, const uint8_t *ops, size_t count) {
+  struct io_uring_probe *probe;
+  size_t size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+  int supported = 0;
+
+  probe = calloc(1, size);
+  if (!probe) {
+    return 0;
+  }
+
+  // Kernels without the probe came before most of the opcodes
+  if (io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+    goto out;
+  }
+
+  for (size_t idx = 0; idx < count; idx++) {
+    if (ops[idx] > probe->last_op || ops[idx] >= probe->ops_len ||
+        !(probe->ops[ops[idx]].flags & IO_URING_OP_SUPPORTED)) {
+      goto out;
+    }
+  }
+  supported = 1;
+
+out:
+  free(probe);
+  return supported;
+}
+
+struct io_uring_sqe *get_uring_sqe(struct uring *ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *ring->sq_tail + ring->sq_pending;
+  struct io_uring_sqe *sqe;
+
+  if (tail - head > ring->sq_mask) {
+    return NULL;
+  }
+
+  sqe = &ring->sqes[tail & ring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+  ring->sq_pending++;
+  return sqe;
+}
+
+unsigned get_uring_sq_space(struct uring *ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *ring->sq_tail + ring->sq_pending;
+
+  return ring->sq_mask + 1 - (tail - head);
+}
+
+int submit_uring(struct uring *ring, unsigned wait_nr) {
+  unsigned to_submit = ring->sq_pending;
+  unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + to_submit,
+                   __ATOMIC_RELEASE);
+  ring->sq_pending = 0;
+
+  for (;;) {
+    int ret = io_uring_enter(ring->fd, to_submit, wait_nr, flags);
+
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+
+    // The kernel may take fewer entries than offered, the rest stay queued
+    if ((unsigned)ret >= to_submit) {
+      return 0;
+    }
+    to_submit -= ret;
+  }
+}
+
+int reap_uring_cqe(struct uring *ring, struct io_uring_cqe *cqe) {
+  unsigned head = *ring->cq_head;
+
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return 1;
+  }
+
+  *cqe = ring->cqes[head & ring->cq_mask];
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A minimal io_uring, set up with the raw system calls, so it runs on a stock
+ * kernel without liburing.
+ *
+ * Requests are queued with get_uring_sqe, which returns a zeroed submission
+ * entry or NULL if the submission queue is full, and handed to the kernel by
+ * submit_uring. reap_uring_cqe copies the next completion into cqe.
+ */
+struct uring {
+  int fd;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sq_pending; // Queued, but not handed to the kernel yet
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+};
+
+/* setup_uring returns 0 on success and a non-zero value if the kernel does
+ * not provide io_uring, or does not let us use it. */
+int setup_uring(struct uring *ring, unsigned entries);
+void close_uring(struct uring *ring);
+
+/* Does the kernel support each of the count opcodes in ops? io_uring came
+ * out before most of them. */
+int has_uring_ops(struct uring *ring, const uint8_t *ops, size_t count);
+
+struct io_uring_sqe *get_uring_sqe(struct uring *ring);
+
+/* The number of entries get_uring_sqe can still hand out */
+unsigned get_uring_sq_space(struct uring *ring);
+
+/* Submit the queued entries and wait until at least wait_nr completions are
+ * available. Returns 0 on success and a non-zero value on failure. */
+int submit_uring(struct uring *ring, unsigned wait_nr);
+
+/* Returns 0 if a completion was reaped and a non-zero value if there is none */
+int reap_uring_cqe(struct uring *ring, struct io_uring_cqe *cqe);
+
+#endif